@@ -0,0 +1,78 @@
+/*
+ * batch_bench - batch loading throughput by worker count
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Build:
+ *   cmake -S . -B build && cmake --build build
+ *
+ * Usage:
+ *   batch_bench [-n copies] [-w max_workers] session.ptx...
+ *
+ * Loads copies repetitions of the given sessions with PTFBatchLoader at 1, 2,
+ * 4, ... workers up to max_workers (by default the hardware thread count) and
+ * prints the throughput of each run and its speedup over one worker.
+ */
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ptformat/batchloader.h"
+
+int
+main(int argc, char **argv) {
+    int copies = 64;
+    unsigned max_workers = std::max(1u, std::thread::hardware_concurrency());
+    int first = 1;
+
+    while (first + 1 < argc && argv[first][0] == '-') {
+        if (strcmp(argv[first], "-n") == 0) {
+            copies = atoi(argv[first + 1]);
+        } else if (strcmp(argv[first], "-w") == 0) {
+            max_workers = std::max(1, atoi(argv[first + 1]));
+        } else {
+            break;
+        }
+        first += 2;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: %s [-n copies] [-w max_workers] session.ptx...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> paths;
+    for (int c = 0; c < copies; c++) {
+        paths.insert(paths.end(), argv + first, argv + argc);
+    }
+
+    double base = 0;
+    int ret = 0;
+    for (unsigned workers = 1;; workers = std::min(workers * 2, max_workers)) {
+        PTFBatchLoader loader(workers);
+        loader.load(paths, [](size_t, PTFBatchLoader::result_t&) {});
+        const PTFBatchLoader::stats_t& stats = loader.stats();
+
+        if (workers == 1) {
+            base = stats.sessions_per_sec();
+        }
+        ret |= stats.failed != 0;
+        printf("workers=%u sessions=%llu failed=%llu bytes=%llu secs=%.4f sessions_per_s=%.1f mb_per_s=%.2f speedup=%.2f\n",
+               workers, (unsigned long long)stats.sessions, (unsigned long long)stats.failed,
+               (unsigned long long)stats.bytes, stats.wall_secs, stats.sessions_per_sec(), stats.mb_per_sec(),
+               base > 0 ? stats.sessions_per_sec() / base : 0.);
+        if (workers == max_workers) {
+            break;
+        }
+    }
+    return ret;
+}
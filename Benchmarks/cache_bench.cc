@@ -0,0 +1,92 @@
+/*
+ * cache_bench - cold session load versus parse cache hit
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Build:
+ *   c++ -std=c++20 -O2 -I../Sources/PtFormatObjC cache_bench.cc ../Sources/PtFormatObjC/ptfcache.cc ../Sources/PtFormatObjC/ptformat.cc -o cache_bench
+ *
+ * Usage:
+ *   cache_bench [-n iterations] session.ptx...
+ *
+ * Writes a cache next to each session (session.ptx.ptfcache) and compares the
+ * best time of load() followed by region_ranges() with that of opening the
+ * cache and reading its region ranges, with and without hashing the session.
+ */
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "ptformat/ptfcache.h"
+
+template <class F>
+static double
+best_ms(int iterations, F run) {
+    double best = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        if (i == 0 || secs.count() < best) {
+            best = secs.count();
+        }
+    }
+    return best * 1e3;
+}
+
+int
+main(int argc, char **argv) {
+    int iterations = 20;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: %s [-n iterations] session.ptx...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = first; i < argc; i++) {
+        std::string cache_path = std::string(argv[i]) + ".ptfcache";
+        PTFFormat ptf;
+        PTFCache cache;
+        uint64_t ranges = 0;
+        int result = 0;
+
+        if (ptf.load(argv[i]) != 0 || PTFCache::write(ptf, cache_path) != 0) {
+            fprintf(stderr, "%s: cannot load session or write cache\n", argv[i]);
+            continue;
+        }
+
+        double load_ms = best_ms(iterations, [&]() {
+            PTFFormat p;
+            result = p.load(argv[i]);
+            ranges = p.region_ranges().size();
+        });
+        double hit_ms = best_ms(iterations, [&]() {
+            result |= cache.open(cache_path, argv[i]);
+            ranges = cache.region_ranges().size();
+        });
+        double hit_hash_ms = best_ms(iterations, [&]() {
+            result |= cache.open(cache_path, argv[i], true);
+            ranges = cache.region_ranges().size();
+        });
+
+        printf("session=%s result=%d bytes=%llu ranges=%llu load_ms=%.3f hit_ms=%.3f hit_hash_ms=%.3f speedup=%.1f\n",
+               argv[i], result, (unsigned long long)ptf.unxored_size(), (unsigned long long)ranges,
+               load_ms, hit_ms, hit_hash_ms, hit_ms > 0 ? load_ms / hit_ms : 0.);
+        remove(cache_path.c_str());
+    }
+    return 0;
+}
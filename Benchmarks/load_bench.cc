@@ -0,0 +1,195 @@
+/*
+ * load_bench - session load time per parse stage, as JSON
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Build:
+ *   cmake -S . -B build && cmake --build build
+ *
+ * Usage:
+ *   load_bench [-n iterations] [session.ptx | directory]...
+ *
+ * Loads every session given, or every file in the given directories (by default
+ * the test fixtures), and prints one JSON document with the best and mean load
+ * time of each session, the mean time of each parse stage, throughput, the load
+ * statistics of the session and the number of allocations made by one load.
+ * Allocations are counted by replacing the global operator new, so the malloc()
+ * holding the session is not included.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "ptformat/ptformat.h"
+
+#ifndef PTF_FIXTURES_DIR
+# define PTF_FIXTURES_DIR "../Tests/PtFormatObjCTests/Resources"
+#endif
+
+static std::atomic<uint64_t> alloc_count(0);
+static std::atomic<uint64_t> alloc_bytes(0);
+
+void*
+operator new(size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void *p) noexcept {
+    free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+struct result_t {
+    std::string path;
+    int result;
+    uint64_t bytes;
+    double best_ms;
+    double mean_ms;
+    double stage_ms[PTFFormat::STAGE_COUNT];
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    PTFFormat::load_stats_t stats;
+};
+
+static void
+print_json_string(const std::string& s) {
+    putchar('"');
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static result_t
+run(const std::string& path, int iterations) {
+    result_t r = { path, 0, 0, 0, 0, {}, 0, 0, {} };
+    double total = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        PTFFormat ptf;
+        uint64_t count = alloc_count.load();
+        uint64_t bytes = alloc_bytes.load();
+        auto start = std::chrono::steady_clock::now();
+        r.result = ptf.load(path, PTFFormat::LOAD_MMAP, PTFFormat::PARSE_ALL, &r.stats);
+        std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+        r.allocs = alloc_count.load() - count;
+        r.alloc_bytes = alloc_bytes.load() - bytes;
+        r.bytes = r.stats.bytes;
+        if (i == 0 || secs.count() < r.best_ms) {
+            r.best_ms = secs.count();
+        }
+        total += secs.count();
+        for (int s = 0; s < PTFFormat::STAGE_COUNT; s++) {
+            r.stage_ms[s] += r.stats.stage_ns[s] / 1e6 / iterations;
+        }
+    }
+    r.best_ms *= 1e3;
+    r.mean_ms = total * 1e3 / iterations;
+    return r;
+}
+
+int
+main(int argc, char **argv) {
+    int iterations = 20;
+    int first = 1;
+    std::vector<std::string> paths;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = std::max(1, atoi(argv[2]));
+        first = 3;
+    }
+
+    std::vector<std::string> args(argv + first, argv + argc);
+    if (args.empty()) {
+        args.push_back(PTF_FIXTURES_DIR);
+    }
+    for (const std::string& arg : args) {
+        std::error_code ec;
+        if (std::filesystem::is_directory(arg, ec)) {
+            std::vector<std::string> files;
+            for (const auto& entry : std::filesystem::directory_iterator(arg, ec)) {
+                if (entry.is_regular_file(ec)) {
+                    files.push_back(entry.path().string());
+                }
+            }
+            std::sort(files.begin(), files.end());
+            paths.insert(paths.end(), files.begin(), files.end());
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()) {
+        fprintf(stderr, "usage: %s [-n iterations] [session.ptx | directory]...\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t total_bytes = 0;
+    double total_best_ms = 0;
+    int failed = 0;
+
+    printf("{\n  \"iterations\": %d,\n  \"sessions\": [\n", iterations);
+    for (size_t i = 0; i < paths.size(); i++) {
+        result_t r = run(paths[i], iterations);
+
+        total_bytes += r.bytes;
+        total_best_ms += r.best_ms;
+        failed += r.result != 0;
+
+        printf("    {\"path\": ");
+        print_json_string(r.path);
+        printf(", \"result\": %d, \"bytes\": %llu, \"best_ms\": %.4f, \"mean_ms\": %.4f, "
+               "\"mb_per_s\": %.2f, \"sessions_per_s\": %.1f, \"allocs\": %llu, \"alloc_bytes\": %llu,\n     ",
+               r.result, (unsigned long long)r.bytes, r.best_ms, r.mean_ms,
+               r.best_ms > 0 ? r.bytes / 1e6 / (r.best_ms / 1e3) : 0.,
+               r.best_ms > 0 ? 1e3 / r.best_ms : 0.,
+               (unsigned long long)r.allocs, (unsigned long long)r.alloc_bytes);
+        printf("\"blocks\": %llu, \"max_depth\": %u, \"block_probes\": %llu, \"search_bytes\": %llu, "
+               "\"wavs\": %llu, \"regions\": %llu, \"tracks\": %llu, \"midi_events\": %llu, \"heap_bytes\": %llu,\n"
+               "     \"stages_ms\": {",
+               (unsigned long long)r.stats.blocks, r.stats.max_depth, (unsigned long long)r.stats.block_probes,
+               (unsigned long long)r.stats.search_bytes, (unsigned long long)r.stats.wavs,
+               (unsigned long long)r.stats.regions, (unsigned long long)r.stats.tracks,
+               (unsigned long long)r.stats.midi_events, (unsigned long long)r.stats.heap_bytes);
+        for (int s = 0; s < PTFFormat::STAGE_COUNT; s++) {
+            printf("%s\"%s\": %.4f", s ? ", " : "",
+                   PTFFormat::load_stats_t::stage_name((PTFFormat::load_stage_t)s), r.stage_ms[s]);
+        }
+        printf("}}%s\n", i + 1 < paths.size() ? "," : "");
+    }
+    printf("  ],\n  \"total\": {\"sessions\": %zu, \"failed\": %d, \"bytes\": %llu, \"best_ms\": %.4f, "
+           "\"mb_per_s\": %.2f, \"sessions_per_s\": %.1f}\n}\n",
+           paths.size(), failed, (unsigned long long)total_bytes, total_best_ms,
+           total_best_ms > 0 ? total_bytes / 1e6 / (total_best_ms / 1e3) : 0.,
+           total_best_ms > 0 ? paths.size() * 1e3 / total_best_ms : 0.);
+    return failed ? 1 : 0;
+}
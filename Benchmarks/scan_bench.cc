@@ -0,0 +1,88 @@
+/*
+ * scan_bench - block scanner scaling with session size
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Build:
+ *   c++ -std=c++20 -O2 -I../Sources/PtFormatObjC scan_bench.cc ../Sources/PtFormatObjC/ptformat.cc -o scan_bench
+ *
+ * Usage:
+ *   scan_bench session.ptx [max_copies] [iterations]
+ *
+ * Synthesizes sessions of growing size by repeating the blocks of the given
+ * session, encrypts them again and loads them from memory. Load time and
+ * probes per byte should stay flat as the size grows. The "damaged" rows
+ * overwrite every 16th byte with a ZMARK to stress the candidate search.
+ */
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "ptformat/ptformat.h"
+
+static void
+run(const char *kind, const std::vector<unsigned char>& plain, int iterations) {
+    std::vector<unsigned char> data(plain);
+    double best = 0;
+    int result = 0;
+    PTFFormat ptf;
+
+    PTFFormat::unxor_range(&data[0x14], data.size() - 0x14, 0x14, data[0x12], data[0x13]);
+
+    for (int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        result = ptf.load_buffer(data.data(), data.size());
+        std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        if (i == 0 || secs.count() < best) {
+            best = secs.count();
+        }
+    }
+
+    printf("kind=%s bytes=%llu result=%d blocks=%llu probes=%llu probes_per_byte=%.3f ms=%.3f ns_per_byte=%.2f\n",
+           kind, (unsigned long long)data.size(), result,
+           (unsigned long long)ptf.block_arena().size(), (unsigned long long)ptf.block_probes(),
+           (double)ptf.block_probes() / data.size(), best * 1e3, best * 1e9 / data.size());
+}
+
+int
+main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s session.ptx [max_copies] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    int max_copies = argc > 2 ? atoi(argv[2]) : 256;
+    int iterations = argc > 3 ? atoi(argv[3]) : 5;
+    PTFFormat ptf;
+
+    if (ptf.load(argv[1]) != 0) {
+        fprintf(stderr, "%s: cannot load session\n", argv[1]);
+        return 1;
+    }
+
+    const unsigned char *session = ptf.unxored_data();
+    uint64_t len = ptf.unxored_size();
+
+    for (int copies = 1; copies <= max_copies; copies *= 2) {
+        std::vector<unsigned char> plain(session, session + 0x14);
+
+        for (int i = 0; i < copies; i++) {
+            plain.insert(plain.end(), session + 0x14, session + len);
+        }
+        run("repeated", plain, iterations);
+
+        for (uint64_t i = 0x40; i < plain.size(); i += 16) {
+            plain[i] = 0x5a;
+        }
+        run("damaged", plain, iterations);
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * search_bench - needle search cost per session load
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Build:
+ *   c++ -std=c++20 -O2 -I../Sources/PtFormatObjC search_bench.cc ../Sources/PtFormatObjC/ptformat.cc -o search_bench
+ *
+ * Usage:
+ *   search_bench [-n iterations] session.ptx...
+ *
+ * Loads each session and reports how many bytes the chunk marker and version
+ * searches covered, relative to the session size, along with the load time.
+ */
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ptformat/ptformat.h"
+
+int
+main(int argc, char **argv) {
+    int iterations = 20;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: %s [-n iterations] session.ptx...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = first; i < argc; i++) {
+        PTFFormat ptf;
+        double best = 0;
+        int result = 0;
+
+        for (int j = 0; j < iterations; j++) {
+            auto start = std::chrono::steady_clock::now();
+            result = ptf.load(argv[i]);
+            std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+            if (j == 0 || secs.count() < best) {
+                best = secs.count();
+            }
+        }
+
+        printf("session=%s result=%d bytes=%llu search_bytes=%llu search_ratio=%.3f ms=%.3f\n",
+               argv[i], result, (unsigned long long)ptf.unxored_size(),
+               (unsigned long long)ptf.search_bytes(),
+               ptf.unxored_size() ? (double)ptf.search_bytes() / ptf.unxored_size() : 0.,
+               best * 1e3);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * unxor_bench - XOR decryption kernel throughput
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Build:
+ *   c++ -std=c++20 -O2 -I../Sources/PtFormatObjC unxor_bench.cc ../Sources/PtFormatObjC/ptformat.cc -o unxor_bench
+ *
+ * Usage:
+ *   unxor_bench [size_mb] [iterations]
+ */
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "ptformat/ptformat.h"
+
+struct kernel_desc {
+    PTFFormat::xor_kernel_t kernel;
+    const char *name;
+};
+
+static const kernel_desc KERNELS[] = {
+    { PTFFormat::XOR_KERNEL_SCALAR, "scalar" },
+    { PTFFormat::XOR_KERNEL_SSE2, "sse2" },
+    { PTFFormat::XOR_KERNEL_AVX2, "avx2" },
+    { PTFFormat::XOR_KERNEL_AUTO, "auto" },
+};
+
+static const uint8_t XOR_TYPES[] = { 0x01, 0x05 };
+
+int
+main(int argc, char **argv) {
+    uint64_t size = (argc > 1 ? strtoull(argv[1], NULL, 10) : 64) << 20;
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+    std::vector<unsigned char> plain(size), reference(size), data(size);
+
+    srand(1);
+    for (uint64_t i = 0; i < size; i++) {
+        plain[i] = rand() & 0xff;
+    }
+
+    for (uint8_t xor_type : XOR_TYPES) {
+        // any key works, 0x7b is an arbitrary one
+        reference = plain;
+        PTFFormat::unxor_range(reference.data(), size, 0x14, xor_type, 0x7b, PTFFormat::XOR_KERNEL_SCALAR);
+
+        for (const kernel_desc& k : KERNELS) {
+            if (!PTFFormat::xor_kernel_supported(k.kernel)) {
+                printf("kernel=%s xor_type=0x%02x unsupported\n", k.name, xor_type);
+                continue;
+            }
+
+            data = plain;
+            PTFFormat::unxor_range(data.data(), size, 0x14, xor_type, 0x7b, k.kernel);
+            if (memcmp(data.data(), reference.data(), size) != 0) {
+                fprintf(stderr, "kernel=%s xor_type=0x%02x output differs from scalar kernel\n", k.name, xor_type);
+                return 1;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                PTFFormat::unxor_range(data.data(), size, 0x14, xor_type, 0x7b, k.kernel);
+            }
+            std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+            printf("kernel=%s xor_type=0x%02x bytes=%llu iterations=%d gbps=%.2f\n",
+                   k.name, xor_type, (unsigned long long)size, iterations,
+                   (double)size * iterations / secs.count() / 1e9);
+        }
+    }
+    return 0;
+}
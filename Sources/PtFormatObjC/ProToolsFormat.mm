@@ -6,36 +6,114 @@
 //
 
 #import <Foundation/Foundation.h>
+#include <fcntl.h>
+#include <unistd.h>
 #import "ptformat/ptformat.h"
 #import "include/ProToolsFormat.h"
 
+static_assert(PTSectionAll == PTFFormat::PARSE_ALL && PTSectionTempo == PTFFormat::PARSE_TEMPO,
+              "PTSections must match PTFFormat::section_t");
+
+@interface ProToolsFormat()
+- (const PTFFormat *) _object;
+@end
+
 @interface PTBlock()
-+ (instancetype) fromBlock:(PTFFormat::block_t)block unxored:(const unsigned char *)unxored;
-+ (NSArray<PTBlock *> *) arrayFromVector:(std::vector<PTFFormat::block_t>)blocksVec unxored:(const unsigned char *)unxored;
++ (instancetype) fromIndex:(uint32_t)index owner:(ProToolsFormat *)owner;
++ (NSArray<PTBlock *> *) arrayFromList:(PTFFormat::block_list_t)blocksList owner:(ProToolsFormat *)owner;
+@end
+
+@interface PTBlockDiff()
++ (instancetype) fromDiff:(const PTFFormat::block_diff_t &)diff older:(ProToolsFormat *)older newer:(ProToolsFormat *)newer;
 @end
 
-@implementation PTBlock
+@implementation PTBlock {
+    // keeps the session, and so the block arena, alive for the lazy accessors
+    ProToolsFormat *_owner;
+    uint32_t _index;
+    NSData *_data;
+    NSArray<PTBlock *> *_children;
+    BOOL _hashed;
+    uint64_t _contentHash;
+}
 
-+ (instancetype) fromBlock:(PTFFormat::block_t)block unxored:(const unsigned char *)unxored {
++ (instancetype) fromIndex:(uint32_t)index owner:(ProToolsFormat *)owner {
+    const PTFFormat *format = [owner _object];
+    const PTFFormat::block_t& block = format->block_arena()[index];
     PTBlock *ptBlock = [[PTBlock alloc] init];
+    ptBlock->_owner = owner;
+    ptBlock->_index = index;
     ptBlock->_type = block.block_type;
     ptBlock->_contentType = block.content_type;
     ptBlock->_offset = block.offset;
-    ptBlock->_data = [[NSData alloc] initWithBytes:&unxored[block.offset] length:block.block_size];
-    ptBlock->_children = [PTBlock arrayFromVector:block.child unxored:unxored];
+    for (uint32_t p = block.parent; p != PTFFormat::NO_BLOCK; p = format->block_arena()[p].parent) {
+        ptBlock->_level++;
+    }
     return ptBlock;
 }
 
-+ (NSArray<PTBlock *> *) arrayFromVector:(std::vector<PTFFormat::block_t>)blocksVec unxored:(const unsigned char *)unxored {
-    PTBlock *blocks[blocksVec.size()];
-    for (int i = 0; i < blocksVec.size(); i++) {
-        blocks[i] = [PTBlock fromBlock:blocksVec[i] unxored:unxored];
++ (NSArray<PTBlock *> *) arrayFromList:(PTFFormat::block_list_t)blocksList owner:(ProToolsFormat *)owner {
+    const PTFFormat *format = [owner _object];
+    NSMutableArray<PTBlock *> *blocks = [NSMutableArray array];
+    for (const PTFFormat::block_t& b : blocksList) {
+        [blocks addObject:[PTBlock fromIndex:(uint32_t)(&b - &format->block_arena()[0]) owner:owner]];
+    }
+    return blocks;
+}
+
+- (NSData *) data {
+    if (_data == nil) {
+        const PTFFormat *format = [_owner _object];
+        const PTFFormat::block_t& block = format->block_arena()[_index];
+        _data = [[NSData alloc] initWithBytes:&format->unxored_data()[block.offset] length:block.block_size];
     }
-    return [[NSArray alloc] initWithObjects:blocks count:blocksVec.size()];
+    return _data;
+}
+
+- (uint64_t) contentHash {
+    if (!_hashed) {
+        const PTFFormat *format = [_owner _object];
+        // hashes all blocks of the session on first use
+        _contentHash = format->block_hash(format->block_arena()[_index]);
+        _hashed = YES;
+    }
+    return _contentHash;
+}
+
+- (NSArray<PTBlock *> *) children {
+    if (_children == nil) {
+        const PTFFormat *format = [_owner _object];
+        _children = [PTBlock arrayFromList:format->children(format->block_arena()[_index]) owner:_owner];
+    }
+    return _children;
 }
 
 @end
 
+@implementation PTBlockDiff
++ (instancetype) fromDiff:(const PTFFormat::block_diff_t &)diff older:(ProToolsFormat *)older newer:(ProToolsFormat *)newer {
+    PTBlockDiff *ptDiff = [[PTBlockDiff alloc] init];
+    switch (diff.kind) {
+    case PTFFormat::block_diff_t::BLOCK_CHANGED:
+        ptDiff->_kind = PTBlockDiffChanged;
+        break;
+    case PTFFormat::block_diff_t::BLOCK_ADDED:
+        ptDiff->_kind = PTBlockDiffAdded;
+        break;
+    case PTFFormat::block_diff_t::BLOCK_REMOVED:
+        ptDiff->_kind = PTBlockDiffRemoved;
+        break;
+    }
+    if (diff.old_block != PTFFormat::NO_BLOCK) {
+        ptDiff->_olderBlock = [PTBlock fromIndex:diff.old_block owner:older];
+    }
+    if (diff.new_block != PTFFormat::NO_BLOCK) {
+        ptDiff->_newerBlock = [PTBlock fromIndex:diff.new_block owner:newer];
+    }
+    return ptDiff;
+}
+@end
+
 @implementation PTWav
 + (instancetype) wavWithFilename:(nonnull NSString *)filename index:(uint16_t)index posAbsolute:(uint64_t)pos length:(uint64_t)length {
     PTWav *wav = [[PTWav alloc] init];
@@ -353,20 +431,22 @@
     return [[ProToolsFormat alloc] initWithPath:path error:error];
 }
 
++ (instancetype) newWithPath:(NSString *)path sections:(PTSections)sections error:(NSError **)error {
+    return [[ProToolsFormat alloc] initWithPath:path sections:sections error:error];
+}
+
 - (instancetype) initWithPath:(NSString *)path error:(NSError **)error {
+    return [self initWithPath:path sections:PTSectionAll error:error];
+}
+
+- (instancetype) initWithPath:(NSString *)path sections:(PTSections)sections error:(NSError **)error {
     self = [super init];
 
     if (self != nil) {
         object = new PTFFormat();
         std::string cPath = std::string([path UTF8String], [path lengthOfBytesUsingEncoding:NSUTF8StringEncoding]);
 
-        int result;
-        if ((result = object->load(cPath))) {
-            if (error != NULL) {
-                // TODO: add error description to userInfo dictionary
-                // convert error code to a positive integer for NSError, otherwise it will overflow
-                *error = [NSError errorWithDomain:@"com.github.ptformat-objc.ErrorDomain" code:-result userInfo:nil];
-            }
+        if (![self _checkLoadResult:object->load(cPath, PTFFormat::LOAD_MMAP, sections) error:error]) {
             // dealloc will still be called so no need to delete object here
             return nil;
         }
@@ -375,6 +455,60 @@
     return self;
 }
 
++ (instancetype) newWithData:(NSData *)data error:(NSError **)error {
+    return [[ProToolsFormat alloc] initWithData:data error:error];
+}
+
+- (instancetype) initWithData:(NSData *)data error:(NSError **)error {
+    return [self initWithData:data sections:PTSectionAll error:error];
+}
+
+- (instancetype) initWithData:(NSData *)data sections:(PTSections)sections error:(NSError **)error {
+    self = [super init];
+
+    if (self != nil) {
+        object = new PTFFormat();
+
+        if (![self _checkLoadResult:object->load_buffer([data bytes], [data length], sections) error:error]) {
+            // dealloc will still be called so no need to delete object here
+            return nil;
+        }
+    }
+
+    return self;
+}
+
+- (BOOL) isLoaded:(PTSections)sections {
+    return object->loaded(sections);
+}
+
+- (BOOL) _checkLoadResult:(int)result error:(NSError **)error {
+    if (result) {
+        if (error != NULL) {
+            // TODO: add error description to userInfo dictionary
+            // convert error code to a positive integer for NSError, otherwise it will overflow
+            *error = [NSError errorWithDomain:@"com.github.ptformat-objc.ErrorDomain" code:-result userInfo:nil];
+        }
+        return NO;
+    }
+    return YES;
+}
+
++ (BOOL) unxorPath:(NSString *)path toFileDescriptor:(int)fd error:(NSError **)error {
+    int fdIn = open([path fileSystemRepresentation], O_RDONLY);
+    int result = fdIn < 0 ? -1 : PTFFormat::unxor_stream(fdIn, fd);
+    if (fdIn >= 0) {
+        close(fdIn);
+    }
+    if (result) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:@"com.github.ptformat-objc.ErrorDomain" code:-result userInfo:nil];
+        }
+        return NO;
+    }
+    return YES;
+}
+
 - (void) dealloc {
     if (object != NULL) {
         delete object;
@@ -397,8 +531,30 @@
     return [[NSData alloc] initWithBytes:object->unxored_data() length:object->unxored_size()];
 }
 
+- (const PTFFormat *) _object {
+    return object;
+}
+
 - (nonnull NSArray<PTBlock *> *) blocks {
-    return [PTBlock arrayFromVector:object->blocks() unxored:object->unxored_data()];
+    return [PTBlock arrayFromList:object->toplevel_blocks() owner:self];
+}
+
+- (nonnull NSArray<PTBlock *> *) blocksOfContentType:(uint16_t)contentType {
+    const std::vector<const PTFFormat::block_t *>& blocksSrc = object->blocks_of_type(contentType);
+    NSMutableArray<PTBlock *> *ret = [NSMutableArray arrayWithCapacity:blocksSrc.size()];
+    for (auto b = blocksSrc.cbegin(); b != blocksSrc.cend(); ++b) {
+        [ret addObject:[PTBlock fromIndex:(uint32_t)(*b - &object->block_arena()[0]) owner:self]];
+    }
+    return ret;
+}
+
++ (nonnull NSArray<PTBlockDiff *> *) diffBlocksFrom:(nonnull ProToolsFormat *)older to:(nonnull ProToolsFormat *)newer {
+    const std::vector<PTFFormat::block_diff_t> diff = PTFFormat::diff_blocks(*older->object, *newer->object);
+    NSMutableArray<PTBlockDiff *> *ret = [NSMutableArray arrayWithCapacity:diff.size()];
+    for (const PTFFormat::block_diff_t& d : diff) {
+        [ret addObject:[PTBlockDiff fromDiff:d older:older newer:newer]];
+    }
+    return ret;
 }
 
 - (nonnull NSArray<PTTrack *> *) _tracksFromTracks:(std::vector<PTFFormat::track_t>)tracksSrc {
@@ -455,6 +611,14 @@
     return [PTMetadata metaWithTitle:title artist:artist contributors:contributors location:location];
 }
 
+- (nullable NSString *) metadataValueForPath:(NSString *)path {
+    const PTFFormat::metadata_field_t *field = object->metadata_field(std::string([path UTF8String]));
+    if (field == NULL || field->type != 0) {
+        return nil;
+    }
+    return [[NSString alloc] initWithBytes:field->value.data() length:field->value.size() encoding:NSUTF8StringEncoding];
+}
+
 - (nonnull NSArray<PTKeySignatureEv *> *) keySignatures {
     std::vector<PTFFormat::key_signature_ev_t> keySigsSrc = object->keysignatures();
     PTKeySignatureEv *keySigs[keySigsSrc.size()];
@@ -503,4 +667,27 @@
     return object->music_duration_secs(gapSecs);
 }
 
+- (nonnull NSArray<NSNumber *> *) musicDurationsSecsWithMaxGapsSecs:(nonnull NSArray<NSNumber *> *)gapsSecs {
+    std::vector<uint8_t> gaps;
+    gaps.reserve([gapsSecs count]);
+    for (NSNumber *gap in gapsSecs) {
+        gaps.push_back([gap unsignedCharValue]);
+    }
+    std::vector<uint32_t> durationsSrc = object->music_durations_secs(gaps);
+    NSMutableArray<NSNumber *> *durations = [NSMutableArray arrayWithCapacity:durationsSrc.size()];
+    for (uint32_t duration : durationsSrc) {
+        [durations addObject:@(duration)];
+    }
+    return durations;
+}
+
+- (nonnull NSArray<NSNumber *> *) gapHistogramSecs {
+    std::vector<uint32_t> histogramSrc = object->gap_histogram_secs();
+    NSMutableArray<NSNumber *> *histogram = [NSMutableArray arrayWithCapacity:histogramSrc.size()];
+    for (uint32_t count : histogramSrc) {
+        [histogram addObject:@(count)];
+    }
+    return histogram;
+}
+
 @end
@@ -0,0 +1,143 @@
+/*
+ * libptformat - a library to read ProTools sessions
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "ptformat/batchloader.h"
+
+using namespace std;
+
+/* Range of input indices owned by one worker. The owner takes work from the
+   front, thieves take the back half. */
+struct work_range {
+    std::mutex lock;
+    size_t begin;
+    size_t end;
+
+    work_range () : begin (0), end (0) {}
+
+    bool pop(size_t& index) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (begin == end)
+            return false;
+        index = begin++;
+        return true;
+    }
+
+    bool steal_into(work_range& thief) {
+        size_t stolen_begin, stolen_end;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (begin == end)
+                return false;
+            stolen_end = end;
+            end -= (end - begin + 1) / 2;
+            stolen_begin = end;
+        }
+        // never hold two locks at once
+        std::lock_guard<std::mutex> guard(thief.lock);
+        thief.begin = stolen_begin;
+        thief.end = stolen_end;
+        return true;
+    }
+};
+
+PTFBatchLoader::PTFBatchLoader(unsigned workers, PTFFormat::load_mode_t mode)
+    : _workers(workers)
+    , _mode(mode)
+{
+    if (_workers == 0) {
+        _workers = max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+std::vector<PTFBatchLoader::result_t>
+PTFBatchLoader::load(std::vector<std::string> const& paths) {
+    std::vector<result_t> results(paths.size());
+
+    // every index is written by exactly one worker, so no locking is needed
+    load(paths, [&results](size_t index, result_t& result) {
+        results[index] = std::move(result);
+    });
+    return results;
+}
+
+void
+PTFBatchLoader::load(std::vector<std::string> const& paths, completion_t const& done) {
+    const size_t nworkers = max<size_t>(1, min<size_t>(_workers, paths.size()));
+    std::vector<work_range> ranges(nworkers);
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> sessions(0), failed(0), bytes(0);
+
+    for (size_t w = 0; w < nworkers; w++) {
+        ranges[w].begin = paths.size() * w / nworkers;
+        ranges[w].end = paths.size() * (w + 1) / nworkers;
+    }
+
+    auto worker = [&](size_t w) {
+        size_t index;
+        for (;;) {
+            if (!ranges[w].pop(index)) {
+                // own range is drained, steal from the others starting with the next worker
+                bool stolen = false;
+                for (size_t v = 1; v < nworkers && !stolen; v++) {
+                    stolen = ranges[(w + v) % nworkers].steal_into(ranges[w]);
+                }
+                if (!stolen)
+                    return;
+                continue;
+            }
+
+            result_t result;
+            result.path = paths[index];
+            result.session.reset(new PTFFormat());
+            result.error = result.session->load(result.path, _mode);
+            if (result.error) {
+                result.session.reset();
+                failed++;
+            } else {
+                sessions++;
+                bytes += result.session->unxored_size();
+            }
+            done(index, result);
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t w = 1; w < nworkers; w++) {
+        threads.push_back(std::thread(worker, w));
+    }
+    // calling thread works as well
+    worker(0);
+    for (std::vector<std::thread>::iterator t = threads.begin(); t != threads.end(); ++t) {
+        t->join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    _stats.sessions = sessions;
+    _stats.failed = failed;
+    _stats.bytes = bytes;
+    _stats.wall_secs = elapsed.count();
+}
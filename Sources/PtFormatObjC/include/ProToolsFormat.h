@@ -15,10 +15,33 @@
 @property (nonatomic, readonly) uint16_t type;
 @property (nonatomic, readonly) uint16_t contentType;
 @property (nonatomic, readonly) uint32_t offset;
+// Nesting level, 0 for toplevel blocks
+@property (nonatomic, readonly) NSUInteger level;
+// Copied from the session on first access
 @property (nonatomic, strong, readonly, nonnull) NSData *data;
+// Hash of type, size and data, equal for blocks with equal content. Computed on first
+// access, when the hashes of all blocks of the session are computed at once.
+@property (nonatomic, readonly) uint64_t contentHash;
+// Built on first access
 @property (nonatomic, strong, readonly, nonnull) NSArray<PTBlock *> *children;
 @end
 
+typedef NS_ENUM(NSInteger, PTBlockDiffKind) {
+    PTBlockDiffChanged, // same content type, different bytes
+    PTBlockDiffAdded,
+    PTBlockDiffRemoved
+};
+
+@interface PTBlockDiff : NSObject
++ (nonnull instancetype) new NS_UNAVAILABLE;
+- (nonnull instancetype) init NS_UNAVAILABLE;
+@property (nonatomic, readonly) PTBlockDiffKind kind;
+// Block of the older session, nil if added
+@property (nonatomic, strong, readonly, nullable) PTBlock *olderBlock;
+// Block of the newer session, nil if removed
+@property (nonatomic, strong, readonly, nullable) PTBlock *newerBlock;
+@end
+
 @interface PTWav : NSObject
 + (nonnull instancetype) new NS_UNAVAILABLE;
 + (nonnull instancetype) wavWithFilename:(nonnull NSString *)filename index:(uint16_t)index posAbsolute:(uint64_t)pos length:(uint64_t)length;
@@ -126,15 +149,44 @@
 @property (nonatomic, readonly) uint64_t beatLength;
 @end
 
+// Session sections to parse, header (version, sample rate, bit depth) is always parsed,
+// PTSectionMidi implies PTSectionRegions (regions and tracks) which implies PTSectionAudio
+typedef NS_OPTIONS(uint32_t, PTSections) {
+    PTSectionHeader   = 1 << 0,
+    PTSectionAudio    = 1 << 1,
+    PTSectionRegions  = 1 << 2,
+    PTSectionMidi     = 1 << 3,
+    PTSectionMetadata = 1 << 4,
+    PTSectionKeySigs  = 1 << 5,
+    PTSectionTimeSigs = 1 << 6,
+    PTSectionTempo    = 1 << 7,
+    PTSectionAll      = 0xff
+};
+
 @interface ProToolsFormat : NSObject
 + (nonnull instancetype) new NS_UNAVAILABLE;
 + (nullable instancetype) newWithPath:(nonnull NSString *)path error:(NSError * _Nullable * _Nullable)error;
++ (nullable instancetype) newWithPath:(nonnull NSString *)path sections:(PTSections)sections error:(NSError * _Nullable * _Nullable)error;
 - (nonnull instancetype) init NS_UNAVAILABLE;
 - (nullable instancetype) initWithPath:(nonnull NSString *)path error:(NSError * _Nullable * _Nullable)error;
+- (nullable instancetype) initWithPath:(nonnull NSString *)path sections:(PTSections)sections error:(NSError * _Nullable * _Nullable)error;
++ (nullable instancetype) newWithData:(nonnull NSData *)data error:(NSError * _Nullable * _Nullable)error;
+- (nullable instancetype) initWithData:(nonnull NSData *)data error:(NSError * _Nullable * _Nullable)error;
+- (nullable instancetype) initWithData:(nonnull NSData *)data sections:(PTSections)sections error:(NSError * _Nullable * _Nullable)error;
 - (void) dealloc;
 
+// Whether all given sections were parsed, accessors of other sections return empty values
+- (BOOL) isLoaded:(PTSections)sections;
+
+// Writes decrypted session data to fd in fixed size chunks without loading the whole session
++ (BOOL) unxorPath:(nonnull NSString *)path toFileDescriptor:(int)fd error:(NSError * _Nullable * _Nullable)error;
+
 - (nonnull NSData *) unxoredData;
 - (nonnull NSArray<PTBlock *> *) blocks;
+// Blocks of given content type at any nesting level, in file order
+- (nonnull NSArray<PTBlock *> *) blocksOfContentType:(uint16_t)contentType;
+// Blocks that differ between two sessions, parents before their children, empty if all blocks are equal
++ (nonnull NSArray<PTBlockDiff *> *) diffBlocksFrom:(nonnull ProToolsFormat *)older to:(nonnull ProToolsFormat *)newer;
 - (nullable NSData *) metadataBase64;
 
 - (uint8_t) version;
@@ -144,6 +196,8 @@
 - (nonnull NSArray<PTTrack *> *) midiTracks;
 - (nonnull NSArray<PTRegionRange *> *) regionRanges;
 - (nonnull PTMetadata *) metadata;
+// String value of any metadata field, e.g. @"http://purl.org/dc/elements/1.1/:title"
+- (nullable NSString *) metadataValueForPath:(nonnull NSString *)path;
 - (nonnull NSArray<PTKeySignatureEv *> *) keySignatures;
 - (nonnull NSArray<PTTimeSignatureEv *> *) timeSignatures;
 - (nonnull NSArray<PTTempoChange *> *) tempoChanges;
@@ -151,6 +205,11 @@
 - (nonnull PTTimeSignature *) mainTimeSignature;
 - (double) mainTempo;
 - (uint32_t) musicDurationSecsWithMaxGapSecs:(uint8_t)gapSecs;
+// musicDurationSecsWithMaxGapSecs: for each of gapsSecs (uint8_t numbers), computed in one pass
+- (nonnull NSArray<NSNumber *> *) musicDurationsSecsWithMaxGapsSecs:(nonnull NSArray<NSNumber *> *)gapsSecs;
+// Count of gaps between region ranges longer than i and at most i + 1 seconds at index i,
+// with all gaps over 255 seconds counted at index 255
+- (nonnull NSArray<NSNumber *> *) gapHistogramSecs;
 @end
 
 #endif /* PRO_TOOLS_FORMAT_H */
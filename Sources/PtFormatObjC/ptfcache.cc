@@ -0,0 +1,585 @@
+/*
+ * libptformat - a library to read ProTools sessions
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <unistd.h>
+# define PTF_HAVE_MMAP
+#endif
+
+#include "ptformat/ptfcache.h"
+
+#define CACHE_MAGIC      "PTFCACHE"
+#define CACHE_BYTE_ORDER 0x01020304
+
+// the layout of records is part of the file format, changing it needs a new VERSION
+static_assert(sizeof(PTFCache::info_t) == 32, "cache record layout");
+static_assert(sizeof(PTFCache::wav_t) == 32, "cache record layout");
+static_assert(sizeof(PTFCache::region_t) == 80, "cache record layout");
+static_assert(sizeof(PTFCache::track_t) == 96, "cache record layout");
+static_assert(sizeof(PTFCache::midi_ev_t) == 24, "cache record layout");
+static_assert(sizeof(PTFCache::key_signature_ev_t) == 16, "cache record layout");
+static_assert(sizeof(PTFCache::time_signature_ev_t) == 16, "cache record layout");
+static_assert(sizeof(PTFCache::tempo_change_t) == 32, "cache record layout");
+static_assert(sizeof(PTFCache::metadata_field_t) == 32, "cache record layout");
+
+/* Size of one record of each section, 1 for byte sections */
+static const size_t record_size[] = {
+    sizeof(PTFCache::info_t),
+    1,
+    sizeof(PTFCache::wav_t),
+    sizeof(PTFCache::region_t),
+    sizeof(PTFCache::region_t),
+    sizeof(PTFCache::track_t),
+    sizeof(PTFCache::track_t),
+    sizeof(PTFCache::midi_ev_t),
+    sizeof(PTFCache::key_signature_ev_t),
+    sizeof(PTFCache::time_signature_ev_t),
+    sizeof(PTFCache::tempo_change_t),
+    sizeof(PTFCache::region_range_t),
+    sizeof(PTFCache::metadata_t),
+    sizeof(PTFCache::string_t),
+    sizeof(PTFCache::metadata_field_t),
+    1,
+};
+
+uint64_t
+PTFCache::content_hash(const unsigned char *data, uint64_t len) {
+    return PTFFormat::hash_bytes(data, len);
+}
+
+int
+PTFCache::session_key(std::string const& path, key_t& key, bool with_hash) {
+    PTFFormat::file_stat_t st;
+
+    if (PTFFormat::stat_file(path, st) != 0) {
+        return -1;
+    }
+    key.size = st.size;
+    key.mtime_ns = st.mtime_ns;
+    key.hash = 0;
+    if (!with_hash) {
+        return 0;
+    }
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return -1;
+    }
+    std::vector<unsigned char> data(key.size);
+    bool ok = fread(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+    if (!ok) {
+        return -1;
+    }
+    key.hash = content_hash(data.data(), data.size());
+    return 0;
+}
+
+/* Key of the session file as ptf read it. Its decrypted data is encrypted again
+   to hash the file content, xor being symmetric. */
+static int
+loaded_session_key(const PTFFormat& ptf, PTFCache::key_t& key) {
+    const unsigned char *data = ptf.unxored_data();
+    uint64_t len = ptf.unxored_size();
+
+    if (ptf.path().empty() || !data || len < 0x14 || ptf.file_stat().size != len) {
+        return -1;
+    }
+    std::vector<unsigned char> content(data, data + len);
+    if (!PTFFormat::unxor_range(&content[0x14], len - 0x14, 0x14, content[0x12], content[0x13])) {
+        return -1;
+    }
+    key.size = len;
+    key.mtime_ns = ptf.file_stat().mtime_ns;
+    key.hash = PTFCache::content_hash(content.data(), len);
+    return 0;
+}
+
+/* Collects the sections of a cache in memory before it is written out */
+class PTFCache::writer_t {
+public:
+    template <class T>
+    void add (section_id_t id, const T& rec) {
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(&rec);
+        _sections[id].insert(_sections[id].end(), p, p + sizeof(T));
+    }
+
+    void add_bytes (section_id_t id, const unsigned char *p, size_t n) {
+        _sections[id].insert(_sections[id].end(), p, p + n);
+    }
+
+    size_t count (section_id_t id) const { return _sections[id].size() / record_size[id]; }
+
+    string_t str (std::string_view s) {
+        std::unordered_map<std::string, string_t>::const_iterator found = _strings.find(std::string(s));
+        if (found != _strings.end()) {
+            return found->second;
+        }
+        std::vector<unsigned char>& strings = _sections[SEC_STRINGS];
+        string_t ret = { (uint32_t)strings.size(), (uint32_t)s.size() };
+        strings.insert(strings.end(), s.begin(), s.end());
+        _strings.emplace(std::string(s), ret);
+        return ret;
+    }
+
+    wav_t wav (const PTFFormat::wav_t& w) {
+        wav_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.filename = str(w.filename);
+        rec.posabsolute = w.posabsolute;
+        rec.length = w.length;
+        rec.index = w.index;
+        return rec;
+    }
+
+    region_t region (const PTFFormat::region_t& r) {
+        region_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.name = str(r.name);
+        rec.startpos = r.startpos;
+        rec.offset = r.offset;
+        rec.length = r.length;
+        rec.wave = wav(r.wave);
+        rec.index = r.index;
+        rec.is_startpos_in_ticks = r.is_startpos_in_ticks;
+
+        // events are shared between regions and tracks, so are written once
+        const PTFFormat::midi_columns_t& columns = r.midi.columns();
+        std::unordered_map<const PTFFormat::midi_columns_t*, uint32_t>::const_iterator found = _midi.find(&columns);
+        rec.midi_count = r.midi.size();
+        if (found != _midi.end()) {
+            rec.midi_first = found->second;
+            return rec;
+        }
+        rec.midi_first = count(SEC_MIDI_EVENTS);
+        for (size_t i = 0; i < columns.size(); i++) {
+            midi_ev_t ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.pos = columns.pos[i];
+            ev.length = columns.length[i];
+            ev.note = columns.note[i];
+            ev.velocity = columns.velocity[i];
+            add(SEC_MIDI_EVENTS, ev);
+        }
+        if (columns.size() != 0) {
+            _midi.emplace(&columns, rec.midi_first);
+        }
+        return rec;
+    }
+
+    track_t track (const PTFFormat::track_t& t) {
+        track_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.name = str(t.name);
+        rec.index = t.index;
+        rec.playlist = t.playlist;
+        rec.reg = region(t.reg);
+        return rec;
+    }
+
+    bool save (std::string const& path, const key_t& key);
+
+private:
+    std::vector<unsigned char> _sections[SEC_COUNT];
+    std::unordered_map<std::string, string_t> _strings;
+    std::unordered_map<const PTFFormat::midi_columns_t*, uint32_t> _midi;
+};
+
+/* Sections follow the header in order, each aligned to 8 bytes. The file is
+   written next to its final path and renamed over it once complete. */
+bool
+PTFCache::writer_t::save(std::string const& path, const key_t& key) {
+    static const unsigned char zeros[8] = { 0 };
+    std::string tmp_path = path + ".tmp";
+    header_t header;
+    uint64_t offset;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    header.byte_order = CACHE_BYTE_ORDER;
+    header.key = key;
+    offset = (sizeof(header) + 7) & ~7ULL;
+    for (int i = 0; i < SEC_COUNT; i++) {
+        header.sections[i].offset = offset;
+        header.sections[i].size = _sections[i].size();
+        offset = (offset + _sections[i].size() + 7) & ~7ULL;
+    }
+    header.file_size = offset;
+
+    FILE *fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    uint64_t written = sizeof(header);
+    for (int i = 0; ok && i < SEC_COUNT; i++) {
+        ok = fwrite(zeros, 1, header.sections[i].offset - written, fp) == header.sections[i].offset - written;
+        written = header.sections[i].offset;
+        if (ok && !_sections[i].empty()) {
+            ok = fwrite(_sections[i].data(), 1, _sections[i].size(), fp) == _sections[i].size();
+            written += _sections[i].size();
+        }
+    }
+    if (ok) {
+        ok = fwrite(zeros, 1, header.file_size - written, fp) == header.file_size - written;
+    }
+    ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+    if (ok) {
+        remove(path.c_str());
+    }
+#endif
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+int
+PTFCache::write(const PTFFormat& ptf, std::string const& cache_path) {
+    writer_t w;
+    key_t key;
+
+    if (loaded_session_key(ptf, key) != 0) {
+        return -1;
+    }
+
+    const PTFFormat::main_values_t& main = ptf.main_values();
+    info_t info;
+    memset(&info, 0, sizeof(info));
+    info.sessionrate = ptf.sessionrate();
+    for (uint32_t bit = 1; bit & PTFFormat::PARSE_ALL; bit <<= 1) {
+        if (ptf.loaded(bit)) {
+            info.loaded |= bit;
+        }
+    }
+    info.version = ptf.version();
+    info.bitdepth = ptf.bitdepth();
+    info.main_key_is_major = main.keysignature.is_major;
+    info.main_key_is_sharp = main.keysignature.is_sharp;
+    info.main_key_sign_count = main.keysignature.sign_count;
+    info.main_tempo = ptf.main_tempo();
+    info.main_time_nominator = main.timesignature.nominator;
+    info.main_time_denominator = main.timesignature.denominator;
+    w.add(SEC_INFO, info);
+
+    for (const PTFFormat::wav_t& wav : ptf.audiofiles()) {
+        w.add(SEC_AUDIOFILES, w.wav(wav));
+    }
+    for (const PTFFormat::region_t& r : ptf.regions()) {
+        w.add(SEC_REGIONS, w.region(r));
+    }
+    for (const PTFFormat::region_t& r : ptf.midiregions()) {
+        w.add(SEC_MIDIREGIONS, w.region(r));
+    }
+    for (const PTFFormat::track_t& t : ptf.tracks()) {
+        w.add(SEC_TRACKS, w.track(t));
+    }
+    for (const PTFFormat::track_t& t : ptf.miditracks()) {
+        w.add(SEC_MIDITRACKS, w.track(t));
+    }
+    for (const PTFFormat::key_signature_ev_t& k : ptf.keysignatures()) {
+        key_signature_ev_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.pos = k.pos;
+        rec.is_major = k.is_major;
+        rec.is_sharp = k.is_sharp;
+        rec.sign_count = k.sign_count;
+        w.add(SEC_KEYSIGS, rec);
+    }
+    for (const PTFFormat::time_signature_ev_t& t : ptf.timesignatures()) {
+        time_signature_ev_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.pos = t.pos;
+        rec.measure_num = t.measure_num;
+        rec.nominator = t.nominator;
+        rec.denominator = t.denominator;
+        w.add(SEC_TIMESIGS, rec);
+    }
+    for (const PTFFormat::tempo_change_t& t : ptf.tempochanges()) {
+        w.add(SEC_TEMPO, t);
+    }
+    for (const PTFFormat::region_range_t& r : ptf.region_ranges()) {
+        w.add(SEC_REGION_RANGES, r);
+    }
+
+    const PTFFormat::metadata_t& meta = ptf.metadata();
+    metadata_t mrec;
+    memset(&mrec, 0, sizeof(mrec));
+    mrec.title = w.str(meta.title);
+    mrec.artist = w.str(meta.artist);
+    mrec.location = w.str(meta.location);
+    mrec.contributors_first = 0;
+    mrec.contributors_count = meta.contributors.size();
+    w.add(SEC_METADATA, mrec);
+    for (const std::string& c : meta.contributors) {
+        w.add(SEC_CONTRIBUTORS, w.str(c));
+    }
+    for (const PTFFormat::metadata_field_t& f : ptf.metadata_fields()) {
+        metadata_field_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.name = w.str(f.name);
+        rec.value = w.str(f.value);
+        rec.type = f.type;
+        rec.parent = f.parent;
+        rec.first_child = f.first_child;
+        rec.next_sibling = f.next_sibling;
+        w.add(SEC_METADATA_FIELDS, rec);
+    }
+    if (ptf.metadata_base64()) {
+        w.add_bytes(SEC_METADATA_BASE64, ptf.metadata_base64(), ptf.metadata_base64_size());
+    }
+
+    return w.save(cache_path, key) ? 0 : -2;
+}
+
+PTFCache::PTFCache()
+    : _data(NULL)
+    , _len(0)
+    , _mapped(false)
+    , _header(NULL)
+    , _info(NULL)
+    , _metadata(NULL)
+{
+}
+
+PTFCache::~PTFCache() {
+    close();
+}
+
+int
+PTFCache::open(std::string const& cache_path, std::string const& session_path, bool verify_hash) {
+    struct stat st;
+    FILE *fp;
+
+    close();
+    if (!(fp = fopen(cache_path.c_str(), "rb"))) {
+        return -1;
+    }
+    if (fstat(fileno(fp), &st) != 0) {
+        fclose(fp);
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(header_t)) {
+        fclose(fp);
+        return -2;
+    }
+    _len = st.st_size;
+
+#ifdef PTF_HAVE_MMAP
+    void *map = mmap(NULL, _len, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map != MAP_FAILED) {
+        _data = (const unsigned char*)map;
+        _mapped = true;
+    }
+#endif
+    if (!_data) {
+        unsigned char *buf = (unsigned char*)malloc(_len);
+        if (buf && fread(buf, 1, _len, fp) != _len) {
+            free(buf);
+            buf = NULL;
+        }
+        _data = buf;
+    }
+    fclose(fp);
+    if (!_data) {
+        return -1;
+    }
+
+    _header = (const header_t*)_data;
+    if (memcmp(_header->magic, CACHE_MAGIC, sizeof(_header->magic)) != 0 ||
+            _header->version != VERSION || _header->byte_order != CACHE_BYTE_ORDER ||
+            _header->file_size != _len || !check_sections() || !check_metadata_fields()) {
+        close();
+        return -2;
+    }
+    _info = (const info_t*)(_data + _header->sections[SEC_INFO].offset);
+    _metadata = (const metadata_t*)(_data + _header->sections[SEC_METADATA].offset);
+
+    key_t key;
+    if (session_key(session_path, key, verify_hash) != 0 || key.size != _header->key.size ||
+            key.mtime_ns != _header->key.mtime_ns || (verify_hash && key.hash != _header->key.hash)) {
+        close();
+        return -3;
+    }
+    return 0;
+}
+
+/* Sections must be aligned, within the file and a whole number of records */
+bool
+PTFCache::check_sections(void) const {
+    for (int i = 0; i < SEC_COUNT; i++) {
+        const section_t& s = _header->sections[i];
+        if (s.offset % 8 != 0 || s.offset < sizeof(header_t) || s.offset > _len ||
+                s.size > _len - s.offset || s.size % record_size[i] != 0) {
+            return false;
+        }
+    }
+    return _header->sections[SEC_INFO].size == sizeof(info_t) &&
+        _header->sections[SEC_METADATA].size == sizeof(metadata_t);
+}
+
+/* Links of the metadata field tree must point at a later field, as the tree is
+   stored in pre-order, or be NO_BLOCK. The parent must be an earlier field. */
+bool
+PTFCache::check_metadata_fields(void) const {
+    array_t<metadata_field_t> fields = section<metadata_field_t>(SEC_METADATA_FIELDS);
+
+    for (size_t i = 0; i < fields.size(); i++) {
+        const metadata_field_t& f = fields[i];
+        if ((f.parent != PTFFormat::NO_BLOCK && f.parent >= i) ||
+                (f.first_child != PTFFormat::NO_BLOCK && (f.first_child <= i || f.first_child >= fields.size())) ||
+                (f.next_sibling != PTFFormat::NO_BLOCK && (f.next_sibling <= i || f.next_sibling >= fields.size()))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+PTFCache::close(void) {
+    if (_data) {
+#ifdef PTF_HAVE_MMAP
+        if (_mapped) {
+            munmap((void*)_data, _len);
+        } else
+#endif
+        {
+            free((void*)_data);
+        }
+    }
+    _data = NULL;
+    _len = 0;
+    _mapped = false;
+    _header = NULL;
+    _info = NULL;
+    _metadata = NULL;
+}
+
+const PTFCache::key_t&
+PTFCache::key() const {
+    static const key_t none = key_t();
+
+    return _header ? _header->key : none;
+}
+
+template <class T>
+PTFCache::array_t<T>
+PTFCache::section(section_id_t id) const {
+    if (!_header) {
+        return array_t<T>();
+    }
+    const section_t& s = _header->sections[id];
+    return array_t<T>((const T*)(_data + s.offset), s.size / sizeof(T));
+}
+
+std::string_view
+PTFCache::str(const string_t& s) const {
+    array_t<char> strings = section<char>(SEC_STRINGS);
+    if (s.offset > strings.size() || s.length > strings.size() - s.offset) {
+        return std::string_view();
+    }
+    return std::string_view(strings.begin() + s.offset, s.length);
+}
+
+PTFCache::array_t<PTFCache::midi_ev_t>
+PTFCache::midi_events(const region_t& r) const {
+    array_t<midi_ev_t> events = section<midi_ev_t>(SEC_MIDI_EVENTS);
+    if (r.midi_first > events.size() || r.midi_count > events.size() - r.midi_first) {
+        return array_t<midi_ev_t>();
+    }
+    return array_t<midi_ev_t>(events.begin() + r.midi_first, r.midi_count);
+}
+
+PTFCache::array_t<PTFCache::wav_t>
+PTFCache::audiofiles() const {
+    return section<wav_t>(SEC_AUDIOFILES);
+}
+
+PTFCache::array_t<PTFCache::region_t>
+PTFCache::regions() const {
+    return section<region_t>(SEC_REGIONS);
+}
+
+PTFCache::array_t<PTFCache::region_t>
+PTFCache::midiregions() const {
+    return section<region_t>(SEC_MIDIREGIONS);
+}
+
+PTFCache::array_t<PTFCache::track_t>
+PTFCache::tracks() const {
+    return section<track_t>(SEC_TRACKS);
+}
+
+PTFCache::array_t<PTFCache::track_t>
+PTFCache::miditracks() const {
+    return section<track_t>(SEC_MIDITRACKS);
+}
+
+PTFCache::array_t<PTFCache::key_signature_ev_t>
+PTFCache::keysignatures() const {
+    return section<key_signature_ev_t>(SEC_KEYSIGS);
+}
+
+PTFCache::array_t<PTFCache::time_signature_ev_t>
+PTFCache::timesignatures() const {
+    return section<time_signature_ev_t>(SEC_TIMESIGS);
+}
+
+PTFCache::array_t<PTFCache::tempo_change_t>
+PTFCache::tempochanges() const {
+    return section<tempo_change_t>(SEC_TEMPO);
+}
+
+PTFCache::array_t<PTFCache::region_range_t>
+PTFCache::region_ranges() const {
+    return section<region_range_t>(SEC_REGION_RANGES);
+}
+
+PTFCache::array_t<PTFCache::string_t>
+PTFCache::contributors() const {
+    array_t<string_t> all = section<string_t>(SEC_CONTRIBUTORS);
+    if (!_metadata || _metadata->contributors_first > all.size() ||
+            _metadata->contributors_count > all.size() - _metadata->contributors_first) {
+        return array_t<string_t>();
+    }
+    return array_t<string_t>(all.begin() + _metadata->contributors_first, _metadata->contributors_count);
+}
+
+PTFCache::array_t<PTFCache::metadata_field_t>
+PTFCache::metadata_fields() const {
+    return section<metadata_field_t>(SEC_METADATA_FIELDS);
+}
+
+PTFCache::array_t<unsigned char>
+PTFCache::metadata_base64() const {
+    return section<unsigned char>(SEC_METADATA_BASE64);
+}
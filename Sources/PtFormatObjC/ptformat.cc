@@ -21,14 +21,16 @@
  *
  */
 
-#include <regex>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <cmath>
+#include <chrono>
 #include <algorithm>
+#include <iterator>
 #include <unordered_map>
 
 #ifdef HAVE_GLIB
@@ -38,6 +40,21 @@
 # define ptf_open	fopen
 #endif
 
+#include <sys/stat.h>
+
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <unistd.h>
+# define PTF_HAVE_MMAP
+#else
+# include <io.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# include <immintrin.h>
+# define PTF_HAVE_X86_KERNELS
+#endif
+
 #include "ptformat/ptformat.h"
 
 #define BITCODE			"0010111100101011"
@@ -52,14 +69,29 @@
 using namespace std;
 
 PTFFormat::PTFFormat()
-    : _ptfunxored(0)
+    : _session_meta_base64_pos(0)
+    , _session_meta_base64_len(0)
+    , _session_meta_decoded(false)
+    , _session_meta_base64(NULL)
+    , _session_meta_base64_size(0)
+    , _region_ranges_cached(false)
+    , _main_values_cached(false)
+    , _placed_regions_cached(false)
+    , _file_stat()
+    , _ptfunxored(0)
+    , _ptfunxored_mapped(false)
     , _len(0)
     , _sessionrate(0)
+    , _bitdepth(0)
     , _version(0)
     , _product(NULL)
-    , _session_meta_base64(NULL)
     , is_bigendian(false)
-    , _region_ranges_cached(false)
+    , _block_probes(0)
+    , _block_hashes_cached(false)
+    , _loaded(0)
+    , _first_unnamed_wav(0)
+    , _search_bytes(0)
+    , _load_stats()
 {
 }
 
@@ -118,90 +150,206 @@ u_endian_read8(unsigned char *buf, bool bigendian) {
 
 void
 PTFFormat::cleanup(void) {
+    free_unxored();
+    _path.clear();
+    _file_stat = file_stat_t();
     _len = 0;
+    _loaded = 0;
     _sessionrate = 0;
     _bitdepth = 0;
     _version = 0;
-    free(_ptfunxored);
-    _ptfunxored = NULL;
     free (_product);
     _product = NULL;
     free(_session_meta_base64);
     _session_meta_base64 = NULL;
+    _session_meta_base64_size = 0;
+    _session_meta_base64_pos = 0;
+    _session_meta_base64_len = 0;
+    _session_meta_decoded = false;
     _session_meta_parsed = {};
+    _session_meta_fields.clear();
+    _session_meta_index.clear();
     _audiofiles.clear();
     _regions.clear();
     _midiregions.clear();
     _tracks.clear();
     _miditracks.clear();
+    _wav_index.clear();
+    _region_index.clear();
+    _midiregion_index.clear();
+    _track_index.clear();
+    _miditrack_index.clear();
+    _first_unnamed_wav = 0;
+    _search_bytes = 0;
     _keysignatures.clear();
     _timesignatures.clear();
     _tempochanges.clear();
+    _tempo_map = tempo_map_t();
+    _grid_map = grid_map_t();
     free_all_blocks();
     _region_ranges_cached = false;
     _region_ranges.clear();
+    _main_values_cached = false;
+    _main_values = main_values_t();
+    _placed_regions_cached = false;
+    _placed_regions = region_index_t();
+    _load_stats = load_stats_t();
 }
 
+static inline uint64_t
+now_ns(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Adds the time since since to stage, returns the current time for the next stage */
+uint64_t
+PTFFormat::stage_done(load_stage_t stage, uint64_t since) {
+    uint64_t now = now_ns();
+    _load_stats.stage_ns[stage] += now - since;
+    return now;
+}
+
+const char*
+PTFFormat::load_stats_t::stage_name(load_stage_t stage) {
+    static const char *names[STAGE_COUNT] = {
+        "unxor", "parseblocks", "parseheader", "parseaudio", "parserest",
+        "parsemidi", "parsemetadata", "parsekeysigs", "parsetimesigs", "parsetempochanges",
+    };
+    return stage < STAGE_COUNT ? names[stage] : "";
+}
+
+/* Needles at least this long are searched for with Horspool, shorter ones
+   by scanning for their first byte followed by memcmp */
+#define HORSPOOL_MIN_NEEDLE 8
+
+/* Position of the first needle in buf[from, end), or -1 if there is none */
 int64_t
-PTFFormat::foundat(unsigned char *haystack, uint64_t n, const char *needle) {
-    int64_t found = 0;
-    uint64_t i, j, needle_n;
-    needle_n = strlen(needle);
+PTFFormat::find_needle(const unsigned char *buf, uint64_t from, uint64_t end, const unsigned char *needle, uint32_t needlelen) {
+    if (needlelen == 0 || from + needlelen > end) {
+        return -1;
+    }
 
-    for (i = 0; i < n; i++) {
-        found = i;
-        for (j = 0; j < needle_n; j++) {
-            if (haystack[i+j] != needle[j]) {
-                found = -1;
+    const uint64_t last = end - needlelen; // last candidate position
+    uint64_t k = from;
+
+    if (needlelen < HORSPOOL_MIN_NEEDLE) {
+        while (k <= last) {
+            const unsigned char *p = (const unsigned char *)memchr(&buf[k], needle[0], last - k + 1);
+            if (!p) {
                 break;
             }
+            k = p - buf;
+            if (memcmp(p + 1, needle + 1, needlelen - 1) == 0) {
+                _search_bytes += k + needlelen - from;
+                return k;
+            }
+            k++;
         }
-        if (found > 0)
-            return found;
+        _search_bytes += end - from;
+        return -1;
+    }
+
+    uint32_t skip[256];
+    for (int c = 0; c < 256; c++) {
+        skip[c] = needlelen;
+    }
+    for (uint32_t i = 0; i + 1 < needlelen; i++) {
+        skip[needle[i]] = needlelen - 1 - i;
     }
+
+    while (k <= last) {
+        unsigned char c = buf[k + needlelen - 1];
+        if (c == needle[needlelen - 1] && memcmp(&buf[k], needle, needlelen - 1) == 0) {
+            _search_bytes += k + needlelen - from;
+            return k;
+        }
+        k += skip[c];
+    }
+    _search_bytes += end - from;
     return -1;
 }
 
-bool
-PTFFormat::jumpto(uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen) {
-    uint64_t i;
-    uint64_t k = *currpos;
-    while (k + needlelen < maxoffset) {
-        bool foundall = true;
-        for (i = 0; i < needlelen; i++) {
-            if (buf[k+i] != needle[i]) {
-                foundall = false;
+/* Position of the last needle in buf[from, end), or -1 if there is none. The
+   mirror image of find_needle(): Horspool shifts on the first byte of the window. */
+int64_t
+PTFFormat::rfind_needle(const unsigned char *buf, uint64_t from, uint64_t end, const unsigned char *needle, uint32_t needlelen) {
+    if (needlelen == 0 || from + needlelen > end) {
+        return -1;
+    }
+
+    uint64_t k = end - needlelen; // last candidate position
+
+    if (needlelen < HORSPOOL_MIN_NEEDLE) {
+        for (;; k--) {
+            if (buf[k] == needle[0] && memcmp(&buf[k + 1], needle + 1, needlelen - 1) == 0) {
+                _search_bytes += end - k;
+                return k;
+            }
+            if (k == from) {
                 break;
             }
         }
-        if (foundall) {
-            *currpos = k;
-            return true;
+        _search_bytes += end - from;
+        return -1;
+    }
+
+    uint32_t skip[256];
+    for (int c = 0; c < 256; c++) {
+        skip[c] = needlelen;
+    }
+    for (uint32_t i = needlelen - 1; i > 0; i--) {
+        skip[needle[i]] = i;
+    }
+
+    for (;;) {
+        unsigned char c = buf[k];
+        if (c == needle[0] && memcmp(&buf[k + 1], needle + 1, needlelen - 1) == 0) {
+            _search_bytes += end - k;
+            return k;
         }
-        k++;
+        if (k - from < skip[c]) {
+            break;
+        }
+        k -= skip[c];
     }
-    return false;
+    _search_bytes += end - from;
+    return -1;
+}
+
+/* Position of the first needle within the first n bytes of haystack, or -1 */
+int64_t
+PTFFormat::foundat(unsigned char *haystack, uint64_t n, const char *needle) {
+    return find_needle(haystack, 0, n, (const unsigned char *)needle, strlen(needle));
+}
+
+/* Moves currpos forward to the next needle ending before maxoffset - 1 */
+bool
+PTFFormat::jumpto(uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen) {
+    int64_t found;
+
+    if (maxoffset == 0)
+        return false;
+    found = find_needle(buf, *currpos, maxoffset - 1, needle, needlelen);
+    if (found < 0)
+        return false;
+    *currpos = found;
+    return true;
 }
 
+/* Moves currpos back to the closest needle at or before it, never matching at 0 */
 bool
 PTFFormat::jumpback(uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen) {
-    uint64_t i;
-    uint64_t k = *currpos;
-    while (k > 0 && k + needlelen < maxoffset) {
-        bool foundall = true;
-        for (i = 0; i < needlelen; i++) {
-            if (buf[k+i] != needle[i]) {
-                foundall = false;
-                break;
-            }
-        }
-        if (foundall) {
-            *currpos = k;
-            return true;
-        }
-        k--;
-    }
-    return false;
+    int64_t found;
+
+    // candidates have to end before maxoffset - 1, as with jumpto
+    if (needlelen == 0 || (uint64_t)*currpos + needlelen >= maxoffset)
+        return false;
+    found = rfind_needle(buf, 1, (uint64_t)*currpos + needlelen, needle, needlelen);
+    if (found < 0)
+        return false;
+    *currpos = found;
+    return true;
 }
 
 bool
@@ -213,74 +361,424 @@ PTFFormat::foundin(std::string const& haystack, std::string const& needle) {
      0    success
     -1    error decrypting pt session
 */
+static PTFFormat::file_stat_t
+file_stat_of(const struct stat& st) {
+    PTFFormat::file_stat_t ret;
+
+    ret.size = st.st_size;
+#if defined(__APPLE__)
+    ret.mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    ret.mtime_ns = (int64_t)st.st_mtime * 1000000000;
+#else
+    ret.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return ret;
+}
+
 int
-PTFFormat::unxor(std::string const& path) {
+PTFFormat::stat_file(std::string const& path, file_stat_t& st) {
+    struct stat buf;
+
+    if (stat(path.c_str(), &buf) != 0) {
+        return -1;
+    }
+    st = file_stat_of(buf);
+    return 0;
+}
+
+int
+PTFFormat::unxor(std::string const& path, load_mode_t mode) {
     FILE *fp;
-    unsigned char xxor[256];
-    unsigned char ct;
-    uint64_t i;
-    uint8_t xor_type;
-    uint8_t xor_value;
-    uint8_t xor_delta;
-    uint16_t xor_len;
+    int ret;
+
+    free_unxored();
 
     if (! (fp = ptf_open(path.c_str(), "rb"))) {
         return -1;
     }
+    // taken before reading, so a session changed while it is read looks changed
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0) {
+        _file_stat = file_stat_of(st);
+    }
 
-    fseek(fp, 0, SEEK_END);
-    _len = ftell(fp);
-    if (_len < 0x14) {
+#ifdef PTF_HAVE_MMAP
+    if (mode == LOAD_MMAP && unxor_mmap(fp) == 0) {
         fclose(fp);
+        return unxor_buffer();
+    }
+#endif
+
+    ret = unxor_read(fp);
+    fclose(fp);
+    if (ret) {
+        return ret;
+    }
+    return unxor_buffer();
+}
+
+#ifdef PTF_HAVE_MMAP
+/* Maps a regular file privately (copy-on-write) so that decryption can happen
+   in place without reading the file into a separate buffer. Returns -1 for
+   anything that cannot be mapped, caller is expected to fall back to reading. */
+int
+PTFFormat::unxor_mmap(FILE *fp) {
+    struct stat st;
+    void *map;
+
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 0x14) {
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED) {
         return -1;
     }
+# ifdef MADV_SEQUENTIAL
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+# endif
+
+    _ptfunxored = (unsigned char*) map;
+    _ptfunxored_mapped = true;
+    _len = st.st_size;
+    return 0;
+}
+#endif
+
+/* Reads the whole file into a heap buffer using block reads. Size is taken from
+   the file when it is seekable, otherwise (pipes, character devices) the buffer
+   is grown until EOF. */
+int
+PTFFormat::unxor_read(FILE *fp) {
+    static const uint64_t READ_CHUNK = 1 << 20;
+    uint64_t capacity = 0;
+    unsigned char *grown;
+    size_t n;
+    int c;
+
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        long end = ftell(fp);
+        if (end > 0) {
+            capacity = end;
+        }
+        fseek(fp, 0, SEEK_SET);
+    }
+    if (capacity == 0) {
+        capacity = READ_CHUNK;
+    }
 
-    if (! (_ptfunxored = (unsigned char*) malloc(_len * sizeof(unsigned char)))) {
+    if (! (_ptfunxored = (unsigned char*) malloc(capacity * sizeof(unsigned char)))) {
         /* Silently fail -- out of memory*/
-        fclose(fp);
-        _ptfunxored = 0;
         return -1;
     }
 
-    /* The first 20 bytes are always unencrypted */
-    fseek(fp, 0x00, SEEK_SET);
-    i = fread(_ptfunxored, 1, 0x14, fp);
-    if (i < 0x14) {
-        fclose(fp);
+    _len = 0;
+    for (;;) {
+        if (_len == capacity) {
+            // buffer is full, only grow it if there is actually more to read
+            if ((c = fgetc(fp)) == EOF) {
+                break;
+            }
+            capacity = capacity * 2;
+            if (! (grown = (unsigned char*) realloc(_ptfunxored, capacity * sizeof(unsigned char)))) {
+                return -1;
+            }
+            _ptfunxored = grown;
+            _ptfunxored[_len++] = c;
+        }
+        if ((n = fread(_ptfunxored + _len, 1, capacity - _len, fp)) == 0) {
+            break;
+        }
+        _len += n;
+    }
+
+    if (_len < 0x14) {
         return -1;
     }
+    return 0;
+}
 
-    xor_type = _ptfunxored[0x12];
-    xor_value = _ptfunxored[0x13];
-    xor_len = 256;
+/* Decrypts _ptfunxored in place, the first 20 bytes are always unencrypted
+   and hold the xor type and key */
+int
+PTFFormat::unxor_buffer(void) {
+    if (!_ptfunxored || _len < 0x14) {
+        return -1;
+    }
 
     // xor_type 0x01 = ProTools 5, 6, 7, 8 and 9
     // xor_type 0x05 = ProTools 10, 11, 12
+    if (!unxor_range(&_ptfunxored[0x14], _len - 0x14, 0x14, _ptfunxored[0x12], _ptfunxored[0x13])) {
+        return -1;
+    }
+    return 0;
+}
+
+/* XOR decryption kernels.
+   xor_type 0x01 keys repeat every 256 bytes and xor_type 0x05 keys are a single byte
+   for every 4096 byte page, so every kernel only needs two primitives: xoring a
+   repeating 256 byte pattern and xoring a constant byte. */
+
+// 256 byte key pattern followed by a copy of its head, so that a vector load
+// starting anywhere in the pattern never has to wrap around
+#define XOR_PATTERN_LEN		(256 + 32)
+
+struct xor_kernel_ops {
+    void (*xor_byte)(unsigned char *buf, uint64_t len, uint8_t key);
+    void (*xor_pattern)(unsigned char *buf, uint64_t len, const unsigned char *pattern, uint32_t phase);
+};
+
+static void
+xor_byte_scalar(unsigned char *buf, uint64_t len, uint8_t key) {
+    const uint64_t key8 = key * 0x0101010101010101ULL;
+    uint64_t i = 0, b;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&b, buf + i, 8);
+        b ^= key8;
+        memcpy(buf + i, &b, 8);
+    }
+    for (; i < len; i++) {
+        buf[i] ^= key;
+    }
+}
+
+static void
+xor_pattern_scalar(unsigned char *buf, uint64_t len, const unsigned char *pattern, uint32_t phase) {
+    uint64_t i = 0, b, k;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&b, buf + i, 8);
+        memcpy(&k, pattern + ((phase + i) & 0xff), 8);
+        b ^= k;
+        memcpy(buf + i, &b, 8);
+    }
+    for (; i < len; i++) {
+        buf[i] ^= pattern[(phase + i) & 0xff];
+    }
+}
+
+#ifdef PTF_HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void
+xor_byte_sse2(unsigned char *buf, uint64_t len, uint8_t key) {
+    const __m128i k = _mm_set1_epi8((char)key);
+    uint64_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i));
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(b, k));
+    }
+    xor_byte_scalar(buf + i, len - i, key);
+}
+
+__attribute__((target("sse2")))
+static void
+xor_pattern_sse2(unsigned char *buf, uint64_t len, const unsigned char *pattern, uint32_t phase) {
+    uint64_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i k = _mm_loadu_si128((const __m128i *)(pattern + ((phase + i) & 0xff)));
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(b, k));
+    }
+    xor_pattern_scalar(buf + i, len - i, pattern, (phase + i) & 0xff);
+}
+
+__attribute__((target("avx2")))
+static void
+xor_byte_avx2(unsigned char *buf, uint64_t len, uint8_t key) {
+    const __m256i k = _mm256_set1_epi8((char)key);
+    uint64_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+        _mm256_storeu_si256((__m256i *)(buf + i), _mm256_xor_si256(b0, k));
+        _mm256_storeu_si256((__m256i *)(buf + i + 32), _mm256_xor_si256(b1, k));
+    }
+    xor_byte_scalar(buf + i, len - i, key);
+}
+
+__attribute__((target("avx2")))
+static void
+xor_pattern_avx2(unsigned char *buf, uint64_t len, const unsigned char *pattern, uint32_t phase) {
+    uint64_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i k = _mm256_loadu_si256((const __m256i *)(pattern + ((phase + i) & 0xff)));
+        _mm256_storeu_si256((__m256i *)(buf + i), _mm256_xor_si256(b, k));
+    }
+    xor_pattern_scalar(buf + i, len - i, pattern, (phase + i) & 0xff);
+}
+#endif
+
+static const xor_kernel_ops XOR_OPS_SCALAR = { xor_byte_scalar, xor_pattern_scalar };
+#ifdef PTF_HAVE_X86_KERNELS
+static const xor_kernel_ops XOR_OPS_SSE2 = { xor_byte_sse2, xor_pattern_sse2 };
+static const xor_kernel_ops XOR_OPS_AVX2 = { xor_byte_avx2, xor_pattern_avx2 };
+#endif
+
+bool
+PTFFormat::xor_kernel_supported(xor_kernel_t kernel) {
+    switch (kernel) {
+    case XOR_KERNEL_AUTO:
+    case XOR_KERNEL_SCALAR:
+        return true;
+#ifdef PTF_HAVE_X86_KERNELS
+    case XOR_KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case XOR_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+static const xor_kernel_ops&
+xor_kernel_ops_for(PTFFormat::xor_kernel_t kernel) {
+    // CPU features are only probed once, on first use
+    static const PTFFormat::xor_kernel_t best =
+        PTFFormat::xor_kernel_supported(PTFFormat::XOR_KERNEL_AVX2) ? PTFFormat::XOR_KERNEL_AVX2 :
+        PTFFormat::xor_kernel_supported(PTFFormat::XOR_KERNEL_SSE2) ? PTFFormat::XOR_KERNEL_SSE2 :
+        PTFFormat::XOR_KERNEL_SCALAR;
+
+    if (kernel == PTFFormat::XOR_KERNEL_AUTO || !PTFFormat::xor_kernel_supported(kernel)) {
+        kernel = best;
+    }
+    switch (kernel) {
+#ifdef PTF_HAVE_X86_KERNELS
+    case PTFFormat::XOR_KERNEL_AVX2:
+        return XOR_OPS_AVX2;
+    case PTFFormat::XOR_KERNEL_SSE2:
+        return XOR_OPS_SSE2;
+#endif
+    default:
+        return XOR_OPS_SCALAR;
+    }
+}
+
+bool
+PTFFormat::unxor_range(unsigned char *data, uint64_t len, uint64_t pos, uint8_t xor_type, uint8_t xor_value, xor_kernel_t kernel) {
+    const xor_kernel_ops& ops = xor_kernel_ops_for(kernel);
+    unsigned char pattern[XOR_PATTERN_LEN];
+    uint8_t xor_delta;
+    uint64_t n;
+
     switch(xor_type) {
     case 0x01:
         xor_delta = gen_xor_delta(xor_value, 53, false);
-        break;
+        for (uint32_t i = 0; i < XOR_PATTERN_LEN; i++) {
+            pattern[i] = (i * xor_delta) & 0xff;
+        }
+        ops.xor_pattern(data, len, pattern, pos & 0xff);
+        return true;
     case 0x05:
         xor_delta = gen_xor_delta(xor_value, 11, true);
-        break;
+        while (len > 0) {
+            // key byte only changes on 4096 byte page boundaries
+            n = min(len, (((pos >> 12) + 1) << 12) - pos);
+            ops.xor_byte(data, n, (((pos >> 12) & 0xff) * xor_delta) & 0xff);
+            data += n;
+            pos += n;
+            len -= n;
+        }
+        return true;
     default:
-        fclose(fp);
-        return -1;
+        return false;
     }
+}
+
+void
+PTFFormat::free_unxored(void) {
+#ifdef PTF_HAVE_MMAP
+    if (_ptfunxored_mapped) {
+        munmap(_ptfunxored, _len);
+        _ptfunxored_mapped = false;
+        _ptfunxored = NULL;
+    }
+#endif
+    free(_ptfunxored);
+    _ptfunxored = NULL;
+}
 
-    /* Generate the xor_key */
-    for (i=0; i < xor_len; i++)
-        xxor[i] = (i * xor_delta) & 0xff;
+/* Reads until len bytes are read or EOF is reached, returns bytes read or -1 on error */
+static int64_t
+read_full(int fd, unsigned char *buf, uint64_t len) {
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
 
-    /* Read file and decrypt rest of file */
-    i = 0x14;
-    fseek(fp, i, SEEK_SET);
-    while (fread(&ct, 1, 1, fp) != 0) {
-        uint8_t xor_index = (xor_type == 0x01) ? i & 0xff : (i >> 12) & 0xff;
-        _ptfunxored[i++] = ct ^ xxor[xor_index];
+static bool
+write_full(int fd, const unsigned char *buf, uint64_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
     }
-    fclose(fp);
-    return 0;
+    return true;
+}
+
+/* Return values:
+     0    success
+    -1    error decrypting pt session (or reading / writing data)
+*/
+int
+PTFFormat::unxor_stream(int fd_in, unxor_sink_t const& sink) {
+    static const uint64_t STREAM_CHUNK = 64 * 1024;
+    std::vector<unsigned char> buf(STREAM_CHUNK);
+    uint8_t xor_type, xor_value;
+    uint64_t pos;
+    int64_t n;
+
+    /* The first 20 bytes are always unencrypted */
+    if (read_full(fd_in, buf.data(), 0x14) != 0x14) {
+        return -1;
+    }
+    xor_type = buf[0x12];
+    xor_value = buf[0x13];
+    if (xor_type != 0x01 && xor_type != 0x05) {
+        return -1;
+    }
+    if (!sink(buf.data(), 0x14)) {
+        return -1;
+    }
+
+    pos = 0x14;
+    while ((n = read_full(fd_in, buf.data(), STREAM_CHUNK)) > 0) {
+        unxor_range(buf.data(), n, pos, xor_type, xor_value);
+        if (!sink(buf.data(), n)) {
+            return -1;
+        }
+        pos += n;
+    }
+    return n < 0 ? -1 : 0;
+}
+
+int
+PTFFormat::unxor_stream(int fd_in, int fd_out) {
+    return unxor_stream(fd_in, [fd_out](const unsigned char *data, uint64_t len) {
+        return write_full(fd_out, data, len);
+    });
 }
 
 /* Return values:
@@ -293,19 +791,208 @@ PTFFormat::unxor(std::string const& path) {
    -6    error parsing audio
    -7    error parsing region/track info
    -8    error parsing midi
-   -9    error parsing metadata
+   -9    error locating metadata (a malformed metadata struct loads with empty metadata)
    -10   error parsing key signatures
    -11   error parsing time signatures
    -12   error parsing tempo changes
 */
 int
-PTFFormat::load(std::string const& ptf) {
+PTFFormat::load(std::string const& ptf, load_mode_t mode, uint32_t sections, load_stats_t *stats) {
     cleanup();
     _path = ptf;
 
-    if (unxor(_path))
-        return -1;
+    uint64_t t = now_ns();
+    if (unxor(_path, mode))
+        return finish_load(-1, stats);
+    stage_done(STAGE_UNXOR, t);
+
+    return finish_load(load_unxored(sections), stats);
+}
+
+std::shared_ptr<const PTFFormat>
+PTFFormat::load_snapshot(std::string const& path, int *err, load_mode_t mode, uint32_t sections,
+                         load_stats_t *stats) {
+    std::shared_ptr<PTFFormat> ptf = std::make_shared<PTFFormat>();
+    int ret = ptf->load(path, mode, sections, stats);
+
+    if (err) {
+        *err = ret;
+    }
+    if (ret) {
+        return std::shared_ptr<const PTFFormat>();
+    }
+    return ptf;
+}
+
+/* Runs compute() unless done is set, at most once until the next load(). Threads
+   arriving while it runs wait for it, afterwards done is only read.
+   compute() runs holding _derived_lock, which is not recursive, so it must never
+   call another lazily derived accessor: fetch those before entering, as
+   main_values() does with region_ranges(). */
+template <class F>
+void
+PTFFormat::compute_once(std::atomic<bool>& done, F compute) const {
+    if (done.load(std::memory_order_acquire)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_derived_lock);
+    if (!done.load(std::memory_order_relaxed)) {
+        compute();
+        done.store(true, std::memory_order_release);
+    }
+}
+
+int
+PTFFormat::load_buffer(const void *data, uint64_t len, uint32_t sections, load_stats_t *stats) {
+    cleanup();
 
+    if (len < 0x14 || ! (_ptfunxored = (unsigned char*) malloc(len * sizeof(unsigned char)))) {
+        return finish_load(-1, stats);
+    }
+    uint64_t t = now_ns();
+    memcpy(_ptfunxored, data, len);
+    _len = len;
+
+    if (unxor_buffer())
+        return finish_load(-1, stats);
+    stage_done(STAGE_UNXOR, t);
+
+    return finish_load(load_unxored(sections), stats);
+}
+
+int
+PTFFormat::load_owned(unsigned char *data, uint64_t len, uint32_t sections, load_stats_t *stats) {
+    cleanup();
+
+    _ptfunxored = data;
+    _len = len;
+
+    uint64_t t = now_ns();
+    if (unxor_buffer())
+        return finish_load(-1, stats);
+    stage_done(STAGE_UNXOR, t);
+
+    return finish_load(load_unxored(sections), stats);
+}
+
+/* Fills in the counters of _load_stats at the end of any load and copies it to stats */
+int
+PTFFormat::finish_load(int ret, load_stats_t *stats) {
+    std::vector<const midi_columns_t*> chunks;
+
+    _load_stats.bytes = _len;
+    _load_stats.blocks = _blocks.size();
+    _load_stats.block_probes = _block_probes;
+    _load_stats.search_bytes = _search_bytes;
+    _load_stats.wavs = _audiofiles.size();
+    _load_stats.regions = _regions.size() + _midiregions.size();
+    _load_stats.tracks = _tracks.size() + _miditracks.size();
+    _load_stats.midi_events = 0;
+    midi_chunks(chunks);
+    for (const midi_columns_t *c : chunks) {
+        _load_stats.midi_events += c->size();
+    }
+    _load_stats.heap_bytes = heap_bytes();
+
+    if (stats) {
+        *stats = _load_stats;
+    }
+    return ret;
+}
+
+template <class T>
+static uint64_t
+vector_heap_bytes(const std::vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+static uint64_t
+string_heap_bytes(const std::string& s) {
+    // contents up to the small string capacity are stored inline
+    return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+}
+
+/* Estimate for hash maps: the bucket array and one node per element */
+template <class M>
+static uint64_t
+map_heap_bytes(const M& m) {
+    return m.bucket_count() * sizeof(void*) + m.size() * (sizeof(typename M::value_type) + 2 * sizeof(void*));
+}
+
+static uint64_t
+region_heap_bytes(const PTFFormat::region_t& r) {
+    return string_heap_bytes(r.name) + string_heap_bytes(r.wave.filename);
+}
+
+/* Distinct MIDI chunks of all MIDI regions and tracks, a chunk being shared by
+   every region and track made from the same MIDI events block */
+void
+PTFFormat::midi_chunks(std::vector<const midi_columns_t*>& chunks) const {
+    chunks.clear();
+    for (const region_t& r : _midiregions) {
+        chunks.push_back(&r.midi.columns());
+    }
+    for (const track_t& t : _miditracks) {
+        chunks.push_back(&t.reg.midi.columns());
+    }
+    std::sort(chunks.begin(), chunks.end());
+    chunks.erase(std::unique(chunks.begin(), chunks.end()), chunks.end());
+}
+
+/* Heap memory retained by the session, counting shared MIDI chunks once. Temporaries
+   freed during the load and spare capacity released by reallocation are not included. */
+uint64_t
+PTFFormat::heap_bytes(void) const {
+    std::vector<const midi_columns_t*> chunks;
+    uint64_t n = 0;
+
+    if (!_ptfunxored_mapped) {
+        n += _len;
+    }
+    n += vector_heap_bytes(_blocks);
+    n += map_heap_bytes(_blocks_by_type) + map_heap_bytes(_toplevel_blocks_by_type);
+    for (const auto& by_type : _blocks_by_type) {
+        n += vector_heap_bytes(by_type.second);
+    }
+    for (const auto& by_type : _toplevel_blocks_by_type) {
+        n += vector_heap_bytes(by_type.second);
+    }
+
+    n += vector_heap_bytes(_audiofiles);
+    for (const wav_t& w : _audiofiles) {
+        n += string_heap_bytes(w.filename);
+    }
+    n += vector_heap_bytes(_regions) + vector_heap_bytes(_midiregions);
+    for (const region_t& r : _regions) {
+        n += region_heap_bytes(r);
+    }
+    for (const region_t& r : _midiregions) {
+        n += region_heap_bytes(r);
+    }
+    n += vector_heap_bytes(_tracks) + vector_heap_bytes(_miditracks);
+    for (const track_t& t : _tracks) {
+        n += string_heap_bytes(t.name) + region_heap_bytes(t.reg);
+    }
+    for (const track_t& t : _miditracks) {
+        n += string_heap_bytes(t.name) + region_heap_bytes(t.reg);
+    }
+    midi_chunks(chunks);
+    for (const midi_columns_t *c : chunks) {
+        n += sizeof(midi_columns_t) + vector_heap_bytes(c->pos) + vector_heap_bytes(c->length) +
+             vector_heap_bytes(c->note) + vector_heap_bytes(c->velocity);
+    }
+
+    n += map_heap_bytes(_track_index) + map_heap_bytes(_region_index) + map_heap_bytes(_miditrack_index) +
+         map_heap_bytes(_midiregion_index) + map_heap_bytes(_wav_index);
+    n += vector_heap_bytes(_keysignatures) + vector_heap_bytes(_timesignatures) + vector_heap_bytes(_tempochanges);
+    n += _tempo_map.heap_bytes() + _grid_map.heap_bytes();
+    n += string_heap_bytes(_path);
+    return n;
+}
+
+/* Common part of all load() variants once _ptfunxored holds the decrypted session */
+int
+PTFFormat::load_unxored(uint32_t sections) {
     if (parse_version())
         return -2;
 
@@ -313,7 +1000,7 @@ PTFFormat::load(std::string const& ptf) {
         return -3;
 
     int err = 0;
-    if ((err = parse())) {
+    if ((err = parse(sections))) {
         return err - 3; // -4, -5, -6, -7, -8, ...
     }
 
@@ -323,15 +1010,15 @@ PTFFormat::load(std::string const& ptf) {
 bool
 PTFFormat::parse_version() {
     bool failed = true;
-    struct block_t b;
+    block_t b;
 
-    if (_ptfunxored[0] != '\x03' && foundat(_ptfunxored, 0x100, BITCODE) != 1) {
+    if (_ptfunxored[0] != '\x03' && foundat(_ptfunxored, std::min<uint64_t>(_len, 0x100 + strlen(BITCODE) - 1), BITCODE) != 1) {
         return failed;
     }
 
     is_bigendian = !!_ptfunxored[0x11];
 
-    if (!parse_block_at(0x1f, &b, NULL, 0)) {
+    if (!parse_block_header(0x1f, _len, b)) {
         _version = _ptfunxored[0x40];
         if (_version == 0) {
             _version = _ptfunxored[0x3d];
@@ -357,115 +1044,452 @@ PTFFormat::parse_version() {
     }
 }
 
+/* Inverse of multiplication by an odd number modulo 256, i.e. table[(i * mul) & 0xff] == i */
+struct xor_inverse_table {
+    uint8_t inverse[256];
+
+    constexpr xor_inverse_table(uint8_t mul) : inverse() {
+        for (int i = 0; i < 256; i++) {
+            inverse[(i * mul) & 0xff] = i;
+        }
+    }
+};
+
+static constexpr xor_inverse_table XOR_INVERSE_53(53);
+static constexpr xor_inverse_table XOR_INVERSE_11(11);
+
 uint8_t
 PTFFormat::gen_xor_delta(uint8_t xor_value, uint8_t mul, bool negative) {
-    uint16_t i;
-    for (i = 0; i < 256; i++) {
-        if (((i * mul) & 0xff) == xor_value) {
-                return (negative) ? i * (-1) : i;
-        }
+    uint8_t i;
+    switch (mul) {
+    case 53:
+        i = XOR_INVERSE_53.inverse[xor_value];
+        break;
+    case 11:
+        i = XOR_INVERSE_11.inverse[xor_value];
+        break;
+    default:
+        // Should not occur
+        return 0;
     }
-    // Should not occur
-    return 0;
+    return (negative) ? i * (-1) : i;
+}
+
+/* Position of the first ZMARK in [pos, end), or end if there is none */
+uint32_t
+PTFFormat::next_zmark(uint32_t pos, uint32_t end) const {
+    const void *found;
+
+    if (pos >= end)
+        return end;
+    found = memchr(&_ptfunxored[pos], ZMARK, end - pos);
+    return found ? (const unsigned char *)found - _ptfunxored : end;
 }
 
 bool
-PTFFormat::parse_block_at(uint32_t pos, struct block_t *block, struct block_t *parent, int level) {
-    struct block_t b;
-    int childjump = 0;
-    uint32_t i;
-    uint32_t max = _len;
+PTFFormat::parse_block_header(uint32_t pos, uint32_t max, block_t& b) {
+    _block_probes++;
 
     if (_ptfunxored[pos] != ZMARK)
         return false;
-
-    if (parent)
-        max = parent->block_size + parent->offset;
+    if ((uint64_t)pos + 9 > _len)
+        return false;
 
     b.block_type = u_endian_read2(&_ptfunxored[pos+1], is_bigendian);
     b.block_size = u_endian_read4(&_ptfunxored[pos+3], is_bigendian);
     b.content_type = u_endian_read2(&_ptfunxored[pos+7], is_bigendian);
     b.offset = pos + 7;
+    b.parent = NO_BLOCK;
+    b.first_child = NO_BLOCK;
+    b.next_sibling = NO_BLOCK;
 
-    if (b.block_size + b.offset > max)
+    if ((uint64_t)b.block_size + b.offset > max)
         return false;
     if (b.block_type & 0xff00)
         return false;
+    return true;
+}
 
-    block->block_type = b.block_type;
-    block->block_size = b.block_size;
-    block->content_type = b.content_type;
-    block->offset = b.offset;
-    block->child.clear();
+/* State of the child scan of one block, see parse_block_at() */
+struct block_scan_t {
+    uint32_t index;      // block being scanned
+    uint32_t pos;        // position of its ZMARK
+    uint32_t max;        // end of its parent
+    uint32_t i;          // next candidate, relative to pos
+    uint32_t childjump;  // size of the child found last, 0 if none
+    uint32_t last_child; // index of the child found last
+};
 
-    for (i = 1; (i < block->block_size) && (pos + i + childjump < max); i += childjump ? childjump : 1) {
-        int p = pos + i;
-        struct block_t bchild;
-        childjump = 0;
-        if (parse_block_at(p, &bchild, block, level+1)) {
-            block->child.push_back(bchild);
-            childjump = bchild.block_size + 7;
+/* Appends the block at pos and all of its descendants to _blocks in pre-order,
+ * returns its index.
+ *
+ * Children are searched for in the body of a block, candidates being only the
+ * ZMARK bytes not covered by a child found before. Every byte is therefore looked
+ * at by one block scan only, which keeps the work linear in the size of the
+ * session regardless of nesting. The scan is iterative so that nesting depth of
+ * damaged sessions is not limited by the stack.
+ */
+uint32_t
+PTFFormat::parse_block_at(uint32_t pos, uint32_t parent) {
+    std::vector<block_scan_t> stack;
+    block_t b;
+    uint32_t max = _len;
+    uint32_t root;
+
+    if (parent != NO_BLOCK)
+        max = _blocks[parent].block_size + _blocks[parent].offset;
+
+    if (!parse_block_header(pos, max, b))
+        return NO_BLOCK;
+
+    b.parent = parent;
+    root = _blocks.size();
+    _blocks.push_back(b);
+    stack.push_back({ root, pos, max, 1, 0, NO_BLOCK });
+    _load_stats.max_depth = std::max<uint32_t>(_load_stats.max_depth, 1);
+
+    while (!stack.empty()) {
+        block_scan_t& s = stack.back();
+        uint32_t size = _blocks[s.index].block_size;
+        uint32_t block_end = _blocks[s.index].offset + size;
+        uint32_t end = std::min(s.pos + size, s.max);
+        uint32_t child;
+        block_t c;
+
+        if (s.i >= size || (uint64_t)s.pos + s.i + s.childjump >= s.max) {
+            stack.pop_back();
+            continue;
+        }
+
+        // Only a ZMARK can start a block, so skip right to the next one
+        s.childjump = 0;
+        s.i = next_zmark(s.pos + s.i, end) - s.pos;
+        if (s.pos + s.i >= end) {
+            stack.pop_back();
+            continue;
         }
+
+        if (!parse_block_header(s.pos + s.i, block_end, c)) {
+            s.i++;
+            continue;
+        }
+
+        c.parent = s.index;
+        child = _blocks.size();
+        _blocks.push_back(c);
+        if (s.last_child == NO_BLOCK) {
+            _blocks[s.index].first_child = child;
+        } else {
+            _blocks[s.last_child].next_sibling = child;
+        }
+        s.last_child = child;
+        s.childjump = c.block_size + 7;
+        s.i += s.childjump;
+
+        // Invalidates s
+        stack.push_back({ child, c.offset - 7, block_end, 1, 0, NO_BLOCK });
+        _load_stats.max_depth = std::max<uint32_t>(_load_stats.max_depth, stack.size());
     }
-    return true;
+    return root;
 }
 
 void
-PTFFormat::free_block(struct block_t& b)
+PTFFormat::free_all_blocks(void)
 {
-    for (vector<PTFFormat::block_t>::iterator c = b.child.begin();
-            c != b.child.end(); ++c) {
-        free_block(*c);
+    _blocks.clear();
+    _blocks_by_type.clear();
+    _toplevel_blocks_by_type.clear();
+    _block_probes = 0;
+    _block_hashes_cached = false;
+    _block_hashes.clear();
+}
+
+void
+PTFFormat::parseblocks(void) {
+    uint32_t i = 20;
+    uint32_t last = NO_BLOCK;
+
+    _block_probes = 0;
+
+    // Every block starts with its own 7 byte header (ZMARK, block type, block size), so
+    // a well formed session has fewer blocks than this and the scan never reallocates
+    _blocks.reserve(_len / 7);
+
+    while ((i = next_zmark(i, _len)) < _len) {
+        uint32_t b = parse_block_at(i, NO_BLOCK);
+        if (b != NO_BLOCK) {
+            if (last != NO_BLOCK) {
+                _blocks[last].next_sibling = b;
+            }
+            last = b;
+            i += _blocks[b].block_size ? _blocks[b].block_size + 7 : 1;
+        } else {
+            i++;
+        }
     }
 
-    b.child.clear();
+    // Release the spare capacity before pointers into _blocks are taken below,
+    // _blocks is final at this point so they stay stable
+    _blocks.shrink_to_fit();
+    for (vector<PTFFormat::block_t>::const_iterator b = _blocks.begin();
+            b != _blocks.end(); ++b) {
+        index_block(*b);
+    }
 }
 
 void
-PTFFormat::free_all_blocks(void)
-{
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        free_block(*b);
+PTFFormat::index_block(const block_t& b) {
+    _blocks_by_type[b.content_type].push_back(&b);
+    if (b.parent == NO_BLOCK) {
+        _toplevel_blocks_by_type[b.content_type].push_back(&b);
     }
+}
 
-    _blocks.clear();
+void
+PTFFormat::nest_block(const block_t& b, std::vector<nested_block_t>& v) const {
+    nested_block_t n;
+    n.block_type = b.block_type;
+    n.block_size = b.block_size;
+    n.content_type = b.content_type;
+    n.offset = b.offset;
+    for (const block_t& c : children(b)) {
+        nest_block(c, n.child);
+    }
+    v.push_back(n);
 }
 
+std::vector<PTFFormat::nested_block_t>
+PTFFormat::nested_blocks() const {
+    std::vector<nested_block_t> v;
+    for (const block_t& b : toplevel_blocks()) {
+        nest_block(b, v);
+    }
+    return v;
+}
+
+static inline uint64_t
+hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t
+hash_combine(uint64_t h, uint64_t v) {
+    return hash_mix(h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+/* Multiply-xorshift over 8 byte words, finished with the murmur3 mixer */
+uint64_t
+PTFFormat::hash_bytes(const unsigned char *data, uint64_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    uint64_t tail = 0;
+    for (uint64_t j = 0; i + j < len; j++) {
+        tail |= (uint64_t)data[i + j] << (j * 8);
+    }
+    return hash_mix(h ^ tail);
+}
+
+/* Children always come after their parent in _blocks, so walking it backwards
+   hashes every child before its parent. Children lie within their parent in
+   order, the bytes around them (including their headers) are hashed in between. */
 void
-PTFFormat::parseblocks(void) {
-    uint32_t i = 20;
+PTFFormat::hash_blocks(void) const {
+    _block_hashes.assign(_blocks.size(), 0);
+
+    for (size_t i = _blocks.size(); i-- > 0;) {
+        const block_t& b = _blocks[i];
+        uint64_t h = hash_combine(hash_combine(b.block_type, b.content_type), b.block_size);
+        uint64_t pos = b.offset;
+        uint64_t end = std::min((uint64_t)b.offset + b.block_size, _len);
+
+        for (const block_t& c : children(b)) {
+            if (c.offset > pos) {
+                h = hash_combine(h, hash_bytes(&_ptfunxored[pos], c.offset - pos));
+            }
+            h = hash_combine(h, _block_hashes[&c - &_blocks[0]]);
+            pos = std::max(pos, (uint64_t)c.offset + c.block_size);
+        }
+        if (end > pos) {
+            h = hash_combine(h, hash_bytes(&_ptfunxored[pos], end - pos));
+        }
+        _block_hashes[i] = h;
+    }
+}
 
-    while (i < _len) {
-        struct block_t b;
-        if (parse_block_at(i, &b, NULL, 0)) {
-            _blocks.push_back(b);
+uint64_t
+PTFFormat::block_hash(const block_t& b) const {
+    compute_once(_block_hashes_cached, [this]() { hash_blocks(); });
+    return _block_hashes[&b - &_blocks[0]];
+}
+
+std::vector<PTFFormat::block_diff_t>
+PTFFormat::diff_blocks(const PTFFormat& older, const PTFFormat& newer) {
+    std::vector<block_diff_t> diff;
+
+    older.compute_once(older._block_hashes_cached, [&older]() { older.hash_blocks(); });
+    newer.compute_once(newer._block_hashes_cached, [&newer]() { newer.hash_blocks(); });
+    diff_block_lists(older, older._blocks.empty() ? NO_BLOCK : 0,
+                     newer, newer._blocks.empty() ? NO_BLOCK : 0, diff);
+    return diff;
+}
+
+/* Pairs the siblings starting at a (older) and b (newer). A pair of different blocks
+   of the same type is reported as changed unless one of them matches the next block
+   on the other side, which makes it an insertion or removal instead, and the blocks
+   following the pair differ. */
+void
+PTFFormat::diff_block_lists(const PTFFormat& older, uint32_t a, const PTFFormat& newer, uint32_t b,
+                            std::vector<block_diff_t>& diff) {
+    const std::vector<block_t>& ob = older._blocks;
+    const std::vector<block_t>& nb = newer._blocks;
+    const std::vector<uint64_t>& oh = older._block_hashes;
+    const std::vector<uint64_t>& nh = newer._block_hashes;
+
+    while (a != NO_BLOCK && b != NO_BLOCK) {
+        uint32_t next_a = ob[a].next_sibling;
+        uint32_t next_b = nb[b].next_sibling;
+
+        if (oh[a] == nh[b]) {
+            a = next_a;
+            b = next_b;
+            continue;
         }
-        i += b.block_size ? b.block_size + 7 : 1;
+
+        bool same_type = ob[a].content_type == nb[b].content_type;
+        // Both lists go on alike after this pair, keep it even among repeated blocks
+        bool realigned = same_type && (next_a == NO_BLOCK || next_b == NO_BLOCK ?
+                                       next_a == next_b : oh[next_a] == nh[next_b]);
+        bool added = !realigned && next_b != NO_BLOCK &&
+                     (same_type ? oh[a] == nh[next_b] : ob[a].content_type == nb[next_b].content_type);
+        bool removed = !realigned && next_a != NO_BLOCK &&
+                       (same_type ? oh[next_a] == nh[b] : ob[next_a].content_type == nb[b].content_type);
+
+        if (added) {
+            diff.push_back({ block_diff_t::BLOCK_ADDED, NO_BLOCK, b });
+            b = next_b;
+        } else if (removed) {
+            diff.push_back({ block_diff_t::BLOCK_REMOVED, a, NO_BLOCK });
+            a = next_a;
+        } else if (same_type) {
+            diff.push_back({ block_diff_t::BLOCK_CHANGED, a, b });
+            diff_block_lists(older, ob[a].first_child, newer, nb[b].first_child, diff);
+            a = next_a;
+            b = next_b;
+        } else {
+            diff.push_back({ block_diff_t::BLOCK_REMOVED, a, NO_BLOCK });
+            diff.push_back({ block_diff_t::BLOCK_ADDED, NO_BLOCK, b });
+            a = next_a;
+            b = next_b;
+        }
+    }
+    for (; a != NO_BLOCK; a = ob[a].next_sibling) {
+        diff.push_back({ block_diff_t::BLOCK_REMOVED, a, NO_BLOCK });
+    }
+    for (; b != NO_BLOCK; b = nb[b].next_sibling) {
+        diff.push_back({ block_diff_t::BLOCK_ADDED, NO_BLOCK, b });
     }
 }
 
+const std::vector<const PTFFormat::block_t*>&
+PTFFormat::blocks_of_type(uint16_t content_type) const {
+    static const std::vector<const block_t*> none;
+    block_index_t::const_iterator found = _blocks_by_type.find(content_type);
+    return found != _blocks_by_type.end() ? found->second : none;
+}
+
+const std::vector<const PTFFormat::block_t*>&
+PTFFormat::toplevel_blocks_of_type(uint16_t content_type) const {
+    static const std::vector<const block_t*> none;
+    block_index_t::const_iterator found = _toplevel_blocks_by_type.find(content_type);
+    return found != _toplevel_blocks_by_type.end() ? found->second : none;
+}
+
+/* Top level blocks of either content type, in file order */
+std::vector<const PTFFormat::block_t*>
+PTFFormat::toplevel_blocks_of_types(uint16_t content_type1, uint16_t content_type2) const {
+    const std::vector<const block_t*>& blocks1 = toplevel_blocks_of_type(content_type1);
+    const std::vector<const block_t*>& blocks2 = toplevel_blocks_of_type(content_type2);
+    std::vector<const block_t*> merged;
+
+    merged.reserve(blocks1.size() + blocks2.size());
+    std::merge(blocks1.begin(), blocks1.end(), blocks2.begin(), blocks2.end(), std::back_inserter(merged),
+               [](const block_t *b1, const block_t *b2){ return b1->offset < b2->offset; });
+    return merged;
+}
+
 int
-PTFFormat::parse(void) {
+PTFFormat::parse(uint32_t sections) {
+    // MIDI tracks are found while parsing tracks, which refer to audio files
+    sections |= PARSE_HEADER;
+    if (sections & PARSE_MIDI)
+        sections |= PARSE_REGIONS;
+    if (sections & PARSE_REGIONS)
+        sections |= PARSE_AUDIO;
+
+    uint64_t t = now_ns();
     parseblocks();
+    t = stage_done(STAGE_BLOCKS, t);
     if (!parseheader())
         return -1;
     if (_sessionrate < 44100 || _sessionrate > 192000)
         return -2;
-    if (!parseaudio())
-        return -3;
-    if (!parserest())
-        return -4;
-    if (!parsemidi())
-        return -5;
-    if (!parsemetadata())
-        return -6;
-    if (!parsekeysigs())
-        return -7;
-    if (!parsetimesigs())
-        return -8;
-    if (!parsetempochanges())
-        return -9;
+    t = stage_done(STAGE_HEADER, t);
+    _loaded |= PARSE_HEADER;
+    if (sections & PARSE_AUDIO) {
+        if (!parseaudio())
+            return -3;
+        t = stage_done(STAGE_AUDIO, t);
+        _loaded |= PARSE_AUDIO;
+    }
+    if (sections & PARSE_REGIONS) {
+        if (!parserest())
+            return -4;
+        t = stage_done(STAGE_REST, t);
+        _loaded |= PARSE_REGIONS;
+    }
+    if (sections & PARSE_MIDI) {
+        if (!parsemidi())
+            return -5;
+        t = stage_done(STAGE_MIDI, t);
+        _loaded |= PARSE_MIDI;
+    }
+    if (sections & PARSE_METADATA) {
+        if (!parsemetadata())
+            return -6;
+        t = stage_done(STAGE_METADATA, t);
+        _loaded |= PARSE_METADATA;
+    }
+    if (sections & PARSE_KEYSIGS) {
+        if (!parsekeysigs())
+            return -7;
+        t = stage_done(STAGE_KEYSIGS, t);
+        _loaded |= PARSE_KEYSIGS;
+    }
+    if (sections & PARSE_TIMESIGS) {
+        if (!parsetimesigs())
+            return -8;
+        _grid_map = grid_map_t(_timesignatures);
+        t = stage_done(STAGE_TIMESIGS, t);
+        _loaded |= PARSE_TIMESIGS;
+    }
+    if (sections & PARSE_TEMPO) {
+        if (!parsetempochanges())
+            return -9;
+        stage_done(STAGE_TEMPO, t);
+        _loaded |= PARSE_TEMPO;
+    }
     return 0;
 }
 
@@ -474,17 +1498,15 @@ PTFFormat::parseheader(void) {
     bool found = false;
     uint8_t bitdepthotherblk = 0;
 
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x1028) {
-            _bitdepth = _ptfunxored[b->offset+3];
-            _sessionrate = u_endian_read4(&_ptfunxored[b->offset+4], is_bigendian);
-            found = true;
-        } else if (b->content_type == 0x204b) {
-            // Seems to be available in all versions of format and works not only for 16 / 24 bits
-            // but also for 32bit(float) - reported as 24bit in sample rate info block
-            bitdepthotherblk = _ptfunxored[b->offset+6];
-        }
+    for (const block_t *b : toplevel_blocks_of_type(0x1028)) {
+        _bitdepth = _ptfunxored[b->offset+3];
+        _sessionrate = u_endian_read4(&_ptfunxored[b->offset+4], is_bigendian);
+        found = true;
+    }
+    for (const block_t *b : toplevel_blocks_of_type(0x204b)) {
+        // Seems to be available in all versions of format and works not only for 16 / 24 bits
+        // but also for 32bit(float) - reported as 24bit in sample rate info block
+        bitdepthotherblk = _ptfunxored[b->offset+6];
     }
     if (bitdepthotherblk != 0) {
         _bitdepth = bitdepthotherblk;
@@ -509,58 +1531,55 @@ PTFFormat::parseaudio(void) {
     std::string wavname;
 
     // Parse wav names
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x1004) {
-
-            nwavs = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
-
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
-                if (c->content_type == 0x103a) {
-                    //nstrings = u_endian_read4(&_ptfunxored[c->offset+1], is_bigendian);
-                    pos = c->offset + 11;
-                    // Found wav list
-                    for (i = n = 0; (pos < c->offset + c->block_size) && (n < nwavs); i++) {
-                        wavname = parsestring(pos);
-                        pos += wavname.size() + 4;
-                        wavtype = std::string((const char*)&_ptfunxored[pos], 4);
-                        pos += 9;
-                        if (foundin(wavname, std::string(".grp")))
-                            continue;
-
-                        if (foundin(wavname, std::string("Audio Files"))) {
-                            continue;
-                        }
-                        if (foundin(wavname, std::string("Fade Files"))) {
+    for (const block_t *b : toplevel_blocks_of_type(0x1004)) {
+
+        nwavs = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
+
+        for (block_list_t::const_iterator c = children(*b).begin();
+                c != children(*b).end(); ++c) {
+            if (c->content_type == 0x103a) {
+                //nstrings = u_endian_read4(&_ptfunxored[c->offset+1], is_bigendian);
+                pos = c->offset + 11;
+                // Found wav list
+                for (i = n = 0; (pos < c->offset + c->block_size) && (n < nwavs); i++) {
+                    wavname = parsestring(pos);
+                    pos += wavname.size() + 4;
+                    wavtype = std::string((const char*)&_ptfunxored[pos], 4);
+                    pos += 9;
+                    if (foundin(wavname, std::string(".grp")))
+                        continue;
+
+                    if (foundin(wavname, std::string("Audio Files"))) {
+                        continue;
+                    }
+                    if (foundin(wavname, std::string("Fade Files"))) {
+                        continue;
+                    }
+                    if (_version < 10) {
+                        if (!(foundin(wavtype, std::string("WAVE")) ||
+                                foundin(wavtype, std::string("EVAW")) ||
+                                foundin(wavtype, std::string("AIFF")) ||
+                                foundin(wavtype, std::string("FFIA"))) ) {
                             continue;
                         }
-                        if (_version < 10) {
+                    } else {
+                        if (wavtype[0] != '\0') {
                             if (!(foundin(wavtype, std::string("WAVE")) ||
                                     foundin(wavtype, std::string("EVAW")) ||
                                     foundin(wavtype, std::string("AIFF")) ||
                                     foundin(wavtype, std::string("FFIA"))) ) {
                                 continue;
                             }
-                        } else {
-                            if (wavtype[0] != '\0') {
-                                if (!(foundin(wavtype, std::string("WAVE")) ||
-                                        foundin(wavtype, std::string("EVAW")) ||
-                                        foundin(wavtype, std::string("AIFF")) ||
-                                        foundin(wavtype, std::string("FFIA"))) ) {
-                                    continue;
-                                }
-                            } else if (!(foundin(wavname, std::string(".wav")) || 
-                                    foundin(wavname, std::string(".aif"))) ) {
-                                continue;
-                            }
+                        } else if (!(foundin(wavname, std::string(".wav")) || 
+                                foundin(wavname, std::string(".aif"))) ) {
+                            continue;
                         }
-                        found = true;
-                        wav_t f (n);
-                        f.filename = wavname;
-                        n++;
-                        _audiofiles.push_back(f);
                     }
+                    found = true;
+                    wav_t f (n);
+                    f.filename = wavname;
+                    n++;
+                    add_wav(f);
                 }
             }
         }
@@ -575,21 +1594,18 @@ PTFFormat::parseaudio(void) {
     }
 
     // Add wav length information
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x1004) {
-
-            vector<PTFFormat::wav_t>::iterator wav = _audiofiles.begin();
-
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
-                if (c->content_type == 0x1003) {
-                    for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
-                            d != c->child.end(); ++d) {
-                        if (d->content_type == 0x1001) {
-                            (*wav).length = u_endian_read8(&_ptfunxored[d->offset+8], is_bigendian);
-                            wav++;
-                        }
+    for (const block_t *b : toplevel_blocks_of_type(0x1004)) {
+
+        vector<PTFFormat::wav_t>::iterator wav = _audiofiles.begin();
+
+        for (block_list_t::const_iterator c = children(*b).begin();
+                c != children(*b).end(); ++c) {
+            if (c->content_type == 0x1003) {
+                for (block_list_t::const_iterator d = children(*c).begin();
+                        d != children(*c).end(); ++d) {
+                    if (d->content_type == 0x1001) {
+                        (*wav).length = u_endian_read8(&_ptfunxored[d->offset+8], is_bigendian);
+                        wav++;
                     }
                 }
             }
@@ -618,7 +1634,7 @@ PTFFormat::parse_three_point(uint32_t j, int64_t& start, uint64_t& offset, uint6
 }
 
 void
-PTFFormat::parse_region_info(uint32_t j, block_t& blk, region_t& r) {
+PTFFormat::parse_region_info(uint32_t j, const block_t& blk, region_t& r) {
     int64_t start;
     uint64_t findex, sampleoffset, length;
 
@@ -629,18 +1645,17 @@ PTFFormat::parse_region_info(uint32_t j, block_t& blk, region_t& r) {
     f.posabsolute = start;
     f.length = length;
 
-    wav_t found;
-    if (find_wav(findex, found)) {
-        f.filename = found.filename;
+    const wav_t *found = find_wav(findex);
+    if (found) {
+        f.filename = found->filename;
     }
 
-    std::vector<midi_ev_t> m;
-    r.is_startpos_in_ticks = start >= ZERO_TICKS;
+    r.is_startpos_in_ticks = (uint64_t)start >= ZERO_TICKS;
     r.startpos = r.is_startpos_in_ticks ? start - ZERO_TICKS : start;
     r.offset = sampleoffset;
     r.length = length;
     r.wave = f;
-    r.midi = m;
+    r.midi = midi_events_t();
 }
 
 bool
@@ -656,122 +1671,115 @@ PTFFormat::parserest(void) {
     rindex = 0;
 
     // Parse sources->regions
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x100b || b->content_type == 0x262a) {
-            //nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
-                if (c->content_type == 0x1008 || c->content_type == 0x2629) {
-                    vector<PTFFormat::block_t>::iterator d = c->child.begin();
-                    region_t r;
-
-                    // FIXME: this is actually always parsing child block (0x2628)
-                    //        and duplicates code which is parsing 0x2628 (at least in .ptx files)
-                    found = true;
-                    j = c->offset + 11;
-                    regionname = parsestring(j);
-                    j += regionname.size() + 4;
-
-                    r.name = regionname;
-                    r.index = rindex;
-                    // FIXME: parse_region_info should be consolidated with region info parsing logic in parse_midi
-                    // parse_midi region position logic has been tested excessively and handles some weird situations correctly.
-                    // Even if such weird situations (like negative start position) cannot happen for audio regions,
-                    // parsing of 0x2628 blocks code should live in a single place.s
-                    parse_region_info(j, *d, r);
-
-                    _regions.push_back(r);
-                    rindex++;
-                }
+    for (const block_t *b : toplevel_blocks_of_types(0x100b, 0x262a)) {
+        //nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
+        for (block_list_t::const_iterator c = children(*b).begin();
+                c != children(*b).end(); ++c) {
+            if (c->content_type == 0x1008 || c->content_type == 0x2629) {
+                block_list_t::const_iterator d = children(*c).begin();
+                region_t r;
+
+                if (d == children(*c).end())
+                    continue;
+
+                // FIXME: this is actually always parsing child block (0x2628)
+                //        and duplicates code which is parsing 0x2628 (at least in .ptx files)
+                found = true;
+                j = c->offset + 11;
+                regionname = parsestring(j);
+                j += regionname.size() + 4;
+
+                r.name = regionname;
+                r.index = rindex;
+                // FIXME: parse_region_info should be consolidated with region info parsing logic in parse_midi
+                // parse_midi region position logic has been tested excessively and handles some weird situations correctly.
+                // Even if such weird situations (like negative start position) cannot happen for audio regions,
+                // parsing of 0x2628 blocks code should live in a single place.s
+                parse_region_info(j, *d, r);
+
+                add_entity(_regions, _region_index, r);
+                rindex++;
             }
-            found = true;
         }
+        found = true;
     }
 
     /// Maybe all required info for tracks is in 0x251a BLOCK TYPE and
     /// this section (0x1014/1015 parsing) could be removed?
     // Parse tracks
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x1015) {
-            //ntracks = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
-                if (c->content_type == 0x1014) {
-                    j = c->offset + 2;
-                    trackname = parsestring(j);
-                    j += trackname.size() + 5;
-                    nch = u_endian_read4(&_ptfunxored[j], is_bigendian);
-                    j += 4;
-                    for (i = 0; i < nch; i++) {
-                        ch_map[i] = u_endian_read2(&_ptfunxored[j], is_bigendian);
-
-                        track_t ti;
-                        if (!find_track(ch_map[i], ti)) {
-                            // Add a dummy region for now
-                            region_t r (65535);
-                            track_t t (ch_map[i]);
-                            t.name = trackname;
-                            t.reg = r;
-                            _tracks.push_back(t);
-                        }
-                        j += 2;
+    for (const block_t *b : toplevel_blocks_of_type(0x1015)) {
+        //ntracks = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
+        for (block_list_t::const_iterator c = children(*b).begin();
+                c != children(*b).end(); ++c) {
+            if (c->content_type == 0x1014) {
+                j = c->offset + 2;
+                trackname = parsestring(j);
+                j += trackname.size() + 5;
+                nch = u_endian_read4(&_ptfunxored[j], is_bigendian);
+                j += 4;
+                for (i = 0; i < nch; i++) {
+                    ch_map[i] = u_endian_read2(&_ptfunxored[j], is_bigendian);
+
+                    track_t ti;
+                    if (!find_track(ch_map[i], ti)) {
+                        // Add a dummy region for now
+                        region_t r (65535);
+                        track_t t (ch_map[i]);
+                        t.name = trackname;
+                        t.reg = r;
+                        add_entity(_tracks, _track_index, t);
                     }
+                    j += 2;
                 }
             }
         }
     }
 
     // Reparse from scratch to exclude audio tracks from all tracks to get midi tracks
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x2519) {
-            tindex = 0;
-            mindex = 0;
-            //ntracks = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
-                if (c->content_type == 0x251a) {
-                    j = c->offset + 4;
-                    trackname = parsestring(j);
-                    j += trackname.size() + 4 + 18;
-                    //tindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
-
-                    // Add a dummy region for now
-                    region_t r (65535);
-                    track_t t (mindex);
-                    t.name = trackname;
-                    t.reg = r;
-
-                    track_t ti;
-                    // If the current track is not an audio track, insert as midi track
-                    if (!(find_track(tindex, ti) && foundin(trackname, ti.name))) {
-                        _miditracks.push_back(t);
-                        mindex++;
-                    }
-                    tindex++;
+    for (const block_t *b : toplevel_blocks_of_type(0x2519)) {
+        tindex = 0;
+        mindex = 0;
+        //ntracks = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
+        for (block_list_t::const_iterator c = children(*b).begin();
+                c != children(*b).end(); ++c) {
+            if (c->content_type == 0x251a) {
+                j = c->offset + 4;
+                trackname = parsestring(j);
+                j += trackname.size() + 4 + 18;
+                //tindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
+
+                // Add a dummy region for now
+                region_t r (65535);
+                track_t t (mindex);
+                t.name = trackname;
+                t.reg = r;
+
+                track_t ti;
+                // If the current track is not an audio track, insert as midi track
+                if (!(find_track(tindex, ti) && foundin(trackname, ti.name))) {
+                    add_entity(_miditracks, _miditrack_index, t);
+                    mindex++;
                 }
+                tindex++;
             }
         }
     }
 
     // Parse regions->tracks
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
+    for (const block_t *b : toplevel_blocks_of_types(0x1012, 0x1054)) {
         tindex = 0;
         if (b->content_type == 0x1012) {
             //nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
             count = 0;
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
+            for (block_list_t::const_iterator c = children(*b).begin();
+                    c != children(*b).end(); ++c) {
                 if (c->content_type == 0x1011) {
                     regionname = parsestring(c->offset + 2);
-                    for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
-                            d != c->child.end(); ++d) {
+                    for (block_list_t::const_iterator d = children(*c).begin();
+                            d != children(*c).end(); ++d) {
                         if (d->content_type == 0x100f) {
-                            for (vector<PTFFormat::block_t>::iterator e = d->child.begin();
-                                    e != d->child.end(); ++e) {
+                            for (block_list_t::const_iterator e = children(*d).begin();
+                                    e != children(*d).end(); ++e) {
                                 if (e->content_type == 0x100e) {
                                     // Region->track
                                     track_t ti;
@@ -782,7 +1790,7 @@ PTFFormat::parserest(void) {
                                     if (!find_region(rawindex, ti.reg))
                                         continue;
                                     if (ti.reg.index != 65535) {
-                                        _tracks.push_back(ti);
+                                        add_entity(_tracks, _track_index, ti);
                                     }
                                 }
                             }
@@ -795,19 +1803,19 @@ PTFFormat::parserest(void) {
         } else if (b->content_type == 0x1054) {
             //nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
             count = 0;
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
+            for (block_list_t::const_iterator c = children(*b).begin();
+                    c != children(*b).end(); ++c) {
                 if (c->content_type == 0x1052) {
                     trackname = parsestring(c->offset + 2);
-                    for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
-                            d != c->child.end(); ++d) {
+                    for (block_list_t::const_iterator d = children(*c).begin();
+                            d != children(*c).end(); ++d) {
                         if (d->content_type == 0x1050) {
                             region_is_fade = (_ptfunxored[d->offset + 46] == 0x01);
                             if (region_is_fade) {
                                 continue;
                             }
-                            for (vector<PTFFormat::block_t>::iterator e = d->child.begin();
-                                    e != d->child.end(); ++e) {
+                            for (block_list_t::const_iterator e = children(*d).begin();
+                                    e != children(*d).end(); ++e) {
                                 if (e->content_type == 0x104f) {
                                     // Region->track
                                     j = e->offset + 4;
@@ -822,7 +1830,7 @@ PTFFormat::parserest(void) {
                                     ti.reg.is_startpos_in_ticks = start >= ZERO_TICKS;
                                     ti.reg.startpos = ti.reg.is_startpos_in_ticks ? start - ZERO_TICKS : start;
                                     if (ti.reg.index != 65535) {
-                                        _tracks.push_back(ti);
+                                        add_entity(_tracks, _track_index, ti);
                                     }
                                 }
                             }
@@ -834,268 +1842,332 @@ PTFFormat::parserest(void) {
             }
         }
     }
-    for (std::vector<track_t>::iterator tr = _tracks.begin();
-            tr != _tracks.end(); /* noop */) {
-        if ((*tr).reg.index == 65535) {
-            tr = _tracks.erase(tr);
-        } else {
-            tr++;
-        }
-    }
+    remove_unassigned_tracks(_tracks, _track_index);
     return found;
 }
 
+const PTFFormat::wav_t*
+PTFFormat::find_wav(uint16_t index) const {
+    entity_index_t::const_iterator found = _wav_index.find(index);
+    size_t pos = found != _wav_index.end() ? found->second : _audiofiles.size();
+
+    // wav_t also compares equal by (empty) filename
+    if (_first_unnamed_wav < pos)
+        pos = _first_unnamed_wav;
+    return pos < _audiofiles.size() ? &_audiofiles[pos] : NULL;
+}
+
+void
+PTFFormat::add_wav(const wav_t& w) {
+    _wav_index.emplace(w.index, _audiofiles.size());
+    // stays at the end until an unnamed wav shows up
+    if (!w.filename.empty() && _first_unnamed_wav == _audiofiles.size())
+        _first_unnamed_wav++;
+    _audiofiles.push_back(w);
+}
+
+/* Drops tracks left without a region, keeping the order of the others */
+void
+PTFFormat::remove_unassigned_tracks(std::vector<track_t>& tracks, entity_index_t& idx) {
+    tracks.erase(std::remove_if(tracks.begin(), tracks.end(),
+                                [](const track_t& t){ return t.reg.index == 65535; }),
+                 tracks.end());
+    reindex_entities(tracks, idx);
+}
+
 struct mchunk {
-    mchunk (uint64_t zt, uint64_t ml, std::vector<PTFFormat::midi_ev_t> const& c)
+    mchunk (uint64_t zt, uint64_t ml, PTFFormat::midi_events_t const& c)
     : zero (zt)
     , maxlen (ml)
     , chunk (c)
     {}
     uint64_t zero;
     uint64_t maxlen;
-    std::vector<PTFFormat::midi_ev_t> chunk;
+    PTFFormat::midi_events_t chunk;
 };
 
+// MdNLB event records: 5 byte position, note, 5 byte length and velocity at fixed offsets
+#define MIDI_EV_STRIDE  35
+#define MIDI_EV_SIZE    18
+
+template <bool bigendian>
+static inline uint64_t
+read_u40(const unsigned char *buf) {
+    if (bigendian) {
+        return ((uint64_t)buf[0] << 32) | ((uint64_t)buf[1] << 24) | ((uint64_t)buf[2] << 16) |
+               ((uint64_t)buf[3] << 8) | (uint64_t)buf[4];
+    }
+    return (uint64_t)buf[0] | ((uint64_t)buf[1] << 8) | ((uint64_t)buf[2] << 16) |
+           ((uint64_t)buf[3] << 24) | ((uint64_t)buf[4] << 32);
+}
+
+/* Decodes n MdNLB event records into columns, returns the end of the last note.
+   Each field is gathered in its own pass over the records, which keeps the loops
+   branch free and lets the compiler vectorize them. */
+template <bool bigendian>
+static uint64_t
+decode_midi_events(const unsigned char *rec, uint64_t n, uint64_t zero_ticks, PTFFormat::midi_columns_t& ev) {
+    uint64_t max_pos = 0;
+    uint64_t i;
+
+    ev.pos.resize(n);
+    ev.length.resize(n);
+    ev.note.resize(n);
+    ev.velocity.resize(n);
+
+    uint64_t *pos = ev.pos.data();
+    uint64_t *length = ev.length.data();
+    uint8_t *note = ev.note.data();
+    uint8_t *velocity = ev.velocity.data();
+
+    for (i = 0; i < n; i++) {
+        pos[i] = read_u40<bigendian>(&rec[i * MIDI_EV_STRIDE]) - zero_ticks;
+    }
+    for (i = 0; i < n; i++) {
+        length[i] = read_u40<bigendian>(&rec[i * MIDI_EV_STRIDE + 9]);
+    }
+    for (i = 0; i < n; i++) {
+        note[i] = rec[i * MIDI_EV_STRIDE + 8];
+    }
+    for (i = 0; i < n; i++) {
+        velocity[i] = rec[i * MIDI_EV_STRIDE + 17];
+    }
+    for (i = 0; i < n; i++) {
+        max_pos = std::max(max_pos, pos[i] + length[i]);
+    }
+    return max_pos;
+}
+
 bool
 PTFFormat::parsemidi(void) {
-    uint32_t i, j, k, n, rindex, tindex, mindex, count, rawindex;
+    uint32_t j, k, n, rindex, tindex, mindex, count, rawindex;
     uint64_t n_midi_events, zero_ticks, offset, length, start2, stop2;
-    uint64_t midi_pos, midi_len, max_pos;
-    uint8_t midi_velocity, midi_note;
+    uint64_t midi_len, max_pos;
     uint16_t regionnumber = 0;
     std::string midiregionname;
 
     std::vector<mchunk> midichunks;
-    midi_ev_t m;
 
     std::string regionname, trackname;
     rindex = 0;
 
     // Parse MIDI events
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x2000) {
-
-            k = b->offset;
+    for (const block_t *b : toplevel_blocks_of_type(0x2000)) {
 
-            // Parse all midi chunks, not 1:1 mapping to regions yet
-            while (k + 35 < b->block_size + b->offset) {
-                max_pos = 0;
-                std::vector<midi_ev_t> midi;
+        k = b->offset;
 
-                if (!jumpto(&k, _ptfunxored, _len, (const unsigned char *)"MdNLB", 5)) {
-                    break;
-                }
-                k += 11;
-                n_midi_events = u_endian_read4(&_ptfunxored[k], is_bigendian);
-
-                k += 4;
-                zero_ticks = u_endian_read5(&_ptfunxored[k], is_bigendian);
-                for (i = 0; i < n_midi_events && k < _len; i++, k += 35) {
-                    midi_pos = u_endian_read5(&_ptfunxored[k], is_bigendian);
-                    midi_pos -= zero_ticks;
-                    midi_note = _ptfunxored[k+8];
-                    midi_len = u_endian_read5(&_ptfunxored[k+9], is_bigendian);
-                    midi_velocity = _ptfunxored[k+17];
-
-                    if (midi_pos + midi_len > max_pos) {
-                        max_pos = midi_pos + midi_len;
-                    }
+        // Parse all midi chunks, not 1:1 mapping to regions yet
+        while (k + 35 < b->block_size + b->offset) {
+            std::shared_ptr<midi_columns_t> midi = std::make_shared<midi_columns_t>();
 
-                    m.pos = midi_pos;
-                    m.length = midi_len;
-                    m.note = midi_note;
-                    m.velocity = midi_velocity;
-                    midi.push_back(m);
-                }
-                midichunks.push_back(mchunk (zero_ticks, max_pos, midi));
+            if (!jumpto(&k, _ptfunxored, b->offset + b->block_size, (const unsigned char *)"MdNLB", 5)) {
+                break;
+            }
+            k += 11;
+            n_midi_events = u_endian_read4(&_ptfunxored[k], is_bigendian);
+
+            k += 4;
+            zero_ticks = u_endian_read5(&_ptfunxored[k], is_bigendian);
+
+            // only records which are entirely in the session
+            n = k + MIDI_EV_SIZE <= _len ? (_len - k - MIDI_EV_SIZE) / MIDI_EV_STRIDE + 1 : 0;
+            n_midi_events = std::min<uint64_t>(n_midi_events, n);
+            if (is_bigendian) {
+                max_pos = decode_midi_events<true>(&_ptfunxored[k], n_midi_events, zero_ticks, *midi);
+            } else {
+                max_pos = decode_midi_events<false>(&_ptfunxored[k], n_midi_events, zero_ticks, *midi);
             }
+            k += n_midi_events * MIDI_EV_STRIDE;
+            midichunks.push_back(mchunk (zero_ticks, max_pos, midi_events_t (midi)));
+        }
+    }
 
-        // Put chunks onto regions
-        } else if ((b->content_type == 0x2002) || (b->content_type == 0x2634)) {
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
-                if ((c->content_type == 0x2001) || (c->content_type == 0x2633)) {
-                    for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
-                            d != c->child.end(); ++d) {
-                        if ((d->content_type == 0x1007) || (d->content_type == 0x2628)) {
-                            j = d->offset + 2;
-                            midiregionname = parsestring(j);
-                            j += 4 + midiregionname.size();
-                            int64_t region_pos;
-                            parse_three_point(j, region_pos, zero_ticks, midi_len);
-                            j = d->offset + d->block_size;
-                            rindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
-                            struct mchunk mc = *(midichunks.begin()+rindex);
-
-                            region_t r (regionnumber++);
-                            r.name = midiregionname;
-                            r.startpos = mc.zero - zero_ticks + region_pos;
-                            r.offset = region_pos;
-                            r.length = mc.maxlen;
-                            r.midi = mc.chunk;
+    // Put chunks onto regions
+    for (const block_t *b : toplevel_blocks_of_types(0x2002, 0x2634)) {
+        for (block_list_t::const_iterator c = children(*b).begin();
+                c != children(*b).end(); ++c) {
+            if ((c->content_type == 0x2001) || (c->content_type == 0x2633)) {
+                for (block_list_t::const_iterator d = children(*c).begin();
+                        d != children(*c).end(); ++d) {
+                    if ((d->content_type == 0x1007) || (d->content_type == 0x2628)) {
+                        j = d->offset + 2;
+                        midiregionname = parsestring(j);
+                        j += 4 + midiregionname.size();
+                        int64_t region_pos;
+                        parse_three_point(j, region_pos, zero_ticks, midi_len);
+                        j = d->offset + d->block_size;
+                        rindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
+                        if (rindex >= midichunks.size())
+                            continue;
+                        const struct mchunk& mc = midichunks[rindex];
 
-                            _midiregions.push_back(r);
-                        }
+                        region_t r (regionnumber++);
+                        r.name = midiregionname;
+                        r.startpos = mc.zero - zero_ticks + region_pos;
+                        r.offset = region_pos;
+                        r.length = mc.maxlen;
+                        r.midi = mc.chunk;
+
+                        add_entity(_midiregions, _midiregion_index, r);
                     }
                 }
             }
-        } 
+        }
     }
     
     // FIXME: COMPOUND MIDI regions - unclear what this code does and there are no tests for it
     // At least 0x262c block can be found in .ptx files, but it has no inner blocks nor any data itself
     // in any of the existing test files.
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x262c) {
-            mindex = 0;
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
-                if (c->content_type == 0x262b) {
-                    for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
-                            d != c->child.end(); ++d) {
-                        if (d->content_type == 0x2628) {
-                            count = 0;
-                            j = d->offset + 2;
-                            regionname = parsestring(j);
-                            j += 4 + regionname.size();
-                            int64_t start;
-                            parse_three_point(j, start, offset, length);
-                            j = d->offset + d->block_size + 2;
-                            n = u_endian_read2(&_ptfunxored[j], is_bigendian);
-
-                            for (vector<PTFFormat::block_t>::iterator e = d->child.begin();
-                                    e != d->child.end(); ++e) {
-                                if (e->content_type == 0x2523) {
-                                    // FIXME Compound MIDI region
-                                    j = e->offset + 39;
-                                    rawindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
-                                    j += 12; 
-                                    start2 = u_endian_read5(&_ptfunxored[j], is_bigendian);
-                                    int64_t signedval = (int64_t)start2;
-                                    signedval -= ZERO_TICKS;
-                                    if (signedval < 0) {
-                                        signedval = -signedval;
-                                    }
-                                    start2 = signedval;
-                                    j += 8;
-                                    stop2 = u_endian_read5(&_ptfunxored[j], is_bigendian);
-                                    signedval = (int64_t)stop2;
-                                    signedval -= ZERO_TICKS;
-                                    if (signedval < 0) {
-                                        signedval = -signedval;
-                                    }
-                                    stop2 = signedval;
-                                    j += 16;
-                                    //nn = u_endian_read4(&_ptfunxored[j], is_bigendian);
-                                    count++;
+    for (const block_t *b : toplevel_blocks_of_type(0x262c)) {
+        mindex = 0;
+        for (block_list_t::const_iterator c = children(*b).begin();
+                c != children(*b).end(); ++c) {
+            if (c->content_type == 0x262b) {
+                for (block_list_t::const_iterator d = children(*c).begin();
+                        d != children(*c).end(); ++d) {
+                    if (d->content_type == 0x2628) {
+                        count = 0;
+                        j = d->offset + 2;
+                        regionname = parsestring(j);
+                        j += 4 + regionname.size();
+                        int64_t start;
+                        parse_three_point(j, start, offset, length);
+                        j = d->offset + d->block_size + 2;
+                        n = u_endian_read2(&_ptfunxored[j], is_bigendian);
+
+                        for (block_list_t::const_iterator e = children(*d).begin();
+                                e != children(*d).end(); ++e) {
+                            if (e->content_type == 0x2523) {
+                                // FIXME Compound MIDI region
+                                j = e->offset + 39;
+                                rawindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
+                                j += 12; 
+                                start2 = u_endian_read5(&_ptfunxored[j], is_bigendian);
+                                int64_t signedval = (int64_t)start2;
+                                signedval -= ZERO_TICKS;
+                                if (signedval < 0) {
+                                    signedval = -signedval;
                                 }
-                            }
-                            if (!count) {
-                                // Plain MIDI region
-                                struct mchunk mc = *(midichunks.begin()+n);
-
-                                region_t r (n);
-                                r.name = midiregionname;
-                                r.is_startpos_in_ticks = true;
-                                r.startpos = 0;
-                                r.length = mc.maxlen;
-                                r.midi = mc.chunk;
-                                _midiregions.push_back(r);
-                                mindex++;
+                                start2 = signedval;
+                                j += 8;
+                                stop2 = u_endian_read5(&_ptfunxored[j], is_bigendian);
+                                signedval = (int64_t)stop2;
+                                signedval -= ZERO_TICKS;
+                                if (signedval < 0) {
+                                    signedval = -signedval;
+                                }
+                                stop2 = signedval;
+                                j += 16;
+                                //nn = u_endian_read4(&_ptfunxored[j], is_bigendian);
+                                count++;
                             }
                         }
+                        if (!count) {
+                            // Plain MIDI region
+                            if (n >= midichunks.size())
+                                continue;
+                            const struct mchunk& mc = midichunks[n];
+
+                            region_t r (n);
+                            r.name = midiregionname;
+                            r.is_startpos_in_ticks = true;
+                            r.startpos = 0;
+                            r.length = mc.maxlen;
+                            r.midi = mc.chunk;
+                            add_entity(_midiregions, _midiregion_index, r);
+                            mindex++;
+                        }
                     }
                 }
             }
-        } 
+        }
     }
     
     // Put midi regions onto midi tracks
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x1058) {
-            //nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
-            count = 0;
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-                    c != b->child.end(); ++c) {
-                if (c->content_type == 0x1057) {
-                    regionname = parsestring(c->offset + 2);
-                    for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
-                            d != c->child.end(); ++d) {
-                        if (d->content_type == 0x1056) {
-                            for (vector<PTFFormat::block_t>::iterator e = d->child.begin();
-                                    e != d->child.end(); ++e) {
-                                if (e->content_type == 0x104f) {
-                                    // MIDI region->MIDI track
-                                    track_t ti;
-                                    j = e->offset + 4;
-                                    rawindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
-                                    j += 4 + 1;
-                                    uint64_t start = u_endian_read6(&_ptfunxored[j], is_bigendian);
-                                    j += 6 + 1;
-                                    bool is_pos_in_ticks = _ptfunxored[j] >> 6; // for musical time - 0x40, for sample time - 0x00
-                                    tindex = count;
-                                    if (!find_miditrack(tindex, ti) || !find_midiregion(rawindex, ti.reg)) {
-                                        continue;
-                                    }
+    for (const block_t *b : toplevel_blocks_of_type(0x1058)) {
+        //nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
+        count = 0;
+        for (block_list_t::const_iterator c = children(*b).begin();
+                c != children(*b).end(); ++c) {
+            if (c->content_type == 0x1057) {
+                regionname = parsestring(c->offset + 2);
+                for (block_list_t::const_iterator d = children(*c).begin();
+                        d != children(*c).end(); ++d) {
+                    if (d->content_type == 0x1056) {
+                        for (block_list_t::const_iterator e = children(*d).begin();
+                                e != children(*d).end(); ++e) {
+                            if (e->content_type == 0x104f) {
+                                // MIDI region->MIDI track
+                                track_t ti;
+                                j = e->offset + 4;
+                                rawindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
+                                j += 4 + 1;
+                                uint64_t start = u_endian_read6(&_ptfunxored[j], is_bigendian);
+                                j += 6 + 1;
+                                bool is_pos_in_ticks = _ptfunxored[j] >> 6; // for musical time - 0x40, for sample time - 0x00
+                                tindex = count;
+                                if (!find_miditrack(tindex, ti) || !find_midiregion(rawindex, ti.reg)) {
+                                    continue;
+                                }
 
-                                    ti.reg.is_startpos_in_ticks = is_pos_in_ticks;
-                                    if (!is_pos_in_ticks || start - ti.reg.offset != ZERO_TICKS) {
-                                        ti.reg.startpos = start >= ZERO_TICKS ? start - ZERO_TICKS : start;
-                                    }
-                                    if (ti.reg.index != 65535) {
-                                        _miditracks.push_back(ti);
-                                    }
+                                ti.reg.is_startpos_in_ticks = is_pos_in_ticks;
+                                if (!is_pos_in_ticks || start - ti.reg.offset != ZERO_TICKS) {
+                                    ti.reg.startpos = start >= ZERO_TICKS ? start - ZERO_TICKS : start;
+                                }
+                                if (ti.reg.index != 65535) {
+                                    add_entity(_miditracks, _miditrack_index, ti);
                                 }
                             }
                         }
                     }
-                    count++;
                 }
+                count++;
             }
         }
     }
-    for (std::vector<track_t>::iterator tr = _miditracks.begin();
-            tr != _miditracks.end(); /* noop */) {
-        if ((*tr).reg.index == 65535) {
-            tr = _miditracks.erase(tr);
-        } else {
-            tr++;
-        }
-    }
+    remove_unassigned_tracks(_miditracks, _miditrack_index);
     return true;
 }
 
 bool
 PTFFormat::parsemetadata(void) {
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin();
-            b != _blocks.end(); ++b) {
-        if (b->content_type == 0x2716) {
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin(); c != b->child.end(); ++c) {
-                if (c->content_type == 0x2715) {
-                    if (parsemetadata_base64(*c)) {
-                        return parsemetadata_struct(_session_meta_base64, _session_meta_base64_size, NULL) != 0;
-                    }
-                    return false;
-                }
+    for (const block_t *b : toplevel_blocks_of_type(0x2716)) {
+        for (block_list_t::const_iterator c = children(*b).begin(); c != children(*b).end(); ++c) {
+            if (c->content_type == 0x2715) {
+                return parsemetadata_base64(*c);
             }
         }
     }
     return true;
 }
 
-bool
-PTFFormat::parsemetadata_base64(block_t& blk) {
-    static const std::string BASE64_CHARS =
+/* Values of base64 digits, 0xff for anything else. Padding decodes as 0. */
+struct base64_decode_table {
+    uint8_t value[256];
+
+    constexpr base64_decode_table() : value() {
+        const char digits[] =
              "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
              "abcdefghijklmnopqrstuvwxyz"
              "0123456789+/";
+        for (int i = 0; i < 256; i++) {
+            value[i] = 0xff;
+        }
+        for (int i = 0; i < 64; i++) {
+            value[(unsigned char)digits[i]] = i;
+        }
+        value['='] = 0;
+    }
+};
+
+static constexpr base64_decode_table BASE64_DECODE;
+
+/* Locates and checks base64 encoded metadata, which is decoded by decode_metadata() */
+bool
+PTFFormat::parsemetadata_base64(const block_t& blk) {
     static const int BASE64_GROUP_LEN = 64;
     static const int BASE64_GROUP_LEN_W_PAD = BASE64_GROUP_LEN + 2;
     static const int BYTES_IN = 4;
-    static const int BYTES_OUT = 3;
 
     uint32_t pos = blk.offset + 2;
     std::string meta_header = parsestring(pos);
@@ -1106,50 +2178,114 @@ PTFFormat::parsemetadata_base64(block_t& blk) {
     // read base64 data length
     uint32_t length_with_pad = u_endian_read4(&_ptfunxored[pos], is_bigendian);
     pos += 4;
-    // base64 data is layed out in groups of 64 bytes padded by 2 bytes in-between
-    uint32_t whole_groups = length_with_pad / BASE64_GROUP_LEN_W_PAD;
-    uint32_t last_group_len = length_with_pad % BASE64_GROUP_LEN_W_PAD;
+    if ((uint64_t)pos + length_with_pad > _len) {
+        return false;
+    }
+    // base64 data is layed out in groups of 64 bytes padded by 2 bytes in-between,
     // last group length must be divisible by 4
-    if (last_group_len % BYTES_IN != 0) {
+    if (length_with_pad % BASE64_GROUP_LEN_W_PAD % BYTES_IN != 0) {
         return false;
     }
+    _session_meta_base64_pos = pos;
+    _session_meta_base64_len = length_with_pad;
+    return true;
+}
+
+void
+PTFFormat::decode_metadata(void) const {
+    static const std::string FIELD_TITLE = metadata_key("http://purl.org/dc/elements/1.1/:title");
+    static const std::string FIELD_ARTIST = metadata_key("http://www.id3.org/id3v2.3.0#:TPE1");
+    static const std::string FIELD_CONTRIBUTORS = metadata_key("http://purl.org/dc/elements/1.1/:contributor");
+    static const std::string FIELD_LOCATION = metadata_key("http://meta.avid.com/everywhere/1.0#:location");
+
+    compute_once(_session_meta_decoded, [this]() {
+        if (_session_meta_base64_len == 0) {
+            return;
+        }
+
+        decode_metadata_base64();
+        if (parsemetadata_struct(_session_meta_base64, _session_meta_base64_size, NO_BLOCK) == 0) {
+            _session_meta_fields.clear();
+            _session_meta_index.clear();
+            return;
+        }
+
+        // Values of the well known fields, nested values belong to the struct they are in
+        for (const metadata_field_t& f : _session_meta_fields) {
+            if (f.type != 0) {
+                continue;
+            }
+            std::string_view field = f.parent != NO_BLOCK ? _session_meta_fields[f.parent].name : f.name;
+            if (field == FIELD_TITLE) {
+                _session_meta_parsed.title = f.value;
+            } else if (field == FIELD_ARTIST) {
+                _session_meta_parsed.artist = f.value;
+            } else if (field == FIELD_CONTRIBUTORS) {
+                _session_meta_parsed.contributors.push_back(std::string(f.value));
+            } else if (field == FIELD_LOCATION) {
+                _session_meta_parsed.location = f.value;
+            }
+        }
+    });
+}
+
+void
+PTFFormat::decode_metadata_base64(void) const {
+    static const int BASE64_GROUP_LEN = 64;
+    static const int BASE64_GROUP_LEN_W_PAD = BASE64_GROUP_LEN + 2;
+    static const int BYTES_IN = 4;
+    static const int BYTES_OUT = 3;
+
+    uint32_t length_with_pad = _session_meta_base64_len;
+    uint32_t whole_groups = length_with_pad / BASE64_GROUP_LEN_W_PAD;
+    uint32_t last_group_len = length_with_pad % BASE64_GROUP_LEN_W_PAD;
     // expected decoded bytes length (might be shorter due to '=' padding at the end
     uint32_t decoded_len = (whole_groups * BASE64_GROUP_LEN + last_group_len) / BYTES_IN * BYTES_OUT;
     _session_meta_base64 = (unsigned char*) malloc(decoded_len * sizeof(unsigned char));
-    unsigned char enc_bytes[BYTES_IN], output_bytes[BYTES_OUT];
-
-    uint32_t end_pos = pos + length_with_pad;
-    uint32_t output_pos = 0; // track bytes actually decoded for final length
-    for (uint32_t p = pos; p < end_pos; p += BASE64_GROUP_LEN_W_PAD) {
-        for (uint32_t i = p; i < min(p + BASE64_GROUP_LEN, end_pos); i += BYTES_IN) {
-            int pad_found_at = BYTES_OUT + 1;
-            for (int j = 0; j < BYTES_IN; j++) {
-                unsigned char input_char = _ptfunxored[i + j];
-
-                if (input_char != '=') {
-                    enc_bytes[j] = BASE64_CHARS.find(input_char);
-                } else {
-                    enc_bytes[j] = 0;
-                    pad_found_at = j;
-                }
-            }
 
-            output_bytes[0] = (enc_bytes[0] << 2) + ((enc_bytes[1] & 0x30) >> 4);
-            output_bytes[1] = ((enc_bytes[1] & 0xf) << 4) + ((enc_bytes[2] & 0x3c) >> 2);
-            output_bytes[2] = ((enc_bytes[2] & 0x3) << 6) + enc_bytes[3];
-            for (int o = 0; o < min(BYTES_OUT, pad_found_at); o++) {
-                _session_meta_base64[output_pos] = output_bytes[o];
-                output_pos++;
-            }
+    const unsigned char *in = &_ptfunxored[_session_meta_base64_pos];
+    const unsigned char *in_end = in + length_with_pad;
+    const uint8_t *value = BASE64_DECODE.value;
+    unsigned char *out = _session_meta_base64;
+    uint32_t group_left = BASE64_GROUP_LEN;
+
+    // Single pass over all quads, skipping the 2 padding bytes after every group
+    while (in < in_end) {
+        uint8_t e0 = value[in[0]], e1 = value[in[1]], e2 = value[in[2]], e3 = value[in[3]];
+
+        out[0] = (e0 << 2) + ((e1 & 0x30) >> 4);
+        out[1] = ((e1 & 0xf) << 4) + ((e2 & 0x3c) >> 2);
+        out[2] = ((e2 & 0x3) << 6) + e3;
+        // a quad yields as many bytes as the index of its last '=', all of them without one
+        if (in[3] == '=' || (in[2] != '=' && in[1] != '=' && in[0] != '=')) {
+            out += BYTES_OUT;
+        } else if (in[2] == '=') {
+            out += 2;
+        } else if (in[1] == '=') {
+            out += 1;
+        }
+        in += BYTES_IN;
+
+        group_left -= BYTES_IN;
+        if (group_left == 0) {
+            in += BASE64_GROUP_LEN_W_PAD - BASE64_GROUP_LEN;
+            group_left = BASE64_GROUP_LEN;
         }
     }
-    _session_meta_base64_size = output_pos;
-    return true;
+    _session_meta_base64_size = out - _session_meta_base64;
 }
 
+/* Appends the fields of the struct at base64_data to _session_meta_fields,
+   returns the number of bytes it takes or 0 if it is malformed */
 uint32_t
-PTFFormat::parsemetadata_struct(unsigned char* base64_data_base, uint32_t size, std::string const* outer_field) {
+PTFFormat::parsemetadata_struct(unsigned char* base64_data_base, uint32_t size, uint32_t parent) const {
     unsigned char* base64_data = base64_data_base;
+    const unsigned char* end = base64_data_base + size;
+    uint32_t last = NO_BLOCK;
+
+    if (size < 8) {
+        return 0;
+    }
     uint32_t struct_head = u_endian_read4(base64_data, is_bigendian); // CONSTANT (1)
     base64_data += 4;
     if (struct_head != 1) {
@@ -1157,25 +2293,49 @@ PTFFormat::parsemetadata_struct(unsigned char* base64_data_base, uint32_t size,
     }
     uint32_t field_count = u_endian_read4(base64_data, is_bigendian);
     base64_data += 4;
-    for (int f = 0; f < field_count; f++) {
+    for (uint32_t f = 0; f < field_count; f++) {
+        if (end - base64_data < 4) {
+            return 0;
+        }
         uint32_t field_name_len = u_endian_read4(base64_data, is_bigendian);
         base64_data += 4;
-        std::string field = std::regex_replace(std::string((const char *)base64_data, field_name_len), std::regex("\t"), "/");
+        if ((uint64_t)(end - base64_data) < (uint64_t)field_name_len + 4) {
+            return 0;
+        }
+        metadata_field_t field;
+        field.name = std::string_view((const char *)base64_data, field_name_len);
         base64_data += field_name_len;
-        uint32_t field_type = u_endian_read4(base64_data, is_bigendian);
+        field.type = u_endian_read4(base64_data, is_bigendian);
         base64_data += 4;
-        if (field_type == 0) {
+        field.parent = parent;
+        field.first_child = NO_BLOCK;
+        field.next_sibling = NO_BLOCK;
+
+        uint32_t index = _session_meta_fields.size();
+        _session_meta_fields.push_back(field);
+        _session_meta_index.emplace(field.name, index); // keeps the first one
+        if (last != NO_BLOCK) {
+            _session_meta_fields[last].next_sibling = index;
+        } else if (parent != NO_BLOCK) {
+            _session_meta_fields[parent].first_child = index;
+        }
+        last = index;
+
+        if (field.type == 0) {
             // simple string value
+            if (end - base64_data < 4) {
+                return 0;
+            }
             uint32_t value_len = u_endian_read4(base64_data, is_bigendian);
             base64_data += 4;
-            std::string value = std::string((const char *)base64_data, value_len);
+            if ((uint64_t)(end - base64_data) < value_len) {
+                return 0;
+            }
+            _session_meta_fields[index].value = std::string_view((const char *)base64_data, value_len);
             base64_data += value_len;
-
-            fill_metadata_field(outer_field != NULL ? *outer_field : field, value);
-        } else if (field_type == 3) {
+        } else if (field.type == 3) {
             // nested struct
-            uint32_t pos = base64_data - base64_data_base;
-            uint32_t bytes_inner_read = parsemetadata_struct(base64_data, size - pos, &field);
+            uint32_t bytes_inner_read = parsemetadata_struct(base64_data, end - base64_data, index);
             if (bytes_inner_read == 0) {
                 return 0;
             }
@@ -1185,33 +2345,34 @@ PTFFormat::parsemetadata_struct(unsigned char* base64_data_base, uint32_t size,
     return base64_data - base64_data_base;
 }
 
-void
-PTFFormat::fill_metadata_field(std::string const& field, std::string const& value) {
-    static const std::string FIELD_TITLE = "http://purl.org/dc/elements/1.1/:title";
-    static const std::string FIELD_ARTIST = "http://www.id3.org/id3v2.3.0#:TPE1";
-    static const std::string FIELD_CONTRIBUTORS = "http://purl.org/dc/elements/1.1/:contributor";
-    static const std::string FIELD_LOCATION = "http://meta.avid.com/everywhere/1.0#:location";
+/* Metadata field name as stored for a path, which has tabs in place of '/' */
+std::string
+PTFFormat::metadata_key(std::string const& path) {
+    std::string key(path);
+    std::replace(key.begin(), key.end(), '/', '\t');
+    return key;
+}
 
-    if (field == FIELD_TITLE) {
-        _session_meta_parsed.title = value;
-    } else if (field == FIELD_ARTIST) {
-        _session_meta_parsed.artist = value;
-    } else if (field == FIELD_CONTRIBUTORS) {
-        _session_meta_parsed.contributors.push_back(value);
-    } else if (field == FIELD_LOCATION) {
-        _session_meta_parsed.location = value;
-    }
+PTFFormat::metadata_field_list_t
+PTFFormat::metadata_toplevel_fields() const {
+    decode_metadata();
+    return metadata_field_list_t(&_session_meta_fields, _session_meta_fields.empty() ? NO_BLOCK : 0);
+}
+
+const PTFFormat::metadata_field_t*
+PTFFormat::metadata_field(std::string const& path) const {
+    decode_metadata();
+    std::unordered_map<std::string_view, uint32_t>::const_iterator found = _session_meta_index.find(metadata_key(path));
+    return found != _session_meta_index.end() ? &_session_meta_fields[found->second] : NULL;
 }
 
 bool
 PTFFormat::parsekeysigs() {
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin(); b != _blocks.end(); ++b) {
-        if (b->content_type == 0x2433) {
-            for (vector<PTFFormat::block_t>::iterator c = b->child.begin(); c != b->child.end(); ++c) {
-                if (c->content_type == 0x2432) {
-                    if (!parsekeysig(*c))
-                        return false;
-                }
+    for (const block_t *b : toplevel_blocks_of_type(0x2433)) {
+        for (block_list_t::const_iterator c = children(*b).begin(); c != children(*b).end(); ++c) {
+            if (c->content_type == 0x2432) {
+                if (!parsekeysig(*c))
+                    return false;
             }
         }
     }
@@ -1219,7 +2380,7 @@ PTFFormat::parsekeysigs() {
 }
 
 bool
-PTFFormat::parsekeysig(block_t& blk) {
+PTFFormat::parsekeysig(const block_t& blk) {
     if (blk.block_size < 13)
         return false;
 
@@ -1241,16 +2402,14 @@ PTFFormat::parsekeysig(block_t& blk) {
 
 bool
 PTFFormat::parsetimesigs() {
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin(); b != _blocks.end(); ++b) {
-        if (b->content_type == 0x2029) {
-            return parsetimesigs_block(*b);
-        }
+    for (const block_t *b : toplevel_blocks_of_type(0x2029)) {
+        return parsetimesigs_block(*b);
     }
     return true;
 }
 
 bool
-PTFFormat::parsetimesigs_block(block_t &blk) {
+PTFFormat::parsetimesigs_block(const block_t &blk) {
     static const uint32_t HEADER_SIZE = 17;
     static const uint32_t EV_SIZE = 36;
 
@@ -1263,7 +2422,7 @@ PTFFormat::parsetimesigs_block(block_t &blk) {
     if (blk.block_size < HEADER_SIZE + event_count * EV_SIZE)
         return false;
 
-    for (int i = 0; i < event_count; i++) {
+    for (uint32_t i = 0; i < event_count; i++) {
         uint64_t pos = u_endian_read8(data, is_bigendian) - ZERO_TICKS;
         data += 8;
         uint32_t measure_num = u_endian_read4(data, is_bigendian);
@@ -1285,16 +2444,14 @@ PTFFormat::parsetimesigs_block(block_t &blk) {
 
 bool
 PTFFormat::parsetempochanges() {
-    for (vector<PTFFormat::block_t>::iterator b = _blocks.begin(); b != _blocks.end(); ++b) {
-        if (b->content_type == 0x2028) {
-            return parsetempochanges_block(*b);
-        }
+    for (const block_t *b : toplevel_blocks_of_type(0x2028)) {
+        return parsetempochanges_block(*b);
     }
     return true;
 }
 
 bool
-PTFFormat::parsetempochanges_block(block_t &blk) {
+PTFFormat::parsetempochanges_block(const block_t &blk) {
     static const uint32_t HEADER_SIZE = 17;
     static const uint32_t EV_SIZE = 61;
 
@@ -1307,7 +2464,7 @@ PTFFormat::parsetempochanges_block(block_t &blk) {
     if (blk.block_size < HEADER_SIZE + event_count * EV_SIZE)
         return false;
 
-    for (int i = 0; i < event_count; i++) {
+    for (uint32_t i = 0; i < event_count; i++) {
         data += 34; // (....Const......TMS................)
         uint64_t pos = u_endian_read8(data, is_bigendian) - ZERO_TICKS;
         data += 10; // 8b + 2b (pad)
@@ -1335,161 +2492,547 @@ PTFFormat::parsetempochanges_block(block_t &blk) {
     if (_tempochanges.empty()) {
         _tempochanges.push_back({ 0, 0, 120., QUARTER });
     }
+    _tempo_map = tempo_map_t(_tempochanges, _sessionrate);
     return true;
 }
 
-const PTFFormat::key_signature_t
-PTFFormat::main_keysignature() {
-    if (_keysignatures.empty()) {
-        return {true, true, 0};
+PTFFormat::grid_map_t::grid_map_t(const std::vector<time_signature_ev_t>& timesignatures) {
+    _segments.reserve(timesignatures.size());
+    for (const time_signature_ev_t& ts : timesignatures) {
+        segment_t s;
+        s.pos = ts.pos;
+        s.measure_num = ts.measure_num;
+        s.beat_len = QUARTER * 4 / ts.denominator;
+        s.bar_len = s.beat_len * ts.nominator;
+        _segments.push_back(s);
+    }
+    // sessions always start with a time signature, default to 4/4 otherwise
+    if (_segments.empty()) {
+        _segments.push_back({ 0, 1, QUARTER * 4, QUARTER });
     }
-    return find_main_event_value<key_signature_ev_t, key_signature_t>
-    (_keysignatures, [this](const key_signature_ev_t &e){ return ticks_to_samples(e.pos); });
 }
 
-const PTFFormat::time_signature_t
-PTFFormat::main_timesignature() {
-    if (_timesignatures.empty()) {
-        return {4, 4};
+uint64_t
+PTFFormat::grid_map_t::bbt_to_ticks(const bbt_t& bbt) const {
+    if (_segments.empty())
+        return 0;
+
+    std::vector<segment_t>::const_iterator next = std::upper_bound(_segments.begin(), _segments.end(), bbt.bar,
+                                                  [](uint32_t bar, const segment_t& s){ return bar < s.measure_num; });
+    const segment_t& s = next == _segments.begin() ? *next : *std::prev(next);
+    uint32_t bar = std::max(bbt.bar, s.measure_num);
+    uint32_t beat = std::max(bbt.beat, 1U);
+
+    return s.pos + (bar - s.measure_num) * s.bar_len + (beat - 1) * s.beat_len + bbt.ticks;
+}
+
+PTFFormat::bbt_t
+PTFFormat::grid_map_t::ticks_to_bbt(uint64_t ticks) const {
+    if (_segments.empty())
+        return { 1, 1, 0 };
+
+    std::vector<segment_t>::const_iterator next = std::upper_bound(_segments.begin(), _segments.end(), ticks,
+                                                  [](uint64_t pos, const segment_t& s){ return pos < s.pos; });
+    const segment_t& s = next == _segments.begin() ? *next : *std::prev(next);
+    uint64_t offset = ticks > s.pos ? ticks - s.pos : 0;
+    uint64_t in_bar = offset % s.bar_len;
+
+    return { uint32_t(s.measure_num + offset / s.bar_len), uint32_t(in_bar / s.beat_len + 1), in_bar % s.beat_len };
+}
+
+void
+PTFFormat::grid_map_t::bar_lines(uint64_t start, uint64_t end, std::vector<uint64_t>& ticks) const {
+    for (size_t i = 0; i < _segments.size(); i++) {
+        const segment_t& s = _segments[i];
+        uint64_t seg_end = i + 1 < _segments.size() ? std::min(end, _segments[i + 1].pos) : end;
+        uint64_t pos = s.pos;
+
+        if (seg_end <= start || pos >= seg_end)
+            continue;
+        if (pos < start) {
+            pos += (start - pos + s.bar_len - 1) / s.bar_len * s.bar_len;
+        }
+        for (; pos < seg_end; pos += s.bar_len) {
+            ticks.push_back(pos);
+        }
     }
-    return find_main_event_value<time_signature_ev_t, time_signature_t>
-    (_timesignatures, [this](const time_signature_ev_t &e){ return ticks_to_samples(e.pos); });
 }
 
-const double
-PTFFormat::main_tempo() {
-    // _tempochanges always contains at least one item!
-    if (_tempochanges.size() < 2 || this->region_ranges().empty()) {
-        return _tempochanges[0].event_value();
+uint64_t
+PTFFormat::bbt_to_samples(const bbt_t& bbt) const {
+    if (_grid_map.empty() || _tempo_map.empty())
+        return 0;
+    return _tempo_map.ticks_to_samples(_grid_map.bbt_to_ticks(bbt));
+}
+
+PTFFormat::bbt_t
+PTFFormat::samples_to_bbt(uint64_t samples) const {
+    if (_grid_map.empty() || _tempo_map.empty())
+        return { 1, 1, 0 };
+
+    uint64_t ticks = _tempo_map.samples_to_ticks(samples);
+    bbt_t bbt = _grid_map.ticks_to_bbt(ticks);
+
+    // the nearest tick can fall on the other side of a beat line than its rounded
+    // sample position, so settle the beat by the positions bbt_to_samples() reports
+    uint64_t beat_start = _grid_map.bbt_to_ticks({ bbt.bar, bbt.beat, 0 });
+    if (beat_start > 0 && _tempo_map.ticks_to_samples(beat_start) > samples) {
+        return _grid_map.ticks_to_bbt(beat_start - 1);
+    }
+    uint64_t next_beat = std::min(_grid_map.bbt_to_ticks({ bbt.bar, bbt.beat + 1, 0 }),
+                                  _grid_map.bbt_to_ticks({ bbt.bar + 1, 1, 0 }));
+    if (_tempo_map.ticks_to_samples(next_beat) <= samples) {
+        return _grid_map.ticks_to_bbt(next_beat);
     }
-    return find_main_event_value<tempo_change_t, double>(_tempochanges, [](const tempo_change_t &t){ return t.pos_in_samples; });
+    return bbt;
 }
 
-// finds main event value (for tempo / time sig / key sig changes) by looking up event value
-// which is used for the longest region-covered time in entire session
-template <class EV, class EV_VAL>
-const EV_VAL
-PTFFormat::find_main_event_value(const std::vector<EV> &events, std::function<const uint64_t(const EV&)> ev_pos_in_samples) {
-    // TODO: assert that events is non-empty!
-    if (region_ranges().empty() || events.size() == 1) {
-        return events[0].event_value();
+/* Sample positions of all bar lines before end, converted in a single pass */
+std::vector<uint64_t>
+PTFFormat::bar_lines_in_samples(uint64_t end) const {
+    std::vector<uint64_t> ticks;
+
+    if (_grid_map.empty() || _tempo_map.empty())
+        return ticks;
+
+    // one tick of slack either way of the nearest tick, trimmed below
+    _grid_map.bar_lines(0, _tempo_map.samples_to_ticks(end) + 2, ticks);
+    _tempo_map.ticks_to_samples(ticks.data(), ticks.data(), ticks.size());
+    while (!ticks.empty() && ticks.back() >= end) {
+        ticks.pop_back();
     }
+    return ticks;
+}
 
-    auto end_i = events.cend();
-    using iter_type = typename std::vector<EV>::const_iterator;
-    std::function<const uint64_t(const iter_type&)> safe_pos_in_samples = [=](const iter_type &i){
-        return i != end_i ? ev_pos_in_samples(*i) : UINT64_MAX;
-    };
-    // map of usage where event value is mapped to amount of region-covered samples where it's used
-    std::unordered_map<EV_VAL, uint64_t> usage;
-    // iterators of events i, next_i: next_i will always be i + 1; i starts at first event
-    auto i = events.cbegin();
-    auto next_i = std::next(i);
-    uint64_t length_from_prev = 0; // to track length from current range unused by previous event (when previous event ends before range ends)
-    uint64_t pos = safe_pos_in_samples(i); // position in samples for `i`
-    uint64_t next_pos = safe_pos_in_samples(next_i); // position in samples for `next_i`
-
-    auto r = this->region_ranges().cbegin();
-    while (r != this->region_ranges().cend()) {
-        // advance both iterators if:
-        // * range starts beyond next event position in samples AND
-        // * advanced iterator `i` will still be valid (!= cend())
-        if (r->startpos >= next_pos) {
-            if (next_i == end_i) {
-                break;
+/* Events of one kind on the sweep line, values referring to their usage entry */
+struct usage_stream_t {
+    std::vector<uint64_t> pos;     // event positions in samples
+    std::vector<uint32_t> slot;    // usage entry of each event
+    std::vector<uint64_t> samples; // usage by entry
+    size_t i;                      // event in effect
+};
+
+template <class EV, class V>
+static void
+usage_stream_init(usage_stream_t &stream, std::vector<PTFFormat::usage_t<V> > &usage,
+                  const std::vector<EV> &events, const std::vector<uint64_t> &pos) {
+    stream.pos = pos;
+    stream.i = 0;
+    for (const EV &e : events) {
+        V value = e.event_value();
+        uint32_t slot = 0;
+        while (slot < usage.size() && !(usage[slot].value == value)) {
+            slot++;
+        }
+        if (slot == usage.size()) {
+            usage.push_back({ value, 0 });
+        }
+        stream.slot.push_back(slot);
+    }
+    stream.samples.assign(usage.size(), 0);
+}
+
+template <class V>
+static V
+usage_stream_main(const usage_stream_t &stream, std::vector<PTFFormat::usage_t<V> > &usage, V dflt) {
+    uint32_t main = 0;
+    for (uint32_t slot = 0; slot < usage.size(); slot++) {
+        usage[slot].samples = stream.samples[slot];
+        if (usage[slot].samples > usage[main].samples) {
+            main = slot;
+        }
+    }
+    return usage.empty() ? dflt : usage[main].value;
+}
+
+/* Merges the key signature, time signature and tempo change streams with region
+   ranges in one pass: each range is cut at every event position falling within it
+   and each piece is added to the usage of the values in effect there. Positions
+   before the first event of a kind use its value. */
+const PTFFormat::main_values_t&
+PTFFormat::main_values(void) const {
+    const std::vector<region_range_t>& ranges = region_ranges();
+
+    compute_once(_main_values_cached, [this, &ranges]() {
+        _main_values = main_values_t();
+
+        std::vector<uint64_t> pos;
+        usage_stream_t streams[3];
+
+        pos.resize(_keysignatures.size());
+        for (size_t i = 0; i < pos.size(); i++) {
+            pos[i] = _keysignatures[i].pos;
+        }
+        _tempo_map.ticks_to_samples(pos.data(), pos.data(), pos.size());
+        usage_stream_init(streams[0], _main_values.keysignature_usage, _keysignatures, pos);
+
+        pos.resize(_timesignatures.size());
+        for (size_t i = 0; i < pos.size(); i++) {
+            pos[i] = _timesignatures[i].pos;
+        }
+        _tempo_map.ticks_to_samples(pos.data(), pos.data(), pos.size());
+        usage_stream_init(streams[1], _main_values.timesignature_usage, _timesignatures, pos);
+
+        pos.resize(_tempochanges.size());
+        for (size_t i = 0; i < pos.size(); i++) {
+            pos[i] = _tempochanges[i].pos_in_samples;
+        }
+        usage_stream_init(streams[2], _main_values.tempo_usage, _tempochanges, pos);
+
+        for (const region_range_t &r : ranges) {
+            uint64_t from = r.startpos;
+            while (from < r.endpos) {
+                uint64_t to = r.endpos;
+                for (usage_stream_t &s : streams) {
+                    if (s.pos.empty())
+                        continue;
+                    while (s.i + 1 < s.pos.size() && s.pos[s.i + 1] <= from) {
+                        s.i++;
+                    }
+                    if (s.i + 1 < s.pos.size() && s.pos[s.i + 1] < to) {
+                        to = s.pos[s.i + 1];
+                    }
+                }
+                for (usage_stream_t &s : streams) {
+                    if (!s.pos.empty())
+                        s.samples[s.slot[s.i]] += to - from;
+                }
+                from = to;
             }
-            i++;
-            next_i++;
-            pos = next_pos;
-            next_pos = safe_pos_in_samples(next_i);
-        }
-        if (r->startpos >= next_pos) {
-            const uint64_t usage_length = min(length_from_prev, min(r->endpos, next_pos) - pos);
-            usage[i->event_value()] += usage_length;
-            length_from_prev -= usage_length;
-        } else {
-            usage[i->event_value()] += min(r->endpos, next_pos) - pos;
-            length_from_prev = max(0ULL, r->endpos - next_pos);
-            r++;
         }
+
+        _main_values.keysignature = usage_stream_main(streams[0], _main_values.keysignature_usage, key_signature_t { true, true, 0 });
+        _main_values.timesignature = usage_stream_main(streams[1], _main_values.timesignature_usage, time_signature_t { 4, 4 });
+        _main_values.tempo = usage_stream_main(streams[2], _main_values.tempo_usage, 0.);
+    });
+    return _main_values;
+}
+
+const PTFFormat::key_signature_t
+PTFFormat::main_keysignature() const {
+    if (!loaded(PARSE_KEYSIGS)) {
+        return key_signature_t();
+    }
+    return main_values().keysignature;
+}
+
+const PTFFormat::time_signature_t
+PTFFormat::main_timesignature() const {
+    if (!loaded(PARSE_TIMESIGS)) {
+        return time_signature_t();
     }
+    return main_values().timesignature;
+}
 
-    // find and return event value with max usage
-    using pair_type = std::pair<EV_VAL, uint64_t>;
-    const auto &main = std::max_element(usage.cbegin(), usage.cend(),
-                                        [](const pair_type &v1, const pair_type &v2){ return v1.second < v2.second; });
-    return main->first;
+const double
+PTFFormat::main_tempo() const {
+    if (!loaded(PARSE_TEMPO)) {
+        return 0;
+    }
+    return main_values().tempo;
 }
 
 uint64_t
 PTFFormat::ticks_to_samples(uint64_t pos_in_ticks) const {
-    const auto &next_tempo = std::lower_bound(_tempochanges.cbegin(), _tempochanges.cend(), pos_in_ticks,
-                                              [](const tempo_change_t& t, uint64_t pos){ return t.pos < pos; });
-    // lower_bound will return either valid pointer to tempo change event or end(),
-    // so if it's not the first one, then it's safe to go one back
-    const auto &tempo = next_tempo == _tempochanges.cbegin() ? next_tempo : std::prev(next_tempo);
-    return ticks_to_samples(pos_in_ticks, *tempo);
+    return _tempo_map.ticks_to_samples(pos_in_ticks);
 }
 
 uint64_t
 PTFFormat::ticks_to_samples(uint64_t pos_in_ticks, const tempo_change_t& t) const {
-    double beats = double(pos_in_ticks - t.pos) / t.beat_len;
+    return tempo_map_t::ticks_to_samples(pos_in_ticks, t, _sessionrate);
+}
+
+uint64_t
+PTFFormat::tempo_map_t::ticks_to_samples(uint64_t ticks, const tempo_change_t& t, int64_t sessionrate) {
+    double beats = double(ticks - t.pos) / t.beat_len;
     // the rounding (instead of flooring) is done by PT itself, confirmed by tests
-    return t.pos_in_samples + uint64_t(round(beats * _sessionrate * 60 / t.tempo));
+    return t.pos_in_samples + uint64_t(round(beats * sessionrate * 60 / t.tempo));
+}
+
+PTFFormat::tempo_map_t::tempo_map_t(const std::vector<tempo_change_t>& tempochanges, int64_t sessionrate)
+    : _sessionrate(sessionrate)
+{
+    _segments.reserve(tempochanges.size());
+    for (const tempo_change_t& t : tempochanges) {
+        segment_t s;
+        s.tempo = t;
+        s.samples_per_tick = double(sessionrate) * 60 / (t.tempo * t.beat_len);
+        s.ticks_per_sample = (t.tempo * t.beat_len) / (double(sessionrate) * 60);
+        _segments.push_back(s);
+    }
+}
+
+/* Last segment starting before ticks, or the first one. hint is tried first,
+   followed by the next segment, so that sorted positions take O(1) each. */
+size_t
+PTFFormat::tempo_map_t::segment_for_ticks(uint64_t ticks, size_t hint) const {
+    size_t n = _segments.size();
+
+    if (hint < n && (hint == 0 || _segments[hint].tempo.pos < ticks)) {
+        if (hint + 1 == n || _segments[hint + 1].tempo.pos >= ticks)
+            return hint;
+        if (hint + 2 == n || _segments[hint + 2].tempo.pos >= ticks)
+            return hint + 1;
+    }
+    std::vector<segment_t>::const_iterator next = std::lower_bound(_segments.begin(), _segments.end(), ticks,
+                                                   [](const segment_t& s, uint64_t pos){ return s.tempo.pos < pos; });
+    return next == _segments.begin() ? 0 : next - _segments.begin() - 1;
+}
+
+/* Same as segment_for_ticks(), by position in samples */
+size_t
+PTFFormat::tempo_map_t::segment_for_samples(uint64_t samples, size_t hint) const {
+    size_t n = _segments.size();
+
+    if (hint < n && (hint == 0 || _segments[hint].tempo.pos_in_samples < samples)) {
+        if (hint + 1 == n || _segments[hint + 1].tempo.pos_in_samples >= samples)
+            return hint;
+        if (hint + 2 == n || _segments[hint + 2].tempo.pos_in_samples >= samples)
+            return hint + 1;
+    }
+    std::vector<segment_t>::const_iterator next = std::lower_bound(_segments.begin(), _segments.end(), samples,
+                                                   [](const segment_t& s, uint64_t pos){ return s.tempo.pos_in_samples < pos; });
+    return next == _segments.begin() ? 0 : next - _segments.begin() - 1;
+}
+
+/* Multiplies by the precomputed factor, which can only round differently from
+   ticks_to_samples(ticks, t, rate) when the result is within a few ulps of
+   halfway between two samples. Those rare cases take the exact formula. */
+uint64_t
+PTFFormat::tempo_map_t::segment_ticks_to_samples(const segment_t& s, uint64_t ticks) const {
+    double x = double(ticks - s.tempo.pos) * s.samples_per_tick;
+    double guard = 1e-9 + x * 4e-15;
+
+    if (fabs(x - floor(x) - 0.5) <= guard) {
+        return ticks_to_samples(ticks, s.tempo, _sessionrate);
+    }
+    return s.tempo.pos_in_samples + uint64_t(round(x));
+}
+
+uint64_t
+PTFFormat::tempo_map_t::segment_samples_to_ticks(const segment_t& s, uint64_t samples) const {
+    if (samples >= s.tempo.pos_in_samples) {
+        return s.tempo.pos + uint64_t(round(double(samples - s.tempo.pos_in_samples) * s.ticks_per_sample));
+    }
+    uint64_t back = uint64_t(round(double(s.tempo.pos_in_samples - samples) * s.ticks_per_sample));
+    return back < s.tempo.pos ? s.tempo.pos - back : 0;
+}
+
+uint64_t
+PTFFormat::tempo_map_t::ticks_to_samples(uint64_t ticks) const {
+    if (_segments.empty())
+        return 0;
+    return segment_ticks_to_samples(_segments[segment_for_ticks(ticks, 0)], ticks);
+}
+
+/* Nearest tick of a position in samples */
+uint64_t
+PTFFormat::tempo_map_t::samples_to_ticks(uint64_t samples) const {
+    if (_segments.empty())
+        return 0;
+    return segment_samples_to_ticks(_segments[segment_for_samples(samples, 0)], samples);
+}
+
+void
+PTFFormat::tempo_map_t::ticks_to_samples(const uint64_t *ticks, uint64_t *samples, size_t n) const {
+    size_t seg = 0;
+
+    if (_segments.empty()) {
+        std::fill(samples, samples + n, 0);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        seg = segment_for_ticks(ticks[i], seg);
+        samples[i] = segment_ticks_to_samples(_segments[seg], ticks[i]);
+    }
+}
+
+void
+PTFFormat::tempo_map_t::samples_to_ticks(const uint64_t *samples, uint64_t *ticks, size_t n) const {
+    size_t seg = 0;
+
+    if (_segments.empty()) {
+        std::fill(ticks, ticks + n, 0);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        seg = segment_for_samples(samples[i], seg);
+        ticks[i] = segment_samples_to_ticks(_segments[seg], samples[i]);
+    }
+}
+
+PTFFormat::region_range_t
+PTFFormat::track_range(const track_t &t) const {
+    region_range_t range { t.reg.startpos, t.reg.startpos + t.reg.length };
+    if (t.reg.is_startpos_in_ticks) {
+        range.startpos = ticks_to_samples(range.startpos);
+        // !! if this is audio clip, r->length is in samples, hence a different endpos conversion
+        range.endpos = t.reg.wave.filename.empty() ? ticks_to_samples(range.endpos) : range.startpos + t.reg.length;
+    }
+    return range;
 }
 
 void
-PTFFormat::add_region_ranges_from_tracks(const std::vector<track_t> &tracks) {
+PTFFormat::add_region_ranges_from_tracks(const std::vector<track_t> &tracks) const {
     for (auto t = tracks.cbegin(); t != tracks.cend(); ++t) {
         if (t->reg.length == 0) continue;
-        region_range_t range { t->reg.startpos, t->reg.startpos + t->reg.length };
-        if (t->reg.is_startpos_in_ticks) {
-            range.startpos = ticks_to_samples(range.startpos);
-            // !! if this is audio clip, r->length is in samples, hence a different endpos conversion
-            range.endpos = t->reg.wave.filename.empty() ? ticks_to_samples(range.endpos) : range.startpos + t->reg.length;
-        }
-        _region_ranges.push_back(range);
+        _region_ranges.push_back(track_range(*t));
     }
 }
 
 const std::vector<PTFFormat::region_range_t>&
-PTFFormat::region_ranges(void) {
-    if (_region_ranges_cached) {
-        return _region_ranges;
-    }
-    _region_ranges.clear();
+PTFFormat::region_ranges(void) const {
+    compute_once(_region_ranges_cached, [this]() {
+        _region_ranges.clear();
 
-    // 1. build vector of all region ranges with all start positions / end positions in samples
-    add_region_ranges_from_tracks(_tracks);
-    add_region_ranges_from_tracks(_miditracks);
-    // 2. sort all region ranges by start position
-    std::sort(_region_ranges.begin(), _region_ranges.end());
-    // 3. merge overlapping ranges
-    auto last_to_keep = _region_ranges.begin(); // last range to keep
-    auto next_r = last_to_keep == _region_ranges.end() ? last_to_keep : std::next(last_to_keep);
-    for (auto i = next_r; i != _region_ranges.end(); ++i) {
-        // If endpos of last range overlaps with startpos
-        if (last_to_keep->endpos >= i->startpos) {
-            // Merge previous and current range
-            last_to_keep->endpos = max(last_to_keep->endpos, i->endpos);
-        } else {
-            last_to_keep++;
-            if (last_to_keep != i) {
-                *last_to_keep = *i;
+        // positions in ticks cannot be placed without tempo changes
+        if (!loaded(PARSE_TEMPO)) {
+            return;
+        }
+
+        // 1. build vector of all region ranges with all start positions / end positions in samples
+        add_region_ranges_from_tracks(_tracks);
+        add_region_ranges_from_tracks(_miditracks);
+        // 2. sort all region ranges by start position
+        std::sort(_region_ranges.begin(), _region_ranges.end());
+        // 3. merge overlapping ranges
+        auto last_to_keep = _region_ranges.begin(); // last range to keep
+        auto next_r = last_to_keep == _region_ranges.end() ? last_to_keep : std::next(last_to_keep);
+        for (auto i = next_r; i != _region_ranges.end(); ++i) {
+            // If endpos of last range overlaps with startpos
+            if (last_to_keep->endpos >= i->startpos) {
+                // Merge previous and current range
+                last_to_keep->endpos = max(last_to_keep->endpos, i->endpos);
+            } else {
+                last_to_keep++;
+                if (last_to_keep != i) {
+                    *last_to_keep = *i;
+                }
             }
         }
+        // 4. discard ranges beyond last_to_keep
+        if (last_to_keep != _region_ranges.end()) {
+            _region_ranges.erase(++last_to_keep, _region_ranges.end());
+        }
+    });
+    return _region_ranges;
+}
+
+const std::vector<PTFFormat::placed_region_t>&
+PTFFormat::placed_regions(void) const {
+    compute_once(_placed_regions_cached, [this]() { index_placed_regions(); });
+    return _placed_regions.regions();
+}
+
+void
+PTFFormat::index_placed_regions(void) const {
+    std::vector<placed_region_t> placed;
+
+    // positions in ticks cannot be placed without tempo changes
+    if (!loaded(PARSE_TEMPO)) {
+        _placed_regions = region_index_t();
+        return;
+    }
+
+    for (int midi = 0; midi < 2; midi++) {
+        const std::vector<track_t>& tracks = midi ? _miditracks : _tracks;
+        for (const track_t& t : tracks) {
+            if (t.reg.length == 0) continue;
+            region_range_t range = track_range(t);
+            placed.push_back({ range.startpos, range.endpos, &t, midi != 0 });
+        }
+    }
+    _placed_regions = region_index_t(std::move(placed));
+}
+
+/* Leaves are at even indexes and the root at 2^levels - 1. Nodes past the end of
+   the array take the last real subtree's value. */
+PTFFormat::region_index_t::region_index_t(std::vector<placed_region_t> regions)
+    : _regions(std::move(regions))
+    , _levels(0)
+{
+    std::stable_sort(_regions.begin(), _regions.end(),
+                     [](const placed_region_t& a, const placed_region_t& b){ return a.startpos < b.startpos; });
+
+    size_t n = _regions.size();
+    if (n == 0)
+        return;
+
+    _max_end.resize(n);
+    size_t last_i = 0;
+    uint64_t last = 0;
+    for (size_t i = 0; i < n; i += 2) {
+        last_i = i;
+        last = _max_end[i] = _regions[i].endpos;
     }
-    // 4. discard ranges beyond last_to_keep
-    if (last_to_keep != _region_ranges.end()) {
-        _region_ranges.erase(++last_to_keep, _region_ranges.end());
+    int k;
+    for (k = 1; (size_t(1) << k) <= n; k++) {
+        size_t x = size_t(1) << (k - 1);
+        for (size_t i = (x << 1) - 1; i < n; i += x << 2) {
+            uint64_t el = _max_end[i - x];
+            uint64_t er = i + x < n ? _max_end[i + x] : last;
+            _max_end[i] = std::max(_regions[i].endpos, std::max(el, er));
+        }
+        last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+        if (last_i < n && _max_end[last_i] > last) {
+            last = _max_end[last_i];
+        }
     }
+    _levels = k - 1;
+}
 
-    _region_ranges_cached = true;
-    return _region_ranges;
+void
+PTFFormat::region_index_t::regions_in(uint64_t start, uint64_t end, std::vector<const placed_region_t*>& found) const {
+    struct node_t {
+        size_t x;  // node index
+        int    k;  // node level
+        bool   left_done;
+    };
+    node_t stack[64];
+    int top = 0;
+
+    size_t n = _regions.size();
+    if (n == 0 || start >= end)
+        return;
+
+    stack[top++] = { (size_t(1) << _levels) - 1, _levels, false };
+    while (top > 0) {
+        node_t z = stack[--top];
+        if (z.k <= 3) {
+            // small subtree, scan it in order
+            size_t i0 = z.x >> z.k << z.k;
+            size_t i1 = std::min(i0 + (size_t(1) << (z.k + 1)) - 1, n);
+            for (size_t i = i0; i < i1 && _regions[i].startpos < end; i++) {
+                if (start < _regions[i].endpos)
+                    found.push_back(&_regions[i]);
+            }
+        } else if (!z.left_done) {
+            size_t y = z.x - (size_t(1) << (z.k - 1));
+            stack[top++] = { z.x, z.k, true };
+            if (y >= n || _max_end[y] > start)
+                stack[top++] = { y, z.k - 1, false };
+        } else if (z.x < n && _regions[z.x].startpos < end) {
+            if (start < _regions[z.x].endpos)
+                found.push_back(&_regions[z.x]);
+            stack[top++] = { z.x + (size_t(1) << (z.k - 1)), z.k - 1, false };
+        }
+    }
+}
+
+void
+PTFFormat::regions_in(uint64_t start, uint64_t end, std::vector<const placed_region_t*>& found) const {
+    placed_regions();
+    _placed_regions.regions_in(start, end, found);
+}
+
+void
+PTFFormat::regions_at(uint64_t pos, std::vector<const placed_region_t*>& found) const {
+    if (pos < UINT64_MAX)
+        regions_in(pos, pos + 1, found);
 }
 
 const uint32_t
-PTFFormat::music_duration_secs(uint8_t max_gap_secs) {
+PTFFormat::music_duration_secs(uint8_t max_gap_secs) const {
     const uint64_t max_gap = max_gap_secs * _sessionrate;
 
     uint64_t end_at = 0, duration_agg = 0, duration_max = 0;
@@ -1510,3 +3053,54 @@ PTFFormat::music_duration_secs(uint8_t max_gap_secs) {
 
     return round(double(max(duration_max, duration_agg)) / _sessionrate);
 }
+
+/* The longest stretch of region ranges not interrupted by a gap over the threshold,
+   tracked for all thresholds at once. Equal to what music_duration_secs() sums up
+   range by range, as consecutive lengths and gaps add up to the stretch span. */
+std::vector<uint32_t>
+PTFFormat::music_durations_secs(const std::vector<uint8_t>& max_gaps_secs) const {
+    const std::vector<region_range_t>& ranges = region_ranges();
+    size_t n = max_gaps_secs.size();
+    std::vector<uint64_t> max_gap(n), start_at(n), duration_max(n, 0);
+    std::vector<uint32_t> durations(n, 0);
+
+    if (ranges.empty())
+        return durations;
+
+    for (size_t t = 0; t < n; t++) {
+        max_gap[t] = max_gaps_secs[t] * _sessionrate;
+        start_at[t] = ranges[0].startpos;
+    }
+    for (size_t i = 1; i < ranges.size(); i++) {
+        uint64_t end_at = ranges[i - 1].endpos;
+        uint64_t gap = ranges[i].startpos - end_at;
+        for (size_t t = 0; t < n; t++) {
+            if (gap > max_gap[t]) {
+                duration_max[t] = max(duration_max[t], end_at - start_at[t]);
+                start_at[t] = ranges[i].startpos;
+            }
+        }
+    }
+    for (size_t t = 0; t < n; t++) {
+        duration_max[t] = max(duration_max[t], ranges.back().endpos - start_at[t]);
+        durations[t] = round(double(duration_max[t]) / _sessionrate);
+    }
+    return durations;
+}
+
+std::vector<uint32_t>
+PTFFormat::gap_histogram_secs(void) const {
+    const std::vector<region_range_t>& ranges = region_ranges();
+    std::vector<uint32_t> histogram;
+
+    for (size_t i = 1; i < ranges.size(); i++) {
+        uint64_t gap = ranges[i].startpos - ranges[i - 1].endpos;
+        // merged ranges never touch, so every gap is at least one sample
+        uint64_t bin = min((gap - 1) / _sessionrate, (uint64_t)UINT8_MAX);
+        if (bin >= histogram.size()) {
+            histogram.resize(bin + 1, 0);
+        }
+        histogram[bin]++;
+    }
+    return histogram;
+}
@@ -0,0 +1,79 @@
+/*
+ * libptformat - a library to read ProTools sessions
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef PTFBATCHLOADER_H
+#define PTFBATCHLOADER_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "ptformat/ptformat.h"
+#include "ptformat/visibility.h"
+
+/* Loads many sessions in parallel on a work-stealing thread pool.
+   Every worker starts with an equal slice of the input and steals half of
+   the remaining work of another worker once its own slice runs out. */
+class LIBPTFORMAT_API PTFBatchLoader {
+public:
+    struct result_t {
+        std::string path;
+        int         error;                  // PTFFormat::load() return value
+        std::unique_ptr<PTFFormat> session; // NULL if loading failed
+
+        result_t () : error (0) {}
+    };
+
+    struct stats_t {
+        uint64_t sessions; // loaded successfully
+        uint64_t failed;
+        uint64_t bytes;    // decrypted bytes of successfully loaded sessions
+        double   wall_secs;
+
+        double mb_per_sec () const { return wall_secs > 0 ? bytes / wall_secs / 1e6 : 0; }
+        double sessions_per_sec () const { return wall_secs > 0 ? (sessions + failed) / wall_secs : 0; }
+        stats_t () : sessions (0), failed (0), bytes (0), wall_secs (0) {}
+    };
+
+    /* Called from worker threads in completion order, index is the position in the input */
+    typedef std::function<void(size_t index, result_t& result)> completion_t;
+
+    /* workers == 0 uses one worker per hardware thread */
+    PTFBatchLoader(unsigned workers = 0, PTFFormat::load_mode_t mode = PTFFormat::LOAD_MMAP);
+
+    /* Loads all paths and returns the results in input order */
+    std::vector<result_t> load(std::vector<std::string> const& paths);
+
+    /* Loads all paths handing each result to done as soon as it is ready,
+       sessions not moved out of the result are freed afterwards */
+    void load(std::vector<std::string> const& paths, completion_t const& done);
+
+    unsigned workers () const { return _workers; }
+    /* Aggregate counters of the last load() */
+    const stats_t& stats () const { return _stats; }
+
+private:
+    unsigned _workers;
+    PTFFormat::load_mode_t _mode;
+    stats_t _stats;
+};
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * libptformat - a library to read ProTools sessions
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef PTFCACHE_H
+#define PTFCACHE_H
+
+#include <string>
+#include <string_view>
+#include <stdint.h>
+#include "ptformat/ptformat.h"
+#include "ptformat/visibility.h"
+
+/* Parsed sessions saved to a flat file which is memory-mapped and read in place.
+   A cache file is a header followed by sections of fixed size records, located by
+   offsets in the header, with strings kept in a separate section and referred to
+   by offset and length. Records are in native byte order. The header carries the
+   format version and the size, modification time and content hash of the session
+   file, so caches of another version or of a changed session are rejected.
+
+   Everything parsed is cached except the raw block tree. */
+class LIBPTFORMAT_API PTFCache {
+public:
+    static const uint32_t VERSION = 1;
+
+    /* Identity of the session file a cache was written for */
+    struct key_t {
+        uint64_t size;
+        int64_t  mtime_ns;
+        uint64_t hash;     // content_hash() of the whole file
+    };
+
+    /* Fills key for the session file at path, hashing its content if with_hash.
+       Returns 0 on success, -1 if the file cannot be read. */
+    static int session_key(std::string const& path, key_t& key, bool with_hash = true);
+    static uint64_t content_hash(const unsigned char *data, uint64_t len);
+
+    /* Writes a session loaded from a file (ptf.path()) to cache_path, replacing it
+       atomically. The cache is keyed by the session file as load() read it (see
+       PTFFormat::file_stat()), so a session changed since is not cached as current.
+       Return values:
+         0    success
+        -1    not a session loaded from a file
+        -2    cannot write the cache file
+    */
+    static int write(const PTFFormat& ptf, std::string const& cache_path);
+
+    struct string_t {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    struct info_t {
+        int64_t  sessionrate;
+        uint32_t loaded;         // PTFFormat::section_t bits
+        uint8_t  version;
+        uint8_t  bitdepth;
+        // main values
+        uint8_t  main_key_is_major;
+        uint8_t  main_key_is_sharp;
+        double   main_tempo;
+        uint8_t  main_key_sign_count;
+        uint8_t  main_time_nominator;
+        uint8_t  main_time_denominator;
+        uint8_t  pad[5];
+    };
+
+    struct wav_t {
+        string_t filename;
+        int64_t  posabsolute;
+        uint64_t length;
+        uint16_t index;
+        uint8_t  pad[6];
+    };
+
+    struct region_t {
+        string_t name;
+        uint64_t startpos;
+        int64_t  offset;
+        uint64_t length;
+        wav_t    wave;
+        uint32_t midi_first;     // first of midi_count events in midi_events()
+        uint32_t midi_count;
+        uint16_t index;
+        uint8_t  is_startpos_in_ticks;
+        uint8_t  pad[5];
+    };
+
+    struct track_t {
+        string_t name;
+        uint16_t index;
+        uint8_t  playlist;
+        uint8_t  pad[5];
+        region_t reg;
+    };
+
+    struct midi_ev_t {
+        uint64_t pos;
+        uint64_t length;
+        uint8_t  note;
+        uint8_t  velocity;
+        uint8_t  pad[6];
+    };
+
+    struct key_signature_ev_t {
+        uint64_t pos;
+        uint8_t  is_major;
+        uint8_t  is_sharp;
+        uint8_t  sign_count;
+        uint8_t  pad[5];
+    };
+
+    struct time_signature_ev_t {
+        uint64_t pos;
+        uint32_t measure_num;
+        uint8_t  nominator;
+        uint8_t  denominator;
+        uint8_t  pad[2];
+    };
+
+    typedef PTFFormat::tempo_change_t tempo_change_t;
+    typedef PTFFormat::region_range_t region_range_t;
+
+    struct metadata_t {
+        string_t title;
+        string_t artist;
+        string_t location;
+        uint32_t contributors_first; // first of contributors_count strings in contributors()
+        uint32_t contributors_count;
+    };
+
+    /* Same tree as PTFFormat::metadata_fields() */
+    struct metadata_field_t {
+        string_t name;
+        string_t value;
+        uint32_t type;
+        uint32_t parent;
+        uint32_t first_child;
+        uint32_t next_sibling;
+    };
+
+    /* Records of a section, pointing into the mapped cache */
+    template <class T>
+    class array_t {
+    public:
+        array_t () : _data (NULL), _size (0) {}
+        array_t (const T *data, size_t size) : _data (data), _size (size) {}
+
+        const T* begin () const { return _data; }
+        const T* end () const { return _data + _size; }
+        size_t size () const { return _size; }
+        bool empty () const { return _size == 0; }
+        const T& operator[] (size_t i) const { return _data[i]; }
+
+    private:
+        const T *_data;
+        size_t _size;
+    };
+
+    PTFCache();
+    ~PTFCache();
+
+    /* Maps cache_path if it was written for the session at session_path as it is now.
+       Size and modification time of the session are always compared, verify_hash
+       hashes its content as well. Return values:
+         0    success
+        -1    cannot open cache file
+        -2    not a cache file, another version or byte order, or damaged
+        -3    stale, the session file has changed or cannot be read
+    */
+    int open(std::string const& cache_path, std::string const& session_path, bool verify_hash = false);
+    void close(void);
+
+    bool is_open () const { return _data != NULL; }
+    /* Key of the session the cache was written for, zero when not open */
+    const key_t& key () const;
+
+    /* Everything below stays valid until close() */
+    std::string_view str (const string_t& s) const;
+
+    const info_t& info () const { return *_info; }
+    array_t<wav_t>               audiofiles () const;
+    array_t<region_t>            regions () const;
+    array_t<region_t>            midiregions () const;
+    array_t<track_t>             tracks () const;
+    array_t<track_t>             miditracks () const;
+    array_t<midi_ev_t>           midi_events (const region_t& r) const;
+    array_t<key_signature_ev_t>  keysignatures () const;
+    array_t<time_signature_ev_t> timesignatures () const;
+    array_t<tempo_change_t>      tempochanges () const;
+    array_t<region_range_t>      region_ranges () const;
+    const metadata_t&            metadata () const { return *_metadata; }
+    array_t<string_t>            contributors () const;
+    array_t<metadata_field_t>    metadata_fields () const;
+    array_t<unsigned char>       metadata_base64 () const;
+
+private:
+    enum section_id_t {
+        SEC_INFO,
+        SEC_STRINGS,
+        SEC_AUDIOFILES,
+        SEC_REGIONS,
+        SEC_MIDIREGIONS,
+        SEC_TRACKS,
+        SEC_MIDITRACKS,
+        SEC_MIDI_EVENTS,
+        SEC_KEYSIGS,
+        SEC_TIMESIGS,
+        SEC_TEMPO,
+        SEC_REGION_RANGES,
+        SEC_METADATA,
+        SEC_CONTRIBUTORS,
+        SEC_METADATA_FIELDS,
+        SEC_METADATA_BASE64,
+        SEC_COUNT
+    };
+
+    struct section_t {
+        uint64_t offset;
+        uint64_t size;   // in bytes
+    };
+
+    struct header_t {
+        char      magic[8];
+        uint32_t  version;
+        uint32_t  byte_order;
+        key_t     key;
+        uint64_t  file_size;
+        section_t sections[SEC_COUNT];
+    };
+
+    class writer_t;
+
+    template <class T> array_t<T> section (section_id_t id) const;
+    bool check_sections (void) const;
+    bool check_metadata_fields (void) const;
+
+    const unsigned char *_data;
+    uint64_t _len;
+    bool _mapped;
+    const header_t *_header;
+    const info_t *_info;
+    const metadata_t *_metadata;
+};
+
+#endif
@@ -24,10 +24,19 @@
 #define PTFFORMAT_H
 
 #include <string>
+#include <string_view>
+#include <cstdio>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include <stdint.h>
+#include <strings.h>
 #include "ptformat/visibility.h"
 
 class LIBPTFORMAT_API PTFFormat {
@@ -35,6 +44,71 @@ public:
     PTFFormat();
     ~PTFFormat();
 
+    /* Session file loading modes:
+        LOAD_READ    read the file into a heap buffer with block reads
+        LOAD_MMAP    map the file privately and decrypt it in place,
+                     non-regular files fall back to LOAD_READ. The file must
+                     not be truncated or rewritten while the session is in use,
+                     as that replaces the mapped data.
+    */
+    enum load_mode_t {
+        LOAD_READ,
+        LOAD_MMAP
+    };
+
+    /* Session sections a load can be limited to, skipped sections are not parsed at all.
+       PARSE_HEADER (version, sample rate and bit depth) is always parsed, PARSE_MIDI
+       implies PARSE_REGIONS (regions and tracks) which implies PARSE_AUDIO. Derived values
+       (region_ranges(), main_tempo(), music_duration_secs() etc.) only account
+       for the sections loaded, and need PARSE_TEMPO to place events in time.
+       main_keysignature(), main_timesignature() and main_tempo() return zero values
+       when their section is not loaded (key_signature_t(), time_signature_t() and 0),
+       not the C major and 4/4 of a loaded session without events.
+    */
+    enum section_t {
+        PARSE_HEADER   = 1 << 0,
+        PARSE_AUDIO    = 1 << 1,
+        PARSE_REGIONS  = 1 << 2,
+        PARSE_MIDI     = 1 << 3,
+        PARSE_METADATA = 1 << 4,
+        PARSE_KEYSIGS  = 1 << 5,
+        PARSE_TIMESIGS = 1 << 6,
+        PARSE_TEMPO    = 1 << 7,
+        PARSE_ALL      = 0xff
+    };
+
+    enum load_stage_t {
+        STAGE_UNXOR,    // reading and decrypting the session file
+        STAGE_BLOCKS,   // building the block tree
+        STAGE_HEADER,
+        STAGE_AUDIO,
+        STAGE_REST,     // regions and tracks
+        STAGE_MIDI,
+        STAGE_METADATA,
+        STAGE_KEYSIGS,
+        STAGE_TIMESIGS,
+        STAGE_TEMPO,
+        STAGE_COUNT
+    };
+
+    /* Collected on every load from counters the parser keeps anyway, apart from
+       heap_bytes which is summed up once at the end */
+    struct load_stats_t {
+        uint64_t stage_ns[STAGE_COUNT]; // wall time, zero for stages not run
+        uint64_t bytes;                 // session bytes decrypted
+        uint64_t blocks;
+        uint32_t max_depth;             // of the block tree, 1 if there are only top level blocks
+        uint64_t block_probes;          // same as block_probes()
+        uint64_t search_bytes;          // same as search_bytes(), jumpto() and version detection
+        uint64_t wavs;
+        uint64_t regions;               // audio and MIDI
+        uint64_t tracks;                // audio and MIDI
+        uint64_t midi_events;           // of distinct MIDI chunks
+        uint64_t heap_bytes;            // retained by the PTFFormat once loaded, not a high-water mark
+
+        static const char* stage_name (load_stage_t stage);
+    };
+
     /* Return values:
          0    success
         -1    error decrypting pt session
@@ -45,25 +119,129 @@ public:
         -6    error parsing audio
         -7    error parsing region/track info
         -8    error parsing midi
-        -9    error parsing metadata
+        -9    error locating metadata (a malformed metadata struct loads with empty metadata)
         -10   error parsing key signatures
         -11   error parsing time signatures
         -12   error parsing tempo changes
     */
-    int load(std::string const& path);
+    int load(std::string const& path, load_mode_t mode = LOAD_MMAP, uint32_t sections = PARSE_ALL,
+             load_stats_t *stats = NULL);
+
+    /* Loads a session from memory, return values are the same as load(path).
+       load_buffer() works on a private copy of data. load_owned() takes ownership
+       of a malloc()ed buffer (even when loading fails) and decrypts it in place.
+       All load variants copy load_stats() to stats if given. */
+    int load_buffer(const void *data, uint64_t len, uint32_t sections = PARSE_ALL, load_stats_t *stats = NULL);
+    int load_owned(unsigned char *data, uint64_t len, uint32_t sections = PARSE_ALL, load_stats_t *stats = NULL);
+
+    /* Loads a session into an immutable snapshot, NULL on failure with the load()
+       result in err. All queries of a PTFFormat are const and data derived on
+       first use is computed exactly once, so any number of threads can share a
+       snapshot without locking. */
+    static std::shared_ptr<const PTFFormat> load_snapshot(std::string const& path, int *err = NULL,
+                                                          load_mode_t mode = LOAD_MMAP, uint32_t sections = PARSE_ALL,
+                                                          load_stats_t *stats = NULL);
+
+    /* True if all of the given sections have been parsed. Accessors of sections
+       which were not are empty, which is not to be confused with an empty session. */
+    bool loaded(uint32_t sections) const { return (_loaded & sections) == sections; }
 
     /* Return values:
          0    success
         -1    error decrypting pt session
     */
-    int unxor(std::string const& path);
+    int unxor(std::string const& path, load_mode_t mode = LOAD_MMAP);
+
+    /* XOR decryption kernels, XOR_KERNEL_AUTO picks the fastest one the running CPU supports */
+    enum xor_kernel_t {
+        XOR_KERNEL_AUTO,
+        XOR_KERNEL_SCALAR,
+        XOR_KERNEL_SSE2,
+        XOR_KERNEL_AVX2
+    };
+
+    static bool xor_kernel_supported(xor_kernel_t kernel);
+
+    /* Receives decrypted session data chunk by chunk, returning false aborts the stream */
+    typedef std::function<bool(const unsigned char *data, uint64_t len)> unxor_sink_t;
+
+    /* Decrypts a session read from fd_in in fixed size chunks using constant memory.
+       Streamed bytes are identical to unxored_data() of the loaded session.
+       Return values:
+         0    success
+        -1    error decrypting pt session (or reading / writing data)
+    */
+    static int unxor_stream(int fd_in, int fd_out);
+    static int unxor_stream(int fd_in, unxor_sink_t const& sink);
+
+    /* Decrypts len bytes of data found at file offset pos in place (xor is symmetric,
+       so this encrypts as well). The first 20 bytes of a session are never encrypted
+       and carry xor_type (0x12) and xor_value (0x13). Returns false on unknown xor_type. */
+    static bool unxor_range(unsigned char *data, uint64_t len, uint64_t pos, uint8_t xor_type, uint8_t xor_value,
+                            xor_kernel_t kernel = XOR_KERNEL_AUTO);
     
+    static constexpr uint32_t NO_BLOCK = UINT32_MAX;
+
+    /* Node of the block tree. All nodes live in one array in file (pre-)order and
+       refer to each other by index into it, NO_BLOCK meaning none. */
     struct block_t {
         uint16_t block_type;        // type of block
         uint32_t block_size;        // size of block
         uint16_t content_type;      // type of content
         uint32_t offset;            // offset in file
-        std::vector<block_t> child; // vector of child blocks
+        uint32_t parent;            // index of enclosing block
+        uint32_t first_child;       // index of first child block
+        uint32_t next_sibling;      // index of next block with the same parent
+    };
+
+    /* Iterable list of siblings in a tree stored as an array of nodes linked by
+       next_sibling indices, e.g. blocks as returned by children() and toplevel_blocks() */
+    template <class T>
+    class sibling_list_t {
+    public:
+        class const_iterator {
+        public:
+            typedef std::forward_iterator_tag iterator_category;
+            typedef T value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const T* pointer;
+            typedef const T& reference;
+
+            const_iterator() : _nodes(NULL), _index(NO_BLOCK) {}
+            const_iterator(const std::vector<T> *nodes, uint32_t index) : _nodes(nodes), _index(index) {}
+
+            reference operator*() const { return (*_nodes)[_index]; }
+            pointer operator->() const { return &(*_nodes)[_index]; }
+            const_iterator& operator++() { _index = (*_nodes)[_index].next_sibling; return *this; }
+            const_iterator operator++(int) { const_iterator it = *this; ++(*this); return it; }
+            bool operator==(const const_iterator& other) const { return _index == other._index; }
+            bool operator!=(const const_iterator& other) const { return _index != other._index; }
+
+        private:
+            const std::vector<T> *_nodes;
+            uint32_t _index;
+        };
+
+        sibling_list_t(const std::vector<T> *nodes, uint32_t first) : _nodes(nodes), _first(first) {}
+
+        const_iterator begin() const { return const_iterator(_nodes, _first); }
+        const_iterator end() const { return const_iterator(_nodes, NO_BLOCK); }
+        bool empty() const { return _first == NO_BLOCK; }
+
+    private:
+        const std::vector<T> *_nodes;
+        uint32_t _first;
+    };
+
+    typedef sibling_list_t<block_t> block_list_t;
+
+    /* Self-contained nested copy of a block subtree, see nested_blocks() */
+    struct nested_block_t {
+        uint16_t block_type;               // type of block
+        uint32_t block_size;               // size of block
+        uint16_t content_type;             // type of content
+        uint32_t offset;                   // offset in file
+        std::vector<nested_block_t> child; // vector of child blocks
     };
 
     struct wav_t {
@@ -94,6 +272,80 @@ public:
         midi_ev_t () : pos (0), length (0), note (0), velocity (0) {}
     };
 
+    /* Events of a MIDI chunk stored column by column */
+    struct midi_columns_t {
+        std::vector<uint64_t> pos;
+        std::vector<uint64_t> length;
+        std::vector<uint8_t>  note;
+        std::vector<uint8_t>  velocity;
+
+        size_t size () const { return pos.size(); }
+
+        midi_ev_t event (size_t i) const {
+            midi_ev_t ev;
+            ev.pos = pos[i];
+            ev.length = length[i];
+            ev.note = note[i];
+            ev.velocity = velocity[i];
+            return ev;
+        }
+    };
+
+    /* Read-only view of the events of a MIDI chunk. Events are stored once per chunk
+       and shared by all copies of the view, so copying regions and tracks is cheap.
+       Events are assembled into midi_ev_t on access, columns() gives direct access.
+       Iterators refer to the shared events, so they outlive the view they came from. */
+    class midi_events_t {
+    public:
+        class const_iterator {
+        public:
+            typedef std::random_access_iterator_tag iterator_category;
+            typedef midi_ev_t value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const midi_ev_t* pointer;
+            typedef midi_ev_t reference;
+
+            const_iterator () : _columns (NULL), _i (0) {}
+            const_iterator (const midi_columns_t *columns, size_t i) : _columns (columns), _i (i) {}
+
+            midi_ev_t operator* () const { return _columns->event(_i); }
+            midi_ev_t operator[] (difference_type n) const { return _columns->event(_i + n); }
+            const_iterator& operator++ () { ++_i; return *this; }
+            const_iterator operator++ (int) { const_iterator it = *this; ++_i; return it; }
+            const_iterator& operator-- () { --_i; return *this; }
+            const_iterator operator-- (int) { const_iterator it = *this; --_i; return it; }
+            const_iterator& operator+= (difference_type n) { _i += n; return *this; }
+            const_iterator& operator-= (difference_type n) { _i -= n; return *this; }
+            const_iterator operator+ (difference_type n) const { return const_iterator (_columns, _i + n); }
+            const_iterator operator- (difference_type n) const { return const_iterator (_columns, _i - n); }
+            difference_type operator- (const const_iterator& other) const { return _i - other._i; }
+            bool operator== (const const_iterator& other) const { return _i == other._i; }
+            bool operator!= (const const_iterator& other) const { return _i != other._i; }
+            bool operator< (const const_iterator& other) const { return _i < other._i; }
+
+        private:
+            const midi_columns_t *_columns;
+            size_t _i;
+        };
+
+        midi_events_t () {}
+        explicit midi_events_t (std::shared_ptr<const midi_columns_t> columns) : _columns (columns) {}
+
+        const midi_columns_t& columns () const {
+            static const midi_columns_t none;
+            return _columns ? *_columns : none;
+        }
+        const_iterator begin () const { return const_iterator (&columns(), 0); }
+        const_iterator end () const { return const_iterator (&columns(), size()); }
+        size_t size () const { return _columns ? _columns->size() : 0; }
+        bool empty () const { return size() == 0; }
+
+        midi_ev_t operator[] (size_t i) const { return _columns->event(i); }
+
+    private:
+        std::shared_ptr<const midi_columns_t> _columns;
+    };
+
     struct region_t {
         std::string name;
         uint16_t    index;
@@ -105,7 +357,7 @@ public:
         // ! 3. For MIDI clips, length will be either in ticks or samples (depending on is_startpos_in_ticks)
         uint64_t    length;
         wav_t       wave;
-        std::vector<midi_ev_t> midi;
+        midi_events_t midi;
 
         bool operator ==(const region_t& other) const {
             return (this->index == other.index);
@@ -128,6 +380,38 @@ public:
         }
     };
 
+    struct track_t;
+
+    /* Region of a track placed on the timeline, positions in samples, endpos exclusive */
+    struct placed_region_t {
+        uint64_t       startpos;
+        uint64_t       endpos;
+        const track_t* track;
+        bool           is_midi;
+    };
+
+    /* Implicit interval tree of cgranges over placed regions: regions sorted by start
+       position are the in-order traversal of a complete binary tree, each node is
+       augmented with the largest endpos of its subtree. Queries take O(log n + k) and
+       append the regions overlapping [start, end) in start position order. */
+    class LIBPTFORMAT_API region_index_t {
+    public:
+        region_index_t () : _levels (0) {}
+        region_index_t (std::vector<placed_region_t> regions);
+
+        bool empty () const { return _regions.empty(); }
+        const std::vector<placed_region_t>& regions () const { return _regions; }
+
+        void regions_in (uint64_t start, uint64_t end, std::vector<const placed_region_t*>& found) const;
+
+    private:
+        std::vector<placed_region_t> _regions;
+        // largest endpos within the subtree of each region
+        // (node i is at level = number of trailing 1 bits of i)
+        std::vector<uint64_t> _max_end;
+        int _levels;
+    };
+
     struct track_t {
         std::string name;
         uint16_t    index;
@@ -151,6 +435,21 @@ public:
         std::string location;
     };
 
+    /* Field of the session metadata struct. Fields form a tree stored like blocks,
+       in pre-order with NO_BLOCK meaning none. Names and values point into the
+       decoded metadata (see metadata_base64()) and stay valid until the next load().
+       Names are as stored, where Pro Tools writes '/' as a tab. */
+    struct metadata_field_t {
+        std::string_view name;      // field name
+        std::string_view value;     // string value, empty for structs
+        uint32_t         type;      // 0 for strings, 3 for structs
+        uint32_t         parent;       // index of enclosing struct field
+        uint32_t         first_child;  // index of first field of a struct
+        uint32_t         next_sibling; // index of next field of the same struct
+    };
+
+    typedef sibling_list_t<metadata_field_t> metadata_field_list_t;
+
     /** MIDI POSITION (key_signature_t.pos, time_signature_t.pos, tempo_change_t.pos)
         is encoded as PPQN (or ticks) since session start.
         960,000 PPQN resolution is being used, so if we have 4/4 time signature, then second measure (2|1|000)
@@ -214,75 +513,123 @@ public:
         const double event_value() const { return tempo; }
     };
 
-    bool find_track(uint16_t index, track_t& tt) const {
-        std::vector<track_t>::const_iterator begin = _tracks.begin();
-        std::vector<track_t>::const_iterator finish = _tracks.end();
-        std::vector<track_t>::const_iterator found;
+    /* Conversion between MIDI positions (ticks) and samples along tempo changes.
+       Positions are converted within the last tempo segment starting before them
+       (or the first one), giving exactly the same rounding as converting with
+       tempo changes one by one. Bulk conversions take positions in any order
+       but are fastest when they are sorted. */
+    class LIBPTFORMAT_API tempo_map_t {
+    public:
+        tempo_map_t () : _sessionrate (0) {}
+        tempo_map_t (const std::vector<tempo_change_t>& tempochanges, int64_t sessionrate);
+
+        bool empty () const { return _segments.empty(); }
+        size_t heap_bytes () const { return _segments.capacity() * sizeof(segment_t); }
+
+        uint64_t ticks_to_samples (uint64_t ticks) const;
+        uint64_t samples_to_ticks (uint64_t samples) const;
+        void ticks_to_samples (const uint64_t *ticks, uint64_t *samples, size_t n) const;
+        void samples_to_ticks (const uint64_t *samples, uint64_t *ticks, size_t n) const;
+
+        /* Conversion within a single tempo segment, as done by Pro Tools */
+        static uint64_t ticks_to_samples (uint64_t ticks, const tempo_change_t& t, int64_t sessionrate);
+
+    private:
+        struct segment_t {
+            tempo_change_t tempo;
+            double samples_per_tick;
+            double ticks_per_sample;
+        };
+
+        size_t segment_for_ticks (uint64_t ticks, size_t hint) const;
+        size_t segment_for_samples (uint64_t samples, size_t hint) const;
+        uint64_t segment_ticks_to_samples (const segment_t& s, uint64_t ticks) const;
+        uint64_t segment_samples_to_ticks (const segment_t& s, uint64_t samples) const;
+
+        std::vector<segment_t> _segments;
+        int64_t _sessionrate;
+    };
 
-        track_t t (index);
+    const tempo_map_t& tempo_map () const { return _tempo_map; }
 
-        if ((found = std::find(begin, finish, t)) != finish) {
-            tt = *found;
-            return true;
+    /* Musical position: 1-based bar and beat, and ticks (960,000 PPQN) into the beat */
+    struct bbt_t {
+        uint32_t bar;
+        uint32_t beat;
+        uint64_t ticks;
+
+        bool operator==(const bbt_t &other) const {
+            return (bar == other.bar && beat == other.beat && ticks == other.ticks);
         }
-        return false;
-    }
+    };
 
-    bool find_region(uint16_t index, region_t& rr) const {
-        std::vector<region_t>::const_iterator begin = _regions.begin();
-        std::vector<region_t>::const_iterator finish = _regions.end();
-        std::vector<region_t>::const_iterator found;
+    /* Bars and beats along time signature changes. Each change starts bar measure_num
+       at its position; the last bar before a change may be shorter when the change
+       does not fall on a bar line. Positions before the first change belong to it. */
+    class LIBPTFORMAT_API grid_map_t {
+    public:
+        grid_map_t () {}
+        grid_map_t (const std::vector<time_signature_ev_t>& timesignatures);
 
-        region_t r;
-        r.index = index;
+        bool empty () const { return _segments.empty(); }
+        size_t heap_bytes () const { return _segments.capacity() * sizeof(segment_t); }
 
-        if ((found = std::find(begin, finish, r)) != finish) {
-            rr = *found;
-            return true;
-        }
-        return false;
-    }
-    
-    bool find_miditrack(uint16_t index, track_t& tt) const {
-        std::vector<track_t>::const_iterator begin = _miditracks.begin();
-        std::vector<track_t>::const_iterator finish = _miditracks.end();
-        std::vector<track_t>::const_iterator found;
+        uint64_t bbt_to_ticks (const bbt_t& bbt) const;
+        bbt_t ticks_to_bbt (uint64_t ticks) const;
 
-        track_t t (index);
+        /* Positions of all bar lines in [start, end), appended in order */
+        void bar_lines (uint64_t start, uint64_t end, std::vector<uint64_t>& ticks) const;
 
-        if ((found = std::find(begin, finish, t)) != finish) {
-            tt = *found;
-            return true;
-        }
-        return false;
-    }
+    private:
+        struct segment_t {
+            uint64_t pos;
+            uint32_t measure_num;
+            uint64_t bar_len;
+            uint64_t beat_len;
+        };
 
-    bool find_midiregion(uint16_t index, region_t& rr) const {
-        std::vector<region_t>::const_iterator begin = _midiregions.begin();
-        std::vector<region_t>::const_iterator finish = _midiregions.end();
-        std::vector<region_t>::const_iterator found;
+        std::vector<segment_t> _segments;
+    };
 
-        region_t r (index);
+    const grid_map_t& grid_map () const { return _grid_map; }
 
-        if ((found = std::find(begin, finish, r)) != finish) {
-            rr = *found;
-            return true;
-        }
-        return false;
+    /* Musical positions in samples, requiring both time signatures and tempo changes.
+       When either was not loaded bbt_to_samples() returns 0, samples_to_bbt() returns
+       1|1|0 and bar_lines_in_samples() returns no bar lines. */
+    uint64_t bbt_to_samples (const bbt_t& bbt) const;
+    bbt_t samples_to_bbt (uint64_t samples) const;
+    std::vector<uint64_t> bar_lines_in_samples (uint64_t end) const;
+
+    /* Entity lookups by index, matching the first entity parsed with that index.
+       The pointer returning variants do not copy, pointers stay valid until the next load(). */
+    const track_t* find_track(uint16_t index) const { return find_entity(_tracks, _track_index, index); }
+    const region_t* find_region(uint16_t index) const { return find_entity(_regions, _region_index, index); }
+    const track_t* find_miditrack(uint16_t index) const { return find_entity(_miditracks, _miditrack_index, index); }
+    const region_t* find_midiregion(uint16_t index) const { return find_entity(_midiregions, _midiregion_index, index); }
+    const wav_t* find_wav(uint16_t index) const;
+
+    bool find_track(uint16_t index, track_t& tt) const {
+        return find_entity(_tracks, _track_index, index, tt);
     }
 
-    bool find_wav(uint16_t index, wav_t& ww) const {
-        std::vector<wav_t>::const_iterator begin = _audiofiles.begin();
-        std::vector<wav_t>::const_iterator finish = _audiofiles.end();
-        std::vector<wav_t>::const_iterator found;
+    bool find_region(uint16_t index, region_t& rr) const {
+        return find_entity(_regions, _region_index, index, rr);
+    }
+    
+    bool find_miditrack(uint16_t index, track_t& tt) const {
+        return find_entity(_miditracks, _miditrack_index, index, tt);
+    }
 
-        wav_t w (index);
+    bool find_midiregion(uint16_t index, region_t& rr) const {
+        return find_entity(_midiregions, _midiregion_index, index, rr);
+    }
 
-        if ((found = std::find(begin, finish, w)) != finish) {
-            ww = *found;
-            return true;
-        }
-        return false;
+    bool find_wav(uint16_t index, wav_t& ww) const {
+        const wav_t *w = find_wav(index);
+        if (!w)
+            return false;
+        ww = *w;
+        return true;
     }
 
     static bool regionexistsin(std::vector<region_t> const& reg, uint16_t index) {
@@ -309,33 +656,148 @@ public:
         return false;
     }
 
-    std::vector<block_t> blocks () const { return _blocks; }
+    /* All blocks in file order, see block_t. Valid until the next load(). */
+    const std::vector<block_t>& block_arena () const { return _blocks; }
+    block_list_t toplevel_blocks () const { return block_list_t(&_blocks, _blocks.empty() ? NO_BLOCK : 0); }
+    block_list_t children (const block_t& b) const { return block_list_t(&_blocks, b.first_child); }
+
+    /* Compatibility view of the block tree as nested vectors, one allocation per block */
+    std::vector<nested_block_t> nested_blocks () const;
+    /* Top level blocks with their children, same as nested_blocks() */
+    std::vector<nested_block_t> blocks () const { return nested_blocks(); }
+
+    /* 64-bit hash of a byte range, the same in every session and version of the library */
+    static uint64_t hash_bytes (const unsigned char *data, uint64_t len);
+
+    /* Hash of the type, size and bytes of a block. Hashes are Merkle-style: a block
+       combines the hashes of its children with those of the bytes in between, so
+       all of them are computed in one pass over the session on first use. */
+    uint64_t block_hash (const block_t& b) const;
+
+    struct block_diff_t {
+        enum kind_t {
+            BLOCK_CHANGED, // same content type, different bytes
+            BLOCK_ADDED,
+            BLOCK_REMOVED
+        };
+        kind_t   kind;
+        uint32_t old_block; // index into block_arena() of the older session, NO_BLOCK if added
+        uint32_t new_block; // index into block_arena() of the newer session, NO_BLOCK if removed
+    };
+
+    /* Structural diff of the block trees of two sessions in pre-order. Sibling blocks
+       are paired in order by content type, looking one block ahead on either side for
+       insertions and removals. Blocks with equal hashes are skipped along with their
+       children, changed blocks are followed by the diff of their children. */
+    static std::vector<block_diff_t> diff_blocks (const PTFFormat& older, const PTFFormat& newer);
+
+    /* Number of offsets examined for a block header while building the block tree,
+       at most one per byte of the session */
+    uint64_t block_probes () const { return _block_probes; }
+
+    /* Number of bytes covered by needle searches (chunk markers, version detection)
+       during the last load() */
+    uint64_t search_bytes () const { return _search_bytes; }
+
+    /* Needle searches of the parser, all adding the bytes they cover to search_bytes().
+       find_needle() and rfind_needle() return the position of the first or the last
+       needle within buf[from, end), or -1 if there is none. */
+    int64_t find_needle (const unsigned char *buf, uint64_t from, uint64_t end, const unsigned char *needle, uint32_t needlelen);
+    int64_t rfind_needle (const unsigned char *buf, uint64_t from, uint64_t end, const unsigned char *needle, uint32_t needlelen);
+    bool jumpback (uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen);
+    bool jumpto (uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen);
+    int64_t foundat (unsigned char *haystack, uint64_t n, const char *needle);
+
+    /* Statistics of the last load(), also when it failed */
+    const load_stats_t& load_stats () const { return _load_stats; }
+
+    /* Blocks of a content type in file order, either at any nesting level or top level only.
+       Pointers stay valid until the next load(). */
+    const std::vector<const block_t*>& blocks_of_type (uint16_t content_type) const;
+    const std::vector<const block_t*>& toplevel_blocks_of_type (uint16_t content_type) const;
     uint8_t version () const { return _version; }
     int64_t sessionrate () const { return _sessionrate; }
     uint8_t bitdepth () const { return _bitdepth; }
-    const std::string& path () { return _path; }
+    /* Session file of the last load(), empty for sessions loaded from memory */
+    const std::string& path () const { return _path; }
+
+    struct file_stat_t {
+        uint64_t size;
+        int64_t  mtime_ns;
+    };
+
+    /* Size and modification time of the file at path, 0 on success or -1 */
+    static int stat_file (std::string const& path, file_stat_t& st);
+    /* The session file of the last load() as it was when it was opened, before
+       anything was read from it. Zero for sessions loaded from memory. */
+    const file_stat_t& file_stat () const { return _file_stat; }
 
     const std::vector<wav_t>&    audiofiles () const { return _audiofiles ; }
     const std::vector<region_t>& regions () const { return _regions ; }
     const std::vector<region_t>& midiregions () const { return _midiregions ; }
-    const std::vector<region_range_t>& region_ranges(void);
+    const std::vector<region_range_t>& region_ranges(void) const;
+
+    /* Regions of all audio and MIDI tracks sorted by start position, indexed on first
+       use for overlap queries in O(log n + k). Queries append the regions overlapping
+       a position or [start, end) in start position order. Pointers stay valid until
+       the next load(). */
+    const std::vector<placed_region_t>& placed_regions(void) const;
+    void regions_at(uint64_t pos, std::vector<const placed_region_t*>& found) const;
+    void regions_in(uint64_t start, uint64_t end, std::vector<const placed_region_t*>& found) const;
     const std::vector<track_t>&  tracks () const { return _tracks ; }
     const std::vector<track_t>&  miditracks () const { return _miditracks ; }
     const std::vector<key_signature_ev_t>& keysignatures () const { return _keysignatures ; }
     const std::vector<time_signature_ev_t>& timesignatures () const { return _timesignatures; }
     const std::vector<tempo_change_t>& tempochanges () const { return _tempochanges; }
 
-    const key_signature_t main_keysignature();
-    const time_signature_t main_timesignature();
-    const double main_tempo();
-    const uint32_t music_duration_secs(uint8_t max_gap_secs);
+    /* Samples covered by region ranges while a value is in effect */
+    template <class V>
+    struct usage_t {
+        V        value;
+        uint64_t samples;
+    };
+
+    /* The values used for the longest region-covered time, along with the usage of
+       every value in order of first appearance. Ties go to the earliest value. */
+    struct main_values_t {
+        key_signature_t  keysignature;
+        time_signature_t timesignature;
+        double           tempo;
+        std::vector<usage_t<key_signature_t> >  keysignature_usage;
+        std::vector<usage_t<time_signature_t> > timesignature_usage;
+        std::vector<usage_t<double> >           tempo_usage;
+    };
+
+    const main_values_t& main_values(void) const;
+    const key_signature_t main_keysignature() const;
+    const time_signature_t main_timesignature() const;
+    const double main_tempo() const;
+    const uint32_t music_duration_secs(uint8_t max_gap_secs) const;
+    /* music_duration_secs() for each of max_gaps_secs, computed in a single sweep */
+    std::vector<uint32_t> music_durations_secs(const std::vector<uint8_t>& max_gaps_secs) const;
+    /* Gaps between region ranges by length: element i counts the gaps longer than
+       i seconds and at most i + 1 seconds, and the last of at most 256 elements all
+       longer gaps, so the gaps breaking up music at a max_gap_secs of n are those
+       counted from element n on. */
+    std::vector<uint32_t> gap_histogram_secs(void) const;
 
     const unsigned char* unxored_data () const { return _ptfunxored; }
     uint64_t             unxored_size () const { return _len; }
 
-    const unsigned char* metadata_base64 () const { return _session_meta_base64; }
-    uint32_t             metadata_base64_size () const { return _session_meta_base64_size; }
-    const metadata_t&    metadata () const { return _session_meta_parsed; }
+    /* Session metadata is located while loading but only decoded on first access
+       to any of these, so sessions which are never asked for it do not pay for it. */
+    const unsigned char* metadata_base64 () const { decode_metadata(); return _session_meta_base64; }
+    uint32_t             metadata_base64_size () const { decode_metadata(); return _session_meta_base64_size; }
+    const metadata_t&    metadata () const { decode_metadata(); return _session_meta_parsed; }
+
+    /* All metadata fields in pre-order, and the top level ones / those of a struct */
+    const std::vector<metadata_field_t>& metadata_fields () const { decode_metadata(); return _session_meta_fields; }
+    metadata_field_list_t metadata_toplevel_fields () const;
+    metadata_field_list_t metadata_children (const metadata_field_t& f) const { return metadata_field_list_t(&_session_meta_fields, f.first_child); }
+
+    /* First field (in pre-order) named path, with '/' written as is,
+       e.g. "http://purl.org/dc/elements/1.1/:title". NULL if there is none. */
+    const metadata_field_t* metadata_field (std::string const& path) const;
 
 private:
 
@@ -347,15 +809,31 @@ private:
     std::vector<key_signature_ev_t> _keysignatures;
     std::vector<time_signature_ev_t> _timesignatures;
     std::vector<tempo_change_t> _tempochanges;
-    unsigned char* _session_meta_base64;
-    uint32_t _session_meta_base64_size;
-    metadata_t _session_meta_parsed;
-    bool _region_ranges_cached;
-    std::vector<region_range_t> _region_ranges;
+    tempo_map_t _tempo_map;
+    grid_map_t _grid_map;
+    // _session_meta_base64_pos / _len locate the encoded metadata, the rest is filled by decode_metadata()
+    uint32_t _session_meta_base64_pos;
+    uint32_t _session_meta_base64_len;
+    mutable std::atomic<bool> _session_meta_decoded;
+    mutable unsigned char* _session_meta_base64;
+    mutable uint32_t _session_meta_base64_size;
+    mutable metadata_t _session_meta_parsed;
+    mutable std::vector<metadata_field_t> _session_meta_fields;
+    mutable std::unordered_map<std::string_view, uint32_t> _session_meta_index;
+    mutable std::atomic<bool> _region_ranges_cached;
+    mutable std::vector<region_range_t> _region_ranges;
+    mutable std::atomic<bool> _main_values_cached;
+    mutable main_values_t _main_values;
+    mutable std::atomic<bool> _placed_regions_cached;
+    mutable region_index_t _placed_regions;
+    // Serializes computing derived data, the flags above are set once it is complete
+    mutable std::mutex _derived_lock;
 
     std::string _path;
+    file_stat_t _file_stat;
 
     unsigned char* _ptfunxored;
+    bool           _ptfunxored_mapped; // _ptfunxored is a private file mapping
     uint64_t       _len;
     int64_t        _sessionrate;
     uint8_t        _bitdepth;
@@ -364,43 +842,111 @@ private:
     bool           is_bigendian;
 
     std::vector<block_t> _blocks;
+    typedef std::unordered_map<uint16_t, std::vector<const block_t*> > block_index_t;
+    block_index_t _blocks_by_type;
+    block_index_t _toplevel_blocks_by_type;
+    uint64_t _block_probes;
+    mutable std::atomic<bool> _block_hashes_cached;
+    mutable std::vector<uint64_t> _block_hashes; // by block index
+    uint32_t _loaded; // section_t bits parsed so far
+
+    // Position of the first entity with a given index in its vector
+    typedef std::unordered_map<uint16_t, size_t> entity_index_t;
+    entity_index_t _track_index;
+    entity_index_t _region_index;
+    entity_index_t _miditrack_index;
+    entity_index_t _midiregion_index;
+    entity_index_t _wav_index;
+    size_t _first_unnamed_wav;
+    uint64_t _search_bytes;
+    load_stats_t _load_stats;
+
+    uint64_t stage_done(load_stage_t stage, uint64_t since);
+    int finish_load(int ret, load_stats_t *stats);
+    uint64_t heap_bytes(void) const;
+    void midi_chunks(std::vector<const midi_columns_t*>& chunks) const;
+
+    template <class T>
+    static const T* find_entity(const std::vector<T>& v, const entity_index_t& idx, uint16_t index) {
+        entity_index_t::const_iterator found = idx.find(index);
+        return found != idx.end() ? &v[found->second] : NULL;
+    }
+
+    template <class T>
+    static bool find_entity(const std::vector<T>& v, const entity_index_t& idx, uint16_t index, T& out) {
+        const T *found = find_entity(v, idx, index);
+        if (!found)
+            return false;
+        out = *found;
+        return true;
+    }
+
+    template <class T>
+    static void add_entity(std::vector<T>& v, entity_index_t& idx, const T& e) {
+        idx.emplace(e.index, v.size()); // keeps the first one
+        v.push_back(e);
+    }
+
+    template <class T>
+    static void reindex_entities(const std::vector<T>& v, entity_index_t& idx) {
+        idx.clear();
+        for (size_t i = 0; i < v.size(); i++) {
+            idx.emplace(v[i].index, i);
+        }
+    }
+
+    void add_wav(const wav_t& w);
+    void remove_unassigned_tracks(std::vector<track_t>& tracks, entity_index_t& idx);
 
-    bool jumpback(uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen);
-    bool jumpto(uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen);
     bool foundin(std::string const& haystack, std::string const& needle);
-    int64_t foundat(unsigned char *haystack, uint64_t n, const char *needle);
 
     std::string parsestring(uint32_t pos);
-    int parse(void);
+    int parse(uint32_t sections);
     void parseblocks(void);
+    void index_block(const block_t& b);
+    std::vector<const block_t*> toplevel_blocks_of_types(uint16_t content_type1, uint16_t content_type2) const;
     bool parseheader(void);
     bool parserest(void);
     bool parseaudio(void);
     bool parsemidi(void);
     bool parsemetadata(void);
-    bool parsemetadata_base64(block_t& blk);
-    uint32_t parsemetadata_struct(unsigned char* base64_data, uint32_t size, std::string const* outer_field);
-    void fill_metadata_field(std::string const& field, std::string const& value);
+    bool parsemetadata_base64(const block_t& blk);
+    void decode_metadata(void) const;
+    void decode_metadata_base64(void) const;
+    uint32_t parsemetadata_struct(unsigned char* base64_data, uint32_t size, uint32_t parent) const;
+    static std::string metadata_key(std::string const& path);
     bool parsekeysigs(void);
-    bool parsekeysig(block_t& blk);
+    bool parsekeysig(const block_t& blk);
     bool parsetimesigs(void);
-    bool parsetimesigs_block(block_t& blk);
+    bool parsetimesigs_block(const block_t& blk);
     bool parsetempochanges(void);
-    bool parsetempochanges_block(block_t& blk);
+    bool parsetempochanges_block(const block_t& blk);
     void dump(void);
-    bool parse_block_at(uint32_t pos, struct block_t *b, struct block_t *parent, int level);
+    uint32_t next_zmark(uint32_t pos, uint32_t end) const;
+    bool parse_block_header(uint32_t pos, uint32_t max, block_t& b);
+    uint32_t parse_block_at(uint32_t pos, uint32_t parent);
+    void nest_block(const block_t& b, std::vector<nested_block_t>& v) const;
     void dump_block(struct block_t& b, int level);
     bool parse_version();
-    void parse_region_info(uint32_t j, block_t& blk, region_t& r);
+    void parse_region_info(uint32_t j, const block_t& blk, region_t& r);
     void parse_three_point(uint32_t j, int64_t& start, uint64_t& offset, uint64_t& length);
-    uint8_t gen_xor_delta(uint8_t xor_value, uint8_t mul, bool negative);
+    int unxor_mmap(FILE *fp);
+    int unxor_read(FILE *fp);
+    int unxor_buffer(void);
+    int load_unxored(uint32_t sections);
+    void free_unxored(void);
+    static uint8_t gen_xor_delta(uint8_t xor_value, uint8_t mul, bool negative);
     void cleanup(void);
-    void free_block(struct block_t& b);
     void free_all_blocks(void);
     uint64_t ticks_to_samples(uint64_t pos_in_ticks) const;
     uint64_t ticks_to_samples(uint64_t pos_in_ticks, const tempo_change_t& t) const;
-    template <class EV, class EV_VAL> const EV_VAL find_main_event_value(const std::vector<EV> &events, std::function<const uint64_t(const EV&)> ev_pos_in_samples);
-    void add_region_ranges_from_tracks(const std::vector<track_t> &tracks);
+    template <class F> void compute_once(std::atomic<bool>& done, F compute) const;
+    void add_region_ranges_from_tracks(const std::vector<track_t> &tracks) const;
+    region_range_t track_range(const track_t &t) const;
+    void index_placed_regions(void) const;
+    void hash_blocks(void) const;
+    static void diff_block_lists(const PTFFormat& older, uint32_t a, const PTFFormat& newer, uint32_t b,
+                                 std::vector<block_diff_t>& diff);
 };
 
 template<>
@@ -141,19 +141,17 @@ struct Blocks: ParsableCommand {
         let ptfCurrent = try ProToolsFormat(path: projectFile)
         var newVersion: UInt? = 1
         if let (olderVer, olderVerFile) = olderVersionFiles[safe: 0] {
-            var ptfOlder = try ProToolsFormat(path: olderVerFile.path)
-            let initDifferent = ptfOlder.unxoredData() != ptfCurrent.unxoredData()
-            var different = initDifferent
-            if !different, let (_, evenOlderVerFile) = olderVersionFiles[safe: 1] {
-                ptfOlder = try ProToolsFormat(path: evenOlderVerFile.path)
-                different = ptfOlder.unxoredData() != ptfCurrent.unxoredData()
+            let ptfOlder = try ProToolsFormat(path: olderVerFile.path)
+            let initDiff = ProToolsFormat.diffBlocks(from: ptfOlder, to: ptfCurrent)
+            var diff = initDiff
+            if diff.isEmpty, let (_, evenOlderVerFile) = olderVersionFiles[safe: 1] {
+                let ptfEvenOlder = try ProToolsFormat(path: evenOlderVerFile.path)
+                diff = ProToolsFormat.diffBlocks(from: ptfEvenOlder, to: ptfCurrent)
             }
-            if different {
-                for (prevB, currB) in zipBlocksForDiff(prev: ptfOlder.blocks(), curr: ptfCurrent.blocks()) {
-                    printBlock(prevB, level: 0, filterType: Set(blockType), diffWith: currB)
-                }
+            for blockDiff in diff {
+                printDiff(blockDiff, filterType: Set(blockType))
             }
-            newVersion = initDifferent ? olderVer + 1 : nil
+            newVersion = initDiff.isEmpty ? nil : olderVer + 1
         }
 
         if let newVerToSave = newVersion {
@@ -170,45 +168,41 @@ struct Blocks: ParsableCommand {
         }
     }
 
-    func printBlock(_ b: PTBlock, level: Int, filterType: Set<UInt16>, diffWith b2Maybe: PTBlock? = nil) {
-        // only print contents if:
-        // 1) not diffing OR data is different
-        // OR
-        // 2) not filtering OR block type in filtered block types
-        if !b2Maybe.exists({ $0.data == b.data }) && (filterType.isEmpty || filterType.contains(b.contentType)) {
-            printContents(of: b, level: level, diffWith: b2Maybe)
+    func printBlock(_ b: PTBlock, level: Int, filterType: Set<UInt16>) {
+        if filterType.isEmpty || filterType.contains(b.contentType) {
+            printContents(of: b, level: level)
         }
-
-        if let b2 = b2Maybe {
-            for (childB, childB2) in zipBlocksForDiff(prev: b.children, curr: b2.children) {
-                printBlock(childB, level: level + 2, filterType: filterType, diffWith: childB2)
-            }
-        } else {
-            for child in b.children {
-                printBlock(child, level: level + 1, filterType: filterType)
-            }
+        for child in b.children {
+            printBlock(child, level: level + 1, filterType: filterType)
         }
     }
 
-    func printContents(of b: PTBlock, level: Int, diffWith b2Maybe: PTBlock? = nil) {
-        let prefix = String(repeating: "    ", count: level)
-
-        let contentDescB = description(of: b)
-        let groupedB = groupBytesForPrint(of: b)
-
-        if let b2 = b2Maybe {
-            printColored(str: "\(kDiffMinus)\(contentDescB)", colorCode: 31, newLine: true)
-            let contentDescB2 = description(of: b2)
-            printColored(str: "\(kDiffPlus)\(contentDescB2)", colorCode: 32, newLine: true)
+    func printDiff(_ d: PTBlockDiff, filterType: Set<UInt16>) {
+        guard let b = d.newerBlock ?? d.olderBlock else {
+            return
+        }
+        if !filterType.isEmpty && !filterType.contains(b.contentType) {
+            return
+        }
+        let prefix = String(repeating: "    ", count: Int(b.level))
+        let groupedPrev = d.olderBlock.map { groupBytesForPrint(of: $0) } ?? []
+        let groupedCurr = d.newerBlock.map { groupBytesForPrint(of: $0) } ?? []
 
-            let groupedB2 = groupBytesForPrint(of: b2)
-            for i in 0..<max(groupedB.count, groupedB2.count) {
-                printByteGroupForDiff(prev: groupedB[safe: i], curr: groupedB2[safe: i], prefix: prefix)
-            }
-        } else {
-            print(contentDescB)
-            printBytesForNormalMode(from: groupedB, prefix: prefix)
+        if let prev = d.olderBlock {
+            printColored(str: "\(kDiffMinus)\(description(of: prev))", colorCode: 31, newLine: true)
         }
+        if let curr = d.newerBlock {
+            printColored(str: "\(kDiffPlus)\(description(of: curr))", colorCode: 32, newLine: true)
+        }
+        for i in 0..<max(groupedPrev.count, groupedCurr.count) {
+            printByteGroupForDiff(prev: groupedPrev[safe: i], curr: groupedCurr[safe: i], prefix: prefix)
+        }
+    }
+
+    func printContents(of b: PTBlock, level: Int) {
+        let prefix = String(repeating: "    ", count: level)
+        print(description(of: b))
+        printBytesForNormalMode(from: groupBytesForPrint(of: b), prefix: prefix)
     }
 
     func description(of b: PTBlock) -> String {
@@ -317,12 +311,4 @@ struct Blocks: ParsableCommand {
             .flatMap { blockPostProcessors[$0] }
             .flatMap { $0(block.data) } ?? block.data
     }
-
-    func zipBlocksForDiff(prev: [PTBlock], curr: [PTBlock]) -> [(PTBlock, PTBlock)] {
-        // some extremely naive implementation for now
-        zip(prev, curr).filter { (blockPrev, blockCurr) in
-            blockPrev.contentType == blockCurr.contentType
-        }
-    }
 }
-
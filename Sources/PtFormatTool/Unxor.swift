@@ -9,8 +9,6 @@ struct Unxor: ParsableCommand {
     var projectFile: String
 
     mutating func run() throws {
-        let ptf = try ProToolsFormat(path: projectFile)
-        let data: Data = ptf.unxoredData()
-        FileHandle.standardOutput.write(data)
+        try ProToolsFormat.unxorPath(projectFile, toFileDescriptor: FileHandle.standardOutput.fileDescriptor)
     }
 }
@@ -0,0 +1,100 @@
+/*
+ * batchloader_test - results of PTFBatchLoader by input index, for any worker count
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <atomic>
+#include <filesystem>
+#include <algorithm>
+
+#include "ptformat/batchloader.h"
+#include "test.h"
+
+struct expected_t {
+    int error;
+    uint64_t size;
+};
+
+static std::vector<std::string>
+fixture_paths(void) {
+    std::vector<std::string> paths;
+    for (const auto& entry : std::filesystem::directory_iterator(PTF_FIXTURES_DIR)) {
+        paths.push_back(entry.path().string());
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+static void
+test_results_in_input_order(const std::vector<std::string>& paths, const std::vector<expected_t>& expected,
+                            unsigned workers) {
+    PTFBatchLoader loader(workers);
+    std::vector<PTFBatchLoader::result_t> results = loader.load(paths);
+    uint64_t ok = 0;
+
+    CHECK_EQ(results.size(), paths.size());
+    for (size_t i = 0; i < results.size() && i < paths.size(); i++) {
+        CHECK(results[i].path == paths[i]);
+        CHECK_EQ(results[i].error, expected[i].error);
+        CHECK_EQ(!!results[i].session, expected[i].error == 0);
+        if (results[i].session) {
+            CHECK(results[i].session->path() == paths[i]);
+            CHECK_EQ(results[i].session->unxored_size(), expected[i].size);
+            ok++;
+        }
+    }
+    CHECK_EQ(loader.stats().sessions, ok);
+    CHECK_EQ(loader.stats().failed, paths.size() - ok);
+}
+
+static void
+test_completion_once_per_index(const std::vector<std::string>& paths, unsigned workers) {
+    PTFBatchLoader loader(workers);
+    std::vector<std::atomic<int> > calls(paths.size());
+    std::atomic<bool> path_mismatch(false);
+
+    loader.load(paths, [&](size_t index, PTFBatchLoader::result_t& result) {
+        calls[index]++;
+        if (result.path != paths[index]) {
+            path_mismatch = true;
+        }
+    });
+    for (size_t i = 0; i < calls.size(); i++) {
+        CHECK_EQ(calls[i].load(), 1);
+    }
+    CHECK(!path_mismatch);
+}
+
+int
+main(void) {
+    std::vector<std::string> fixtures = fixture_paths();
+    std::vector<std::string> paths;
+
+    // several copies of every fixture with failing paths in between, so workers steal
+    for (int copy = 0; copy < 8; copy++) {
+        paths.insert(paths.end(), fixtures.begin(), fixtures.end());
+        paths.push_back("/nonexistent/session" + std::to_string(copy) + ".ptx");
+    }
+
+    std::vector<expected_t> expected;
+    for (const std::string& path : paths) {
+        PTFFormat ptf;
+        int error = ptf.load(path);
+        expected.push_back({ error, error ? 0 : ptf.unxored_size() });
+    }
+    CHECK(!fixtures.empty());
+    CHECK(expected.back().error != 0);
+
+    for (unsigned workers : { 1u, 2u, 4u, 7u, 16u }) {
+        test_results_in_input_order(paths, expected, workers);
+        test_completion_once_per_index(paths, workers);
+    }
+    test_results_in_input_order(std::vector<std::string>(), std::vector<expected_t>(), 4);
+    return TEST_RESULT;
+}
@@ -0,0 +1,421 @@
+/*
+ * cache_test - sessions written to and read back from PTFCache files
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <filesystem>
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ptformat/ptfcache.h"
+#include "test.h"
+
+namespace fs = std::filesystem;
+
+static std::string
+temp_dir(void) {
+    fs::path dir = fs::temp_directory_path() / ("ptfcache_test_" + std::to_string(getpid()));
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    return dir.string();
+}
+
+/* A copy of the fixture, so it can be touched and changed */
+static std::string
+copy_fixture(const std::string& dir, const char *name) {
+    std::string path = dir + "/" + name;
+    fs::copy_file(fixture(name), path, fs::copy_options::overwrite_existing);
+    return path;
+}
+
+static bool
+write_file(const std::string& path, const std::vector<unsigned char>& data) {
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    return fclose(fp) == 0 && ok;
+}
+
+static void
+set_mtime(const std::string& path, fs::file_time_type t) {
+    fs::last_write_time(path, t);
+}
+
+static void
+check_wav(const PTFCache& cache, const PTFCache::wav_t& c, const PTFFormat::wav_t& w) {
+    CHECK(cache.str(c.filename) == w.filename);
+    CHECK_EQ(c.posabsolute, w.posabsolute);
+    CHECK_EQ(c.length, w.length);
+    CHECK_EQ(c.index, w.index);
+}
+
+static void
+check_region(const PTFCache& cache, const PTFCache::region_t& c, const PTFFormat::region_t& r) {
+    CHECK(cache.str(c.name) == r.name);
+    CHECK_EQ(c.startpos, r.startpos);
+    CHECK_EQ(c.offset, r.offset);
+    CHECK_EQ(c.length, r.length);
+    CHECK_EQ(c.index, r.index);
+    CHECK_EQ(c.is_startpos_in_ticks, r.is_startpos_in_ticks);
+    check_wav(cache, c.wave, r.wave);
+
+    PTFCache::array_t<PTFCache::midi_ev_t> events = cache.midi_events(c);
+    CHECK_EQ(events.size(), r.midi.size());
+    for (size_t i = 0; i < events.size() && i < r.midi.size(); i++) {
+        PTFFormat::midi_ev_t ev = r.midi[i];
+        CHECK_EQ(events[i].pos, ev.pos);
+        CHECK_EQ(events[i].length, ev.length);
+        CHECK_EQ(events[i].note, ev.note);
+        CHECK_EQ(events[i].velocity, ev.velocity);
+    }
+}
+
+static void
+check_track(const PTFCache& cache, const PTFCache::track_t& c, const PTFFormat::track_t& t) {
+    CHECK(cache.str(c.name) == t.name);
+    CHECK_EQ(c.index, t.index);
+    CHECK_EQ(c.playlist, t.playlist);
+    check_region(cache, c.reg, t.reg);
+}
+
+/* Regions sharing events in the session share them in the cache, written once */
+static void
+check_shared_events(const PTFCache& cache, const PTFFormat& ptf) {
+    std::vector<std::pair<const PTFFormat::midi_columns_t*, uint32_t> > firsts;
+    size_t distinct_events = 0;
+
+    for (size_t i = 0; i < ptf.midiregions().size(); i++) {
+        firsts.push_back({ &ptf.midiregions()[i].midi.columns(), cache.midiregions()[i].midi_first });
+    }
+    for (size_t i = 0; i < ptf.miditracks().size(); i++) {
+        firsts.push_back({ &ptf.miditracks()[i].reg.midi.columns(), cache.miditracks()[i].reg.midi_first });
+    }
+    for (size_t i = 0; i < firsts.size(); i++) {
+        bool seen = false;
+        for (size_t j = 0; j < i; j++) {
+            if (firsts[j].first == firsts[i].first) {
+                CHECK_EQ(firsts[j].second, firsts[i].second);
+                seen = true;
+                break;
+            }
+        }
+        if (!seen) {
+            distinct_events += firsts[i].first->size();
+        }
+    }
+    CHECK_EQ(cache.midi_events({ {}, 0, 0, 0, {}, 0, (uint32_t)distinct_events, 0, 0, {} }).size(), distinct_events);
+    CHECK(cache.midi_events({ {}, 0, 0, 0, {}, 0, (uint32_t)distinct_events + 1, 0, 0, {} }).empty());
+}
+
+static void
+check_sections(const PTFCache& cache, const PTFFormat& ptf) {
+    const PTFCache::info_t& info = cache.info();
+    CHECK_EQ(info.sessionrate, ptf.sessionrate());
+    CHECK_EQ(info.version, ptf.version());
+    CHECK_EQ(info.bitdepth, ptf.bitdepth());
+    CHECK_EQ(info.loaded, PTFFormat::PARSE_ALL);
+    CHECK(info.main_tempo == ptf.main_tempo());
+    CHECK_EQ(info.main_key_is_major, ptf.main_keysignature().is_major);
+    CHECK_EQ(info.main_key_is_sharp, ptf.main_keysignature().is_sharp);
+    CHECK_EQ(info.main_key_sign_count, ptf.main_keysignature().sign_count);
+    CHECK_EQ(info.main_time_nominator, ptf.main_timesignature().nominator);
+    CHECK_EQ(info.main_time_denominator, ptf.main_timesignature().denominator);
+
+    CHECK_EQ(cache.audiofiles().size(), ptf.audiofiles().size());
+    for (size_t i = 0; i < cache.audiofiles().size() && i < ptf.audiofiles().size(); i++) {
+        check_wav(cache, cache.audiofiles()[i], ptf.audiofiles()[i]);
+    }
+    CHECK_EQ(cache.regions().size(), ptf.regions().size());
+    for (size_t i = 0; i < cache.regions().size() && i < ptf.regions().size(); i++) {
+        check_region(cache, cache.regions()[i], ptf.regions()[i]);
+    }
+    CHECK_EQ(cache.midiregions().size(), ptf.midiregions().size());
+    for (size_t i = 0; i < cache.midiregions().size() && i < ptf.midiregions().size(); i++) {
+        check_region(cache, cache.midiregions()[i], ptf.midiregions()[i]);
+    }
+    CHECK_EQ(cache.tracks().size(), ptf.tracks().size());
+    for (size_t i = 0; i < cache.tracks().size() && i < ptf.tracks().size(); i++) {
+        check_track(cache, cache.tracks()[i], ptf.tracks()[i]);
+    }
+    CHECK_EQ(cache.miditracks().size(), ptf.miditracks().size());
+    for (size_t i = 0; i < cache.miditracks().size() && i < ptf.miditracks().size(); i++) {
+        check_track(cache, cache.miditracks()[i], ptf.miditracks()[i]);
+    }
+    if (cache.midiregions().size() == ptf.midiregions().size() && cache.miditracks().size() == ptf.miditracks().size()) {
+        check_shared_events(cache, ptf);
+    }
+
+    CHECK_EQ(cache.keysignatures().size(), ptf.keysignatures().size());
+    for (size_t i = 0; i < cache.keysignatures().size() && i < ptf.keysignatures().size(); i++) {
+        CHECK_EQ(cache.keysignatures()[i].pos, ptf.keysignatures()[i].pos);
+        CHECK_EQ(cache.keysignatures()[i].is_major, ptf.keysignatures()[i].is_major);
+        CHECK_EQ(cache.keysignatures()[i].is_sharp, ptf.keysignatures()[i].is_sharp);
+        CHECK_EQ(cache.keysignatures()[i].sign_count, ptf.keysignatures()[i].sign_count);
+    }
+    CHECK_EQ(cache.timesignatures().size(), ptf.timesignatures().size());
+    for (size_t i = 0; i < cache.timesignatures().size() && i < ptf.timesignatures().size(); i++) {
+        CHECK_EQ(cache.timesignatures()[i].pos, ptf.timesignatures()[i].pos);
+        CHECK_EQ(cache.timesignatures()[i].measure_num, ptf.timesignatures()[i].measure_num);
+        CHECK_EQ(cache.timesignatures()[i].nominator, ptf.timesignatures()[i].nominator);
+        CHECK_EQ(cache.timesignatures()[i].denominator, ptf.timesignatures()[i].denominator);
+    }
+    CHECK_EQ(cache.tempochanges().size(), ptf.tempochanges().size());
+    for (size_t i = 0; i < cache.tempochanges().size() && i < ptf.tempochanges().size(); i++) {
+        CHECK_EQ(cache.tempochanges()[i].pos, ptf.tempochanges()[i].pos);
+        CHECK_EQ(cache.tempochanges()[i].pos_in_samples, ptf.tempochanges()[i].pos_in_samples);
+        CHECK(cache.tempochanges()[i].tempo == ptf.tempochanges()[i].tempo);
+        CHECK_EQ(cache.tempochanges()[i].beat_len, ptf.tempochanges()[i].beat_len);
+    }
+    CHECK_EQ(cache.region_ranges().size(), ptf.region_ranges().size());
+    for (size_t i = 0; i < cache.region_ranges().size() && i < ptf.region_ranges().size(); i++) {
+        CHECK_EQ(cache.region_ranges()[i].startpos, ptf.region_ranges()[i].startpos);
+        CHECK_EQ(cache.region_ranges()[i].endpos, ptf.region_ranges()[i].endpos);
+    }
+
+    const PTFFormat::metadata_t& meta = ptf.metadata();
+    CHECK(cache.str(cache.metadata().title) == meta.title);
+    CHECK(cache.str(cache.metadata().artist) == meta.artist);
+    CHECK(cache.str(cache.metadata().location) == meta.location);
+    CHECK_EQ(cache.contributors().size(), meta.contributors.size());
+    for (size_t i = 0; i < cache.contributors().size() && i < meta.contributors.size(); i++) {
+        CHECK(cache.str(cache.contributors()[i]) == meta.contributors[i]);
+    }
+    CHECK_EQ(cache.metadata_fields().size(), ptf.metadata_fields().size());
+    for (size_t i = 0; i < cache.metadata_fields().size() && i < ptf.metadata_fields().size(); i++) {
+        const PTFCache::metadata_field_t& c = cache.metadata_fields()[i];
+        const PTFFormat::metadata_field_t& f = ptf.metadata_fields()[i];
+        CHECK(cache.str(c.name) == f.name);
+        CHECK(cache.str(c.value) == f.value);
+        CHECK_EQ(c.type, f.type);
+        CHECK_EQ(c.parent, f.parent);
+        CHECK_EQ(c.first_child, f.first_child);
+        CHECK_EQ(c.next_sibling, f.next_sibling);
+    }
+    CHECK_EQ(cache.metadata_base64().size(), ptf.metadata_base64() ? ptf.metadata_base64_size() : 0);
+    CHECK(cache.metadata_base64().empty() ||
+          memcmp(cache.metadata_base64().begin(), ptf.metadata_base64(), cache.metadata_base64().size()) == 0);
+}
+
+static void
+test_round_trip(const std::string& dir) {
+    for (const char *name : { "RegionTest.ptx", "MetadataFields.ptx", "TempoTimeKeySig.ptx",
+                              "midi345x.ptf", "goodplaylists2.ptf", "Damien_monos.pts" }) {
+        std::string session = copy_fixture(dir, name);
+        std::string cache_path = session + ".ptfcache";
+        PTFFormat ptf;
+        PTFCache cache;
+        PTFCache::key_t key;
+
+        CHECK_EQ(ptf.load(session), 0);
+        CHECK_EQ(PTFCache::write(ptf, cache_path), 0);
+        CHECK_EQ(cache.open(cache_path, session, true), 0);
+        if (!cache.is_open()) {
+            continue;
+        }
+        CHECK_EQ(PTFCache::session_key(session, key), 0);
+        CHECK_EQ(cache.key().size, key.size);
+        CHECK_EQ(cache.key().mtime_ns, key.mtime_ns);
+        CHECK_EQ(cache.key().hash, key.hash);
+        check_sections(cache, ptf);
+    }
+}
+
+static void
+test_damaged(const std::string& dir) {
+    std::string session = copy_fixture(dir, "RegionTest.ptx");
+    std::string cache_path = session + ".ptfcache";
+    std::string damaged = session + ".damaged";
+    std::vector<unsigned char> good, data;
+    PTFFormat ptf;
+    PTFCache cache;
+
+    CHECK_EQ(ptf.load(session), 0);
+    CHECK_EQ(PTFCache::write(ptf, cache_path), 0);
+    CHECK(read_file(cache_path, good));
+    CHECK(good.size() > 64);
+    CHECK_EQ(cache.open(cache_path, session), 0);
+
+    CHECK_EQ(cache.open(dir + "/nonexistent.ptfcache", session), -1);
+    CHECK(!cache.is_open());
+
+    data = good;
+    data[0] ^= 0xff;  // magic
+    CHECK(write_file(damaged, data));
+    CHECK_EQ(cache.open(damaged, session), -2);
+    CHECK(!cache.is_open());
+
+    data = good;
+    uint32_t version = PTFCache::VERSION + 1;  // follows the 8 byte magic
+    memcpy(&data[8], &version, sizeof(version));
+    CHECK(write_file(damaged, data));
+    CHECK_EQ(cache.open(damaged, session), -2);
+
+    for (size_t len : { good.size() - 1, good.size() / 2, (size_t)16, (size_t)0 }) {
+        data.assign(good.begin(), good.begin() + len);
+        CHECK(write_file(damaged, data));
+        CHECK_EQ(cache.open(damaged, session), -2);
+    }
+
+    data = good;
+    data.push_back(0);
+    CHECK(write_file(damaged, data));
+    CHECK_EQ(cache.open(damaged, session), -2);
+}
+
+/* Cache files whose metadata field tree links point outside of the tree are damaged */
+static void
+test_damaged_metadata_fields(const std::string& dir) {
+    std::string session = copy_fixture(dir, "MetadataFields.ptx");
+    std::string cache_path = session + ".ptfcache";
+    std::string damaged = session + ".damaged";
+    std::vector<unsigned char> good, data;
+    PTFFormat ptf;
+    PTFCache cache;
+
+    CHECK_EQ(cache.key().size, 0);
+    CHECK_EQ(ptf.load(session), 0);
+    CHECK_EQ(PTFCache::write(ptf, cache_path), 0);
+    CHECK(read_file(cache_path, good));
+    CHECK_EQ(cache.open(cache_path, session), 0);
+    CHECK_EQ(cache.key().size, ptf.unxored_size());
+
+    PTFCache::array_t<PTFCache::metadata_field_t> fields = cache.metadata_fields();
+    uint32_t count = fields.size();
+    CHECK(count > 2);
+    if (count <= 2) {
+        return;
+    }
+    // the records are stored as is, so find the second field and its links in the file
+    const unsigned char *rec = (const unsigned char *)&fields[1];
+    std::vector<unsigned char>::iterator found =
+        std::search(good.begin(), good.end(), rec, rec + sizeof(PTFCache::metadata_field_t));
+    CHECK(found != good.end());
+    if (found == good.end()) {
+        return;
+    }
+    size_t at = found - good.begin();
+    cache.close();
+    CHECK_EQ(cache.key().size, 0);
+
+    const size_t links[] = {
+        offsetof(PTFCache::metadata_field_t, parent),
+        offsetof(PTFCache::metadata_field_t, first_child),
+        offsetof(PTFCache::metadata_field_t, next_sibling),
+    };
+    for (size_t link : links) {
+        for (uint32_t bad : { count, count + 1000, (uint32_t)1 }) {
+            data = good;
+            memcpy(&data[at + link], &bad, sizeof(bad));
+            CHECK(write_file(damaged, data));
+            CHECK_EQ(cache.open(damaged, session), -2);
+            CHECK(!cache.is_open());
+        }
+    }
+    CHECK(write_file(damaged, good));
+    CHECK_EQ(cache.open(damaged, session), 0);
+}
+
+static void
+test_stale(const std::string& dir) {
+    std::string session = copy_fixture(dir, "TestPTX.ptx");
+    std::string cache_path = session + ".ptfcache";
+    std::vector<unsigned char> content, changed;
+    PTFFormat ptf;
+    PTFCache cache;
+
+    CHECK(read_file(session, content));
+    CHECK_EQ(ptf.load(session), 0);
+    CHECK_EQ(PTFCache::write(ptf, cache_path), 0);
+    CHECK_EQ(cache.open(cache_path, session, true), 0);
+    fs::file_time_type mtime = fs::last_write_time(session);
+
+    // touched
+    set_mtime(session, mtime + std::chrono::seconds(1));
+    CHECK_EQ(cache.open(cache_path, session), -3);
+    CHECK(!cache.is_open());
+    set_mtime(session, mtime);
+    CHECK_EQ(cache.open(cache_path, session), 0);
+
+    // changed in place, keeping size and modification time: only the hash tells
+    changed = content;
+    changed[changed.size() / 2] ^= 0x01;
+    CHECK(write_file(session, changed));
+    set_mtime(session, mtime);
+    CHECK_EQ(cache.open(cache_path, session), 0);
+    CHECK_EQ(cache.open(cache_path, session, true), -3);
+
+    // grown
+    changed = content;
+    changed.push_back(0);
+    CHECK(write_file(session, changed));
+    set_mtime(session, mtime);
+    CHECK_EQ(cache.open(cache_path, session), -3);
+
+    // gone
+    CHECK(write_file(session, content));
+    set_mtime(session, mtime);
+    CHECK_EQ(cache.open(cache_path, session, true), 0);
+    fs::remove(session);
+    CHECK_EQ(cache.open(cache_path, session), -3);
+}
+
+/* The cache is keyed by the session as it was loaded, not as it is when written */
+static void
+test_key_taken_at_load(const std::string& dir) {
+    std::string session = copy_fixture(dir, "DurationDetectTest.ptx");
+    std::string cache_path = session + ".ptfcache";
+    std::vector<unsigned char> content, changed;
+    PTFCache::key_t loaded_key;
+    PTFFormat ptf;
+    PTFCache cache;
+
+    CHECK(read_file(session, content));
+    CHECK_EQ(PTFCache::session_key(session, loaded_key), 0);
+    // rewriting a session loaded with LOAD_MMAP replaces the loaded data
+    CHECK_EQ(ptf.load(session, PTFFormat::LOAD_READ), 0);
+    CHECK_EQ(ptf.file_stat().size, loaded_key.size);
+    CHECK_EQ(ptf.file_stat().mtime_ns, loaded_key.mtime_ns);
+    fs::file_time_type mtime = fs::last_write_time(session);
+
+    changed = content;
+    changed[changed.size() / 2] ^= 0x01;
+    CHECK(write_file(session, changed));
+    set_mtime(session, mtime + std::chrono::seconds(1));
+
+    CHECK_EQ(PTFCache::write(ptf, cache_path), 0);
+    CHECK_EQ(cache.open(cache_path, session), -3);
+
+    // same size and time as the loaded session, but not its content
+    set_mtime(session, mtime);
+    CHECK_EQ(cache.open(cache_path, session), 0);
+    CHECK_EQ(cache.key().hash, loaded_key.hash);
+    CHECK_EQ(cache.open(cache_path, session, true), -3);
+
+    // sessions from memory are not cached
+    CHECK_EQ(ptf.load_buffer(content.data(), content.size()), 0);
+    CHECK_EQ(ptf.file_stat().size, 0);
+    CHECK_EQ(PTFCache::write(ptf, cache_path), -1);
+}
+
+int
+main(void) {
+    std::string dir = temp_dir();
+
+    test_round_trip(dir);
+    test_damaged(dir);
+    test_damaged_metadata_fields(dir);
+    test_stale(dir);
+    test_key_taken_at_load(dir);
+    fs::remove_all(dir);
+    return TEST_RESULT;
+}
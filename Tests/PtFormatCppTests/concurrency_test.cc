@@ -0,0 +1,130 @@
+/*
+ * concurrency_test - lazily derived data of a snapshot shared between threads
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Built with -fsanitize=thread as concurrency_tsan_test where the compiler
+ * supports it, so data races fail the test along with wrong results.
+ */
+
+#include <atomic>
+#include <thread>
+
+#include "ptformat/ptformat.h"
+#include "test.h"
+
+static const int THREADS = 8;
+
+/* Everything derived on first use, as computed by a session used from one thread */
+struct derived_t {
+    size_t region_ranges;
+    double main_tempo;
+    PTFFormat::time_signature_t main_timesignature;
+    uint32_t music_duration;
+    std::vector<uint32_t> gap_histogram;
+    std::string title;
+    size_t metadata_fields;
+    size_t placed_regions;
+    size_t regions_at_start;
+    std::vector<uint64_t> block_hashes;
+    size_t self_diff;
+
+    bool operator==(const derived_t& o) const {
+        return region_ranges == o.region_ranges && main_tempo == o.main_tempo &&
+            main_timesignature == o.main_timesignature && music_duration == o.music_duration &&
+            gap_histogram == o.gap_histogram && title == o.title && metadata_fields == o.metadata_fields &&
+            placed_regions == o.placed_regions && regions_at_start == o.regions_at_start &&
+            block_hashes == o.block_hashes && self_diff == o.self_diff;
+    }
+};
+
+/* Queries in a different order per thread, so each derived value is raced for */
+static derived_t
+query(const PTFFormat& ptf, int order) {
+    derived_t d;
+    std::vector<const PTFFormat::placed_region_t*> found;
+
+    for (int step = 0; step < 6; step++) {
+        switch ((step + order) % 6) {
+        case 0:
+            d.main_tempo = ptf.main_tempo();
+            d.main_timesignature = ptf.main_timesignature();
+            break;
+        case 1:
+            d.region_ranges = ptf.region_ranges().size();
+            d.music_duration = ptf.music_duration_secs(10);
+            d.gap_histogram = ptf.gap_histogram_secs();
+            break;
+        case 2:
+            d.title = ptf.metadata().title;
+            d.metadata_fields = ptf.metadata_fields().size();
+            ptf.metadata_field("http://purl.org/dc/elements/1.1/:title");
+            break;
+        case 3:
+            d.placed_regions = ptf.placed_regions().size();
+            ptf.regions_at(d.placed_regions ? ptf.placed_regions()[0].startpos : 0, found);
+            d.regions_at_start = found.size();
+            break;
+        case 4:
+            d.block_hashes.clear();
+            for (const PTFFormat::block_t& b : ptf.block_arena()) {
+                d.block_hashes.push_back(ptf.block_hash(b));
+            }
+            break;
+        case 5:
+            d.self_diff = PTFFormat::diff_blocks(ptf, ptf).size();
+            break;
+        }
+    }
+    return d;
+}
+
+static void
+test_shared_snapshot(const char *name) {
+    PTFFormat ref_ptf;
+    CHECK_EQ(ref_ptf.load(fixture(name)), 0);
+    derived_t ref = query(ref_ptf, 0);
+
+    // a fresh snapshot per round, so first uses overlap again
+    for (int round = 0; round < 4; round++) {
+        int err = 0;
+        std::shared_ptr<const PTFFormat> ptf = PTFFormat::load_snapshot(fixture(name), &err);
+        CHECK_EQ(err, 0);
+        if (!ptf) {
+            return;
+        }
+
+        std::atomic<int> ready(0);
+        std::atomic<int> mismatches(0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; t++) {
+            threads.emplace_back([&, t]() {
+                ready++;
+                while (ready.load() < THREADS) {
+                    std::this_thread::yield();
+                }
+                if (!(query(*ptf, t + round) == ref)) {
+                    mismatches++;
+                }
+            });
+        }
+        for (std::thread& t : threads) {
+            t.join();
+        }
+        CHECK_EQ(mismatches.load(), 0);
+    }
+}
+
+int
+main(void) {
+    for (const char *name : { "RegionTest.ptx", "MetadataFields.ptx", "TempoTimeKeySig.ptx",
+                              "big_duration_mess.ptx", "midi345x.ptf" }) {
+        test_shared_snapshot(name);
+    }
+    return TEST_RESULT;
+}
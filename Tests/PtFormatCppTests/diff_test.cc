@@ -0,0 +1,208 @@
+/*
+ * diff_test - structural diffs of block trees
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include "ptformat/ptformat.h"
+#include "test.h"
+
+typedef PTFFormat::block_t block_t;
+typedef PTFFormat::block_diff_t block_diff_t;
+
+static const uint16_t INSERTED_CONTENT_TYPE = 0x7777;
+
+/* Decrypted session data that loads as is (xor type 0x01 with xor value 0) */
+static std::vector<unsigned char>
+plaintext_of(const PTFFormat& ptf) {
+    std::vector<unsigned char> data(ptf.unxored_data(), ptf.unxored_data() + ptf.unxored_size());
+    data[0x12] = 0x01;
+    data[0x13] = 0x00;
+    return data;
+}
+
+static uint32_t
+block_start(const block_t& b) {
+    return b.offset - 7;  // ZMARK, block type and block size come before offset
+}
+
+static uint32_t
+block_end(const block_t& b) {
+    return b.offset + b.block_size;
+}
+
+static bool
+is_leaf(const block_t& b) {
+    return b.first_child == PTFFormat::NO_BLOCK;
+}
+
+static void
+put(std::vector<unsigned char>& data, uint32_t pos, uint32_t v, int n, bool little) {
+    for (int i = 0; i < n; i++) {
+        data[pos + (little ? i : n - 1 - i)] = (v >> (8 * i)) & 0xff;
+    }
+}
+
+/* Byte order of the session, told by the size of its first block */
+static bool
+is_little_endian(const std::vector<unsigned char>& data, const block_t& b) {
+    const unsigned char *size = &data[b.offset - 4];
+    return (size[0] | size[1] << 8 | size[2] << 16 | (uint32_t)size[3] << 24) == b.block_size;
+}
+
+/* Adds delta to the size of b and of every block enclosing it */
+static void
+resize_ancestors(std::vector<unsigned char>& data, const std::vector<block_t>& arena, uint32_t b, int32_t delta,
+                 bool little) {
+    for (; b != PTFFormat::NO_BLOCK; b = arena[b].parent) {
+        put(data, arena[b].offset - 4, arena[b].block_size + delta, 4, little);
+    }
+}
+
+static uint32_t
+find_block(const PTFFormat& ptf, uint32_t offset) {
+    const std::vector<block_t>& arena = ptf.block_arena();
+    for (uint32_t i = 0; i < arena.size(); i++) {
+        if (arena[i].offset == offset)
+            return i;
+    }
+    return PTFFormat::NO_BLOCK;
+}
+
+static bool
+is_ancestor(const std::vector<block_t>& arena, uint32_t a, uint32_t b) {
+    for (b = arena[b].parent; b != PTFFormat::NO_BLOCK; b = arena[b].parent) {
+        if (a == b)
+            return true;
+    }
+    return false;
+}
+
+static void
+test_self_diff(const char *name) {
+    PTFFormat a, b;
+
+    CHECK_EQ(a.load(fixture(name)), 0);
+    CHECK_EQ(b.load(fixture(name)), 0);
+    CHECK(PTFFormat::diff_blocks(a, a).empty());
+    CHECK(PTFFormat::diff_blocks(a, b).empty());
+    CHECK(PTFFormat::diff_blocks(b, a).empty());
+}
+
+/* One leaf block modified, one inserted and one removed, in different parts of the tree */
+static void
+test_variant(const char *name) {
+    PTFFormat older, newer;
+
+    CHECK_EQ(older.load(fixture(name), PTFFormat::LOAD_MMAP, PTFFormat::PARSE_HEADER), 0);
+    const std::vector<block_t>& arena = older.block_arena();
+    uint32_t modified = PTFFormat::NO_BLOCK, inserted_before = PTFFormat::NO_BLOCK, removed = PTFFormat::NO_BLOCK;
+
+    // leaves with unique content among their siblings, so each change pairs up one way only
+    std::vector<uint32_t> leaves;
+    for (uint32_t i = 0; i < arena.size(); i++) {
+        const block_t& b = arena[i];
+        bool unique = true;
+        if (!is_leaf(b) || b.parent == PTFFormat::NO_BLOCK || b.block_size < 8)
+            continue;
+        for (const block_t& s : older.children(arena[b.parent])) {
+            unique = unique && (&s == &b || s.content_type != b.content_type);
+        }
+        if (unique)
+            leaves.push_back(i);
+    }
+    CHECK(leaves.size() >= 3);
+    if (leaves.size() < 3)
+        return;
+    modified = leaves[0];
+    inserted_before = leaves[leaves.size() / 2];
+    removed = leaves.back();
+    CHECK(arena[modified].parent != arena[inserted_before].parent || arena[inserted_before].parent != arena[removed].parent);
+
+    // edits from the end of the session, so earlier offsets stay put
+    std::vector<unsigned char> data = plaintext_of(older);
+    bool little = is_little_endian(data, arena[0]);
+    uint32_t removed_len = block_end(arena[removed]) - block_start(arena[removed]);
+    data.erase(data.begin() + block_start(arena[removed]), data.begin() + block_end(arena[removed]));
+    resize_ancestors(data, arena, arena[removed].parent, -(int32_t)removed_len, little);
+
+    // a leaf block of block type 1 with 4 bytes of content
+    uint32_t insert_at = block_start(arena[inserted_before]);
+    const unsigned char inserted[13] = { 0x5a };
+    data.insert(data.begin() + insert_at, inserted, inserted + sizeof(inserted));
+    put(data, insert_at + 1, 1, 2, little);
+    put(data, insert_at + 3, sizeof(inserted) - 7, 4, little);
+    put(data, insert_at + 7, INSERTED_CONTENT_TYPE, 2, little);
+    put(data, insert_at + 9, 0x01020304, 4, little);
+    resize_ancestors(data, arena, arena[inserted_before].parent, sizeof(inserted), little);
+
+    uint32_t changed_at = block_end(arena[modified]) - 1;
+    data[changed_at] = data[changed_at] == 0x01 ? 0x02 : 0x01;
+
+    CHECK_EQ(newer.load_buffer(data.data(), data.size(), PTFFormat::PARSE_HEADER), 0);
+    CHECK_EQ(newer.block_arena().size(), arena.size());
+
+    // where the blocks of interest are in newer, nothing before them moved
+    uint32_t new_modified = find_block(newer, arena[modified].offset);
+    uint32_t new_inserted = find_block(newer, insert_at + 7);
+    CHECK(new_modified != PTFFormat::NO_BLOCK && new_inserted != PTFFormat::NO_BLOCK);
+    if (new_modified == PTFFormat::NO_BLOCK || new_inserted == PTFFormat::NO_BLOCK)
+        return;
+    CHECK_EQ(newer.block_arena()[new_inserted].content_type, INSERTED_CONTENT_TYPE);
+
+    std::vector<block_diff_t> diff = PTFFormat::diff_blocks(older, newer);
+    int modified_seen = 0, inserted_seen = 0, removed_seen = 0;
+    for (const block_diff_t& d : diff) {
+        if (d.kind == block_diff_t::BLOCK_CHANGED && d.old_block == modified) {
+            CHECK_EQ(d.new_block, new_modified);
+            modified_seen++;
+        } else if (d.kind == block_diff_t::BLOCK_ADDED) {
+            CHECK_EQ(d.old_block, PTFFormat::NO_BLOCK);
+            CHECK_EQ(d.new_block, new_inserted);
+            inserted_seen++;
+        } else if (d.kind == block_diff_t::BLOCK_REMOVED) {
+            CHECK_EQ(d.old_block, removed);
+            CHECK_EQ(d.new_block, PTFFormat::NO_BLOCK);
+            removed_seen++;
+        } else {
+            // the rest are the blocks enclosing the changes
+            CHECK_EQ(d.kind, block_diff_t::BLOCK_CHANGED);
+            CHECK(is_ancestor(arena, d.old_block, modified) || is_ancestor(arena, d.old_block, inserted_before) ||
+                  is_ancestor(arena, d.old_block, removed));
+            CHECK_EQ(arena[d.old_block].content_type, newer.block_arena()[d.new_block].content_type);
+        }
+    }
+    CHECK_EQ(modified_seen, 1);
+    CHECK_EQ(inserted_seen, 1);
+    CHECK_EQ(removed_seen, 1);
+
+    // the other way around, insertions and removals swap
+    int added_back = 0, removed_back = 0;
+    for (const block_diff_t& d : PTFFormat::diff_blocks(newer, older)) {
+        if (d.kind == block_diff_t::BLOCK_ADDED) {
+            CHECK_EQ(d.new_block, removed);
+            added_back++;
+        } else if (d.kind == block_diff_t::BLOCK_REMOVED) {
+            CHECK_EQ(d.old_block, new_inserted);
+            removed_back++;
+        }
+    }
+    CHECK_EQ(added_back, 1);
+    CHECK_EQ(removed_back, 1);
+}
+
+int
+main(void) {
+    for (const char *name : { "RegionTest.ptx", "TestPTX.ptx", "goodplaylists2.ptf", "forArdour.pts" }) {
+        test_self_diff(name);
+        test_variant(name);
+    }
+    return TEST_RESULT;
+}
@@ -0,0 +1,133 @@
+/*
+ * grid_test - bars and beats along time signatures and tempo changes
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include "ptformat/ptformat.h"
+#include "test.h"
+
+#define CHECK_BBT(bbt, b, bt, t) do { \
+    PTFFormat::bbt_t _bbt = (bbt); \
+    CHECK_EQ(_bbt.bar, (b)); \
+    CHECK_EQ(_bbt.beat, (bt)); \
+    CHECK_EQ(_bbt.ticks, (t)); \
+} while (0)
+
+static const uint64_t QUARTER = 960000;
+
+static void
+test_meter_changes(const PTFFormat& ptf) {
+    const PTFFormat::grid_map_t& grid = ptf.grid_map();
+
+    // every change starts its bar at its position
+    CHECK_EQ(ptf.timesignatures().size(), 9);
+    for (const PTFFormat::time_signature_ev_t& ts : ptf.timesignatures()) {
+        CHECK_EQ(grid.bbt_to_ticks({ ts.measure_num, 1, 0 }), ts.pos);
+        CHECK_BBT(grid.ticks_to_bbt(ts.pos), ts.measure_num, 1, 0);
+    }
+
+    // 3/8 -> 5/2 -> 6/16 -> 2/4 in consecutive bars
+    uint64_t bar_3_8 = grid.bbt_to_ticks({ 91180, 1, 0 });
+    CHECK_EQ(bar_3_8, 191832480000ULL);
+    CHECK_EQ(grid.bbt_to_ticks({ 91181, 1, 0 }), bar_3_8 + 3 * QUARTER / 2);
+    CHECK_EQ(grid.bbt_to_ticks({ 91182, 1, 0 }), bar_3_8 + 3 * QUARTER / 2 + 5 * QUARTER * 2);
+    CHECK_EQ(grid.bbt_to_ticks({ 91183, 1, 0 }), bar_3_8 + 3 * QUARTER / 2 + 5 * QUARTER * 2 + 6 * QUARTER / 4);
+    CHECK_BBT(grid.ticks_to_bbt(bar_3_8 + 2 * QUARTER / 2 + 7), 91180, 3, 7);
+    CHECK_BBT(grid.ticks_to_bbt(grid.bbt_to_ticks({ 91181, 5, 0 }) + QUARTER * 2 - 1), 91181, 5, QUARTER * 2 - 1);
+    CHECK_BBT(grid.ticks_to_bbt(grid.bbt_to_ticks({ 91183, 1, 0 }) - 1), 91182, 6, QUARTER / 4 - 1);
+    CHECK_BBT(grid.ticks_to_bbt(grid.bbt_to_ticks({ 91183, 1, 0 }) + 2 * QUARTER), 91184, 1, 0);
+
+    // bar 2 is a 2/4 bar ending at the 3/4 change
+    CHECK_BBT(grid.ticks_to_bbt(5 * QUARTER), 2, 2, 0);
+    CHECK_BBT(grid.ticks_to_bbt(6 * QUARTER), 3, 1, 0);
+}
+
+static void
+test_samples(const PTFFormat& ptf) {
+    // bar lines falling on tempo changes are placed where those changes are
+    CHECK_EQ(ptf.bbt_to_samples({ 1, 1, 0 }), 0);
+    CHECK_EQ(ptf.bbt_to_samples({ 2, 1, 0 }), 182545);
+    CHECK_EQ(ptf.bbt_to_samples({ 3, 1, 0 }), 235465);
+    CHECK_EQ(ptf.bbt_to_samples({ 4, 1, 0 }), 307629);
+    CHECK_EQ(ptf.bbt_to_samples({ 6, 1, 0 }), 485448);
+    CHECK_BBT(ptf.samples_to_bbt(182545), 2, 1, 0);
+    CHECK_EQ(ptf.samples_to_bbt(182544).bar, 1);
+    CHECK_EQ(ptf.samples_to_bbt(182544).beat, 4);
+
+    // bbt -> samples -> bbt settles on the same samples, and on the same bar and beat
+    // where that beat exists (a change can cut the bar before it short)
+    for (const PTFFormat::time_signature_ev_t& ts : ptf.timesignatures()) {
+        for (uint32_t bar = ts.measure_num > 2 ? ts.measure_num - 2 : 1; bar < ts.measure_num + 3; bar++) {
+            for (uint32_t beat = 1; beat <= 3; beat++) {
+                uint64_t samples = ptf.bbt_to_samples({ bar, beat, 0 });
+                PTFFormat::bbt_t bbt = ptf.samples_to_bbt(samples);
+
+                CHECK_EQ(ptf.bbt_to_samples(bbt), samples);
+                if (ptf.grid_map().bbt_to_ticks({ bar, beat, 0 }) >= ptf.grid_map().bbt_to_ticks({ bar + 1, 1, 0 }))
+                    continue;
+                CHECK_EQ(bbt.bar, bar);
+                CHECK_EQ(bbt.beat, beat);
+                if (samples > 0) {
+                    PTFFormat::bbt_t before = ptf.samples_to_bbt(samples - 1);
+                    CHECK(before.bar < bar || (before.bar == bar && before.beat < beat));
+                }
+            }
+        }
+    }
+}
+
+static void
+test_bar_lines(const PTFFormat& ptf) {
+    uint64_t end = ptf.bbt_to_samples({ 91184, 1, 0 });
+    std::vector<uint64_t> lines = ptf.bar_lines_in_samples(end);
+
+    CHECK_EQ(lines.size(), 91183);
+    for (uint32_t bar = 1; bar <= lines.size(); bar += bar < 20 || bar > 91170 ? 1 : 997) {
+        CHECK_EQ(lines[bar - 1], ptf.bbt_to_samples({ bar, 1, 0 }));
+    }
+    for (size_t i = 1; i < lines.size(); i++) {
+        if (lines[i] <= lines[i - 1]) {
+            CHECK(lines[i] > lines[i - 1]);
+            break;
+        }
+    }
+    CHECK_EQ(ptf.bar_lines_in_samples(end + 1).size(), lines.size() + 1);
+    CHECK_EQ(ptf.bar_lines_in_samples(1).size(), 1);
+    CHECK(ptf.bar_lines_in_samples(0).empty());
+}
+
+static void
+test_without_tempo(void) {
+    PTFFormat ptf;
+
+    CHECK_EQ(ptf.load(fixture("TempoTimeKeySig.ptx"), PTFFormat::LOAD_MMAP, PTFFormat::PARSE_TIMESIGS), 0);
+    CHECK(!ptf.grid_map().empty());
+    CHECK(ptf.tempo_map().empty());
+    CHECK_EQ(ptf.bbt_to_samples({ 3, 1, 0 }), 0);
+    CHECK_BBT(ptf.samples_to_bbt(0), 1, 1, 0);
+    CHECK_BBT(ptf.samples_to_bbt(100000), 1, 1, 0);
+    CHECK(ptf.bar_lines_in_samples(100000).empty());
+
+    CHECK_EQ(ptf.load(fixture("TempoTimeKeySig.ptx"), PTFFormat::LOAD_MMAP, PTFFormat::PARSE_TEMPO), 0);
+    CHECK(ptf.grid_map().empty());
+    CHECK_EQ(ptf.bbt_to_samples({ 3, 1, 0 }), 0);
+    CHECK_BBT(ptf.samples_to_bbt(100000), 1, 1, 0);
+}
+
+int
+main(void) {
+    PTFFormat ptf;
+
+    CHECK_EQ(ptf.load(fixture("TempoTimeKeySig.ptx")), 0);
+    test_meter_changes(ptf);
+    test_samples(ptf);
+    test_bar_lines(ptf);
+    test_without_tempo();
+    return TEST_RESULT;
+}
@@ -0,0 +1,305 @@
+/*
+ * load_test - loading sessions from files and from memory
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <set>
+#include <string.h>
+
+#include "ptformat/ptformat.h"
+#include "ptformat/ptfcache.h"
+#include "test.h"
+
+static void
+test_path_cleared_by_memory_loads(void) {
+    std::string a = fixture("RegionTest.ptx");
+    std::vector<unsigned char> b;
+    PTFFormat ptf;
+
+    CHECK(read_file(fixture("TestPTX.ptx"), b));
+
+    CHECK_EQ(ptf.load(a), 0);
+    CHECK(ptf.path() == a);
+
+    // b's data must not be written as a cache of a
+    CHECK_EQ(ptf.load_buffer(b.data(), b.size()), 0);
+    CHECK(ptf.path().empty());
+    CHECK_EQ(PTFCache::write(ptf, "load_test.ptfcache"), -1);
+
+    CHECK_EQ(ptf.load(a), 0);
+    unsigned char *owned = (unsigned char*) malloc(b.size());
+    memcpy(owned, b.data(), b.size());
+    CHECK_EQ(ptf.load_owned(owned, b.size()), 0);
+    CHECK(ptf.path().empty());
+
+    CHECK(ptf.load("/nonexistent/session.ptx") != 0);
+    CHECK(ptf.path() == "/nonexistent/session.ptx");
+}
+
+static size_t
+count_nested(const std::vector<PTFFormat::nested_block_t>& blocks) {
+    size_t n = blocks.size();
+    for (const PTFFormat::nested_block_t& b : blocks) {
+        n += count_nested(b.child);
+    }
+    return n;
+}
+
+static void
+test_blocks_is_the_nested_tree(void) {
+    PTFFormat ptf;
+    size_t toplevel = 0;
+
+    CHECK_EQ(ptf.load(fixture("RegionTest.ptx")), 0);
+    for (const PTFFormat::block_t& b : ptf.toplevel_blocks()) {
+        (void)b;
+        toplevel++;
+    }
+    std::vector<PTFFormat::nested_block_t> blocks = ptf.blocks();
+    CHECK_EQ(blocks.size(), toplevel);
+    CHECK(blocks.size() < ptf.block_arena().size());
+    CHECK_EQ(count_nested(blocks), ptf.block_arena().size());
+}
+
+static void
+test_block_arena_is_exact(void) {
+    size_t checked = 0;
+
+    for (const auto& entry : std::filesystem::directory_iterator(PTF_FIXTURES_DIR)) {
+        PTFFormat ptf;
+
+        if (ptf.load(entry.path().string()) != 0) {
+            continue;
+        }
+        // no spare capacity is retained after the scan
+        CHECK_EQ(ptf.block_arena().capacity(), ptf.block_arena().size());
+        checked++;
+    }
+    CHECK(checked > 0);
+}
+
+static PTFFormat::midi_events_t
+copy_of_events(const PTFFormat::region_t& r) {
+    return r.midi;
+}
+
+static void
+test_midi_iterators_outlive_views(void) {
+    PTFFormat ptf;
+    size_t checked = 0;
+
+    CHECK_EQ(ptf.load(fixture("midi345x.ptf")), 0);
+    for (const PTFFormat::region_t& r : ptf.midiregions()) {
+        // the views these iterators come from are gone before they are used
+        PTFFormat::midi_events_t::const_iterator it = copy_of_events(r).begin();
+        PTFFormat::midi_events_t::const_iterator end = copy_of_events(r).end();
+
+        CHECK_EQ(end - it, r.midi.size());
+        for (size_t i = 0; it != end; ++it, ++i) {
+            PTFFormat::midi_ev_t ev = *it;
+            CHECK_EQ(ev.pos, r.midi[i].pos);
+            CHECK_EQ(ev.length, r.midi[i].length);
+            CHECK_EQ(ev.note, r.midi[i].note);
+            CHECK_EQ(ev.velocity, r.midi[i].velocity);
+            checked++;
+        }
+    }
+    CHECK(checked > 0);
+
+    PTFFormat::midi_events_t none;
+    CHECK(none.begin() == none.end());
+}
+
+static void
+test_malformed_metadata_loads_empty(void) {
+    PTFFormat ptf;
+    const char *header = "sessionMetadataBase64";
+
+    CHECK_EQ(ptf.load(fixture("MetadataFields.ptx")), 0);
+    CHECK(!ptf.metadata().title.empty());
+    std::vector<unsigned char> data(ptf.unxored_data(), ptf.unxored_data() + ptf.unxored_size());
+    // xor type 0x01 with xor value 0 loads the decrypted data as is
+    data[0x12] = 0x01;
+    data[0x13] = 0x00;
+    std::vector<unsigned char>::iterator found =
+        std::search(data.begin(), data.end(), header, header + strlen(header));
+    CHECK(found != data.end());
+    if (found == data.end()) {
+        return;
+    }
+    size_t encoded = (found - data.begin()) + strlen(header) + 4;
+
+    std::vector<unsigned char> bad_struct = data;
+    memcpy(&bad_struct[encoded], "AAAA", 4);
+    CHECK_EQ(ptf.load_buffer(bad_struct.data(), bad_struct.size()), 0);
+    CHECK(ptf.metadata().title.empty());
+    CHECK(ptf.metadata().artist.empty());
+    CHECK(ptf.metadata_fields().empty());
+    CHECK(ptf.metadata_base64_size() > 0);
+
+    std::vector<unsigned char> bad_length = data;
+    bad_length[encoded - 1] = 0x7f;
+    CHECK_EQ(ptf.load_buffer(bad_length.data(), bad_length.size()), -9);
+}
+
+static uint32_t
+arena_depth(const PTFFormat& ptf) {
+    const std::vector<PTFFormat::block_t>& arena = ptf.block_arena();
+    uint32_t max_depth = 0;
+
+    for (const PTFFormat::block_t& b : arena) {
+        uint32_t depth = 1;
+        for (uint32_t p = b.parent; p != PTFFormat::NO_BLOCK; p = arena[p].parent) {
+            depth++;
+        }
+        max_depth = std::max(max_depth, depth);
+    }
+    return max_depth;
+}
+
+static void
+test_load_stats_of_fixtures(void) {
+    size_t with_midi = 0;
+
+    for (const auto& entry : std::filesystem::directory_iterator(PTF_FIXTURES_DIR)) {
+        PTFFormat ptf;
+        PTFFormat::load_stats_t stats;
+        std::set<const PTFFormat::midi_columns_t*> chunks;
+        uint64_t events = 0;
+
+        if (ptf.load(entry.path().string(), PTFFormat::LOAD_MMAP, PTFFormat::PARSE_ALL, &stats) != 0) {
+            continue;
+        }
+        CHECK_EQ(stats.bytes, ptf.unxored_size());
+        CHECK_EQ(stats.blocks, ptf.block_arena().size());
+        CHECK_EQ(stats.max_depth, arena_depth(ptf));
+        CHECK_EQ(stats.block_probes, ptf.block_probes());
+        CHECK_EQ(stats.search_bytes, ptf.search_bytes());
+        CHECK_EQ(stats.wavs, ptf.audiofiles().size());
+        CHECK_EQ(stats.regions, ptf.regions().size() + ptf.midiregions().size());
+        CHECK_EQ(stats.tracks, ptf.tracks().size() + ptf.miditracks().size());
+        CHECK(stats.heap_bytes > 0);
+        for (int s = 0; s < PTFFormat::STAGE_COUNT; s++) {
+            CHECK(stats.stage_ns[s] > 0);
+        }
+
+        // events of distinct chunks, however many regions and tracks share them
+        for (const PTFFormat::region_t& r : ptf.midiregions()) {
+            chunks.insert(&r.midi.columns());
+        }
+        for (const PTFFormat::track_t& t : ptf.miditracks()) {
+            chunks.insert(&t.reg.midi.columns());
+        }
+        for (const PTFFormat::midi_columns_t *c : chunks) {
+            events += c->size();
+        }
+        CHECK_EQ(stats.midi_events, events);
+        with_midi += events > 0;
+    }
+    CHECK(with_midi > 0);
+}
+
+static void
+test_load_stats_of_skipped_sections(void) {
+    PTFFormat ptf;
+    PTFFormat::load_stats_t stats;
+    const uint32_t sections = PTFFormat::PARSE_HEADER | PTFFormat::PARSE_METADATA;
+
+    // a full load first, so stale stage times would show
+    CHECK_EQ(ptf.load(fixture("midi345x.ptf")), 0);
+    CHECK_EQ(ptf.load(fixture("midi345x.ptf"), PTFFormat::LOAD_MMAP, sections, &stats), 0);
+    CHECK(stats.stage_ns[PTFFormat::STAGE_UNXOR] > 0);
+    CHECK(stats.stage_ns[PTFFormat::STAGE_BLOCKS] > 0);
+    CHECK(stats.stage_ns[PTFFormat::STAGE_HEADER] > 0);
+    CHECK(stats.stage_ns[PTFFormat::STAGE_METADATA] > 0);
+    CHECK_EQ(stats.stage_ns[PTFFormat::STAGE_AUDIO], 0);
+    CHECK_EQ(stats.stage_ns[PTFFormat::STAGE_REST], 0);
+    CHECK_EQ(stats.stage_ns[PTFFormat::STAGE_MIDI], 0);
+    CHECK_EQ(stats.stage_ns[PTFFormat::STAGE_KEYSIGS], 0);
+    CHECK_EQ(stats.stage_ns[PTFFormat::STAGE_TIMESIGS], 0);
+    CHECK_EQ(stats.stage_ns[PTFFormat::STAGE_TEMPO], 0);
+    CHECK_EQ(stats.wavs, 0);
+    CHECK_EQ(stats.regions, 0);
+    CHECK_EQ(stats.tracks, 0);
+    CHECK_EQ(stats.midi_events, 0);
+    CHECK_EQ(stats.blocks, ptf.block_arena().size());
+}
+
+static void
+test_main_values_of_skipped_sections(void) {
+    PTFFormat ptf;
+
+    CHECK_EQ(ptf.load(fixture("TempoTimeKeySig.ptx"), PTFFormat::LOAD_MMAP, PTFFormat::PARSE_REGIONS), 0);
+    CHECK_EQ(ptf.main_tempo(), 0);
+    CHECK_EQ(ptf.main_timesignature().nominator, 0);
+    CHECK_EQ(ptf.main_timesignature().denominator, 0);
+    CHECK_EQ(ptf.main_keysignature().is_major, false);
+    CHECK_EQ(ptf.main_keysignature().is_sharp, false);
+    CHECK_EQ(ptf.main_keysignature().sign_count, 0);
+
+    CHECK_EQ(ptf.load(fixture("TempoTimeKeySig.ptx")), 0);
+    CHECK(ptf.main_tempo() > 0);
+    CHECK(ptf.main_timesignature().nominator > 0);
+    CHECK(ptf.main_timesignature().denominator > 0);
+}
+
+static void
+test_load_stats_of_failed_loads(void) {
+    PTFFormat ptf;
+    PTFFormat::load_stats_t stats;
+
+    memset(&stats, 0xff, sizeof(stats));
+    CHECK(ptf.load("/nonexistent/session.ptx", PTFFormat::LOAD_MMAP, PTFFormat::PARSE_ALL, &stats) != 0);
+    CHECK_EQ(stats.bytes, 0);
+    CHECK_EQ(stats.blocks, 0);
+    CHECK_EQ(stats.wavs, 0);
+    for (int s = 0; s < PTFFormat::STAGE_COUNT; s++) {
+        CHECK_EQ(stats.stage_ns[s], 0);
+    }
+
+    // a sample rate out of range fails the load once the block tree is built
+    CHECK_EQ(ptf.load(fixture("RegionTest.ptx")), 0);
+    std::vector<unsigned char> data(ptf.unxored_data(), ptf.unxored_data() + ptf.unxored_size());
+    CHECK(!ptf.blocks_of_type(0x1028).empty());
+    if (ptf.blocks_of_type(0x1028).empty()) {
+        return;
+    }
+    memset(&data[ptf.blocks_of_type(0x1028)[0]->offset + 4], 0, 4);
+    // xor type 0x01 with xor value 0 loads the decrypted data as is
+    data[0x12] = 0x01;
+    data[0x13] = 0x00;
+
+    memset(&stats, 0xff, sizeof(stats));
+    CHECK(ptf.load_buffer(data.data(), data.size(), PTFFormat::PARSE_ALL, &stats) != 0);
+    CHECK_EQ(stats.bytes, data.size());
+    CHECK(stats.blocks > 0);
+    CHECK_EQ(stats.blocks, ptf.block_arena().size());
+    CHECK_EQ(stats.max_depth, arena_depth(ptf));
+    CHECK(stats.stage_ns[PTFFormat::STAGE_BLOCKS] > 0);
+    CHECK_EQ(stats.stage_ns[PTFFormat::STAGE_HEADER], 0);
+    CHECK_EQ(stats.stage_ns[PTFFormat::STAGE_AUDIO], 0);
+    CHECK_EQ(stats.wavs, 0);
+    CHECK_EQ(stats.regions, 0);
+}
+
+int
+main(void) {
+    test_path_cleared_by_memory_loads();
+    test_blocks_is_the_nested_tree();
+    test_block_arena_is_exact();
+    test_midi_iterators_outlive_views();
+    test_malformed_metadata_loads_empty();
+    test_load_stats_of_fixtures();
+    test_load_stats_of_skipped_sections();
+    test_load_stats_of_failed_loads();
+    test_main_values_of_skipped_sections();
+    return TEST_RESULT;
+}
@@ -0,0 +1,128 @@
+/*
+ * region_index_test - overlap queries of the placed region index against brute force
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <random>
+
+#include "ptformat/ptformat.h"
+#include "test.h"
+
+typedef std::vector<const PTFFormat::placed_region_t*> found_t;
+
+static found_t
+brute_force(const std::vector<PTFFormat::placed_region_t>& regions, uint64_t start, uint64_t end) {
+    found_t found;
+    for (const PTFFormat::placed_region_t& r : regions) {
+        if (r.startpos < end && start < r.endpos)
+            found.push_back(&r);
+    }
+    return found;
+}
+
+static bool
+check_query(const PTFFormat::region_index_t& index, uint64_t start, uint64_t end) {
+    found_t found;
+    index.regions_in(start, end, found);
+    return found == brute_force(index.regions(), start, end);
+}
+
+/* Regions of a few tracks: short ones, some overlapping, with occasional long ones
+   that have to be found through the subtree max end of nodes far to their left */
+static std::vector<PTFFormat::placed_region_t>
+synthetic_regions(size_t n, std::mt19937_64& rng) {
+    std::vector<PTFFormat::placed_region_t> regions;
+    std::uniform_int_distribution<uint64_t> gap(0, 2000);
+    std::uniform_int_distribution<uint64_t> len(1, 3000);
+    std::uniform_int_distribution<int> kind(0, 49);
+    uint64_t pos = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        int k = kind(rng);
+        uint64_t start = k < 5 ? pos - std::min(pos, len(rng)) : pos;
+        uint64_t length = k == 0 ? len(rng) * n : (k == 1 ? 0 : len(rng));
+        regions.push_back({ start, start + length, NULL, k == 2 });
+        pos += gap(rng);
+    }
+    std::shuffle(regions.begin(), regions.end(), rng);
+    return regions;
+}
+
+static void
+test_synthetic(void) {
+    std::mt19937_64 rng(42);
+
+    // sizes reaching the tree descent (over 15 regions), around powers of two
+    for (size_t n : { 0, 1, 2, 15, 16, 17, 31, 32, 33, 100, 1000, 4095, 4096, 4097 }) {
+        PTFFormat::region_index_t index(synthetic_regions(n, rng));
+        const std::vector<PTFFormat::placed_region_t>& regions = index.regions();
+        uint64_t max_end = 0;
+        int failed = 0;
+
+        CHECK_EQ(regions.size(), n);
+        CHECK_EQ(index.empty(), n == 0);
+        for (size_t i = 1; i < regions.size(); i++) {
+            CHECK(regions[i - 1].startpos <= regions[i].startpos);
+        }
+        for (const PTFFormat::placed_region_t& r : regions) {
+            max_end = std::max(max_end, r.endpos);
+        }
+
+        std::uniform_int_distribution<uint64_t> any(0, max_end + 10);
+        std::uniform_int_distribution<uint64_t> span(1, 20000);
+        for (int q = 0; q < 2000; q++) {
+            uint64_t start = any(rng);
+            failed += !check_query(index, start, start + 1);
+            failed += !check_query(index, start, start + span(rng));
+        }
+        for (const PTFFormat::placed_region_t& r : regions) {
+            failed += !check_query(index, r.startpos, r.startpos + 1);
+            failed += !check_query(index, r.endpos, r.endpos + 1);
+            if (r.startpos > 0)
+                failed += !check_query(index, r.startpos - 1, r.startpos);
+        }
+        failed += !check_query(index, 0, UINT64_MAX);
+        CHECK_EQ(failed, 0);
+
+        found_t found;
+        index.regions_in(10, 10, found);
+        index.regions_in(11, 10, found);
+        CHECK(found.empty());
+    }
+}
+
+static void
+test_sessions(void) {
+    for (const char *name : { "RegionTest.ptx", "DurationDetectTest.ptx", "big_duration_mess.ptx" }) {
+        PTFFormat ptf;
+        int failed = 0;
+
+        CHECK_EQ(ptf.load(fixture(name)), 0);
+        const std::vector<PTFFormat::placed_region_t>& regions = ptf.placed_regions();
+        CHECK(!regions.empty());
+        for (const PTFFormat::placed_region_t& r : regions) {
+            for (uint64_t pos : { r.startpos, r.endpos - 1, r.endpos }) {
+                found_t found;
+                ptf.regions_at(pos, found);
+                failed += found != brute_force(regions, pos, pos + 1);
+            }
+            found_t found;
+            ptf.regions_in(r.startpos, r.endpos, found);
+            failed += found != brute_force(regions, r.startpos, r.endpos);
+        }
+        CHECK_EQ(failed, 0);
+    }
+}
+
+int
+main(void) {
+    test_synthetic();
+    test_sessions();
+    return TEST_RESULT;
+}
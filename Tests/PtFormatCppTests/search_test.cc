@@ -0,0 +1,142 @@
+/*
+ * search_test - needle searches of the parser against a naive search
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <random>
+#include <string.h>
+
+#include "ptformat/ptformat.h"
+#include "test.h"
+
+static bool
+match_at(const std::vector<unsigned char>& buf, uint64_t k, const std::vector<unsigned char>& needle) {
+    return k + needle.size() <= buf.size() && memcmp(&buf[k], needle.data(), needle.size()) == 0;
+}
+
+static int64_t
+naive_find(const std::vector<unsigned char>& buf, uint64_t from, uint64_t end, const std::vector<unsigned char>& needle) {
+    for (uint64_t k = from; !needle.empty() && k + needle.size() <= end; k++) {
+        if (match_at(buf, k, needle)) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+static int64_t
+naive_rfind(const std::vector<unsigned char>& buf, uint64_t from, uint64_t end, const std::vector<unsigned char>& needle) {
+    int64_t found = -1;
+    for (uint64_t k = from; !needle.empty() && k + needle.size() <= end; k++) {
+        if (match_at(buf, k, needle)) {
+            found = k;
+        }
+    }
+    return found;
+}
+
+/* Checks one search range, from + needlelen may be past end */
+static void
+check_range(PTFFormat& ptf, std::vector<unsigned char>& buf, uint64_t from, uint64_t end,
+            const std::vector<unsigned char>& needle) {
+    int64_t expected = naive_find(buf, from, end, needle);
+    int64_t rexpected = naive_rfind(buf, from, end, needle);
+    uint64_t before = ptf.search_bytes();
+
+    CHECK_EQ(ptf.find_needle(buf.data(), from, end, needle.data(), needle.size()), expected);
+    CHECK(ptf.search_bytes() - before <= (end > from ? end - from : 0));
+    CHECK_EQ(ptf.rfind_needle(buf.data(), from, end, needle.data(), needle.size()), rexpected);
+
+    // jumpto finds needles ending before maxoffset - 1
+    if (end < UINT32_MAX && from < end) {
+        uint32_t pos = from;
+        bool found = ptf.jumpto(&pos, buf.data(), end + 1, needle.data(), needle.size());
+        CHECK_EQ(found, expected >= 0);
+        CHECK_EQ(pos, found ? (uint64_t)expected : from);
+    }
+
+    // jumpback finds the closest needle at or before pos, never at 0
+    uint32_t pos = from;
+    int64_t back = pos + needle.size() < buf.size() ? naive_rfind(buf, 1, pos + needle.size(), needle) : -1;
+    bool found = ptf.jumpback(&pos, buf.data(), buf.size(), needle.data(), needle.size());
+    CHECK_EQ(found, back >= 0);
+    CHECK_EQ(pos, found ? (uint64_t)back : from);
+}
+
+static void
+test_random_buffers(void) {
+    std::mt19937 rng(12345);
+    PTFFormat ptf;
+
+    for (int round = 0; round < 2000; round++) {
+        // a small alphabet gives plenty of partial and overlapping matches
+        int alphabet = 2 + rng() % 3;
+        std::vector<unsigned char> buf(1 + rng() % 200);
+        for (unsigned char& c : buf) {
+            c = 'a' + rng() % alphabet;
+        }
+
+        // lengths on both sides of the Horspool threshold of 8
+        std::vector<unsigned char> needle(1 + rng() % 16);
+        if (rng() % 4 && needle.size() <= buf.size()) {
+            uint64_t at = rng() % (buf.size() - needle.size() + 1);
+            needle.assign(buf.begin() + at, buf.begin() + at + needle.size());
+        } else {
+            for (unsigned char& c : needle) {
+                c = 'a' + rng() % alphabet;
+            }
+        }
+
+        uint64_t from = rng() % (buf.size() + 1);
+        uint64_t end = from + rng() % (buf.size() - from + 1);
+        check_range(ptf, buf, from, end, needle);
+        check_range(ptf, buf, 0, buf.size(), needle);
+
+        // ranges ending exactly at the end of a match, and one byte short of it
+        int64_t first = naive_find(buf, 0, buf.size(), needle);
+        if (first >= 0) {
+            check_range(ptf, buf, 0, first + needle.size(), needle);
+            check_range(ptf, buf, 0, first + needle.size() - 1, needle);
+            check_range(ptf, buf, first, first + needle.size(), needle);
+            check_range(ptf, buf, first + 1, first + needle.size(), needle);
+        }
+    }
+}
+
+static void
+test_edge_cases(void) {
+    PTFFormat ptf;
+    std::vector<unsigned char> buf = { 'x', 'a', 'b', 'c', 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'a', 'b' };
+    std::vector<unsigned char> none;
+    std::vector<unsigned char> whole(buf.begin(), buf.end());
+    std::vector<unsigned char> longer(buf.size() + 1, 'a');
+    std::vector<unsigned char> horspool = { 'c', 'd', 'e', 'f', 'g', 'h', 'a', 'b' };
+
+    CHECK_EQ(ptf.find_needle(buf.data(), 0, buf.size(), none.data(), 0), -1);
+    CHECK_EQ(ptf.rfind_needle(buf.data(), 0, buf.size(), none.data(), 0), -1);
+    CHECK_EQ(ptf.find_needle(buf.data(), 0, buf.size(), whole.data(), whole.size()), 0);
+    CHECK_EQ(ptf.rfind_needle(buf.data(), 0, buf.size(), whole.data(), whole.size()), 0);
+    CHECK_EQ(ptf.find_needle(buf.data(), 0, buf.size(), longer.data(), longer.size()), -1);
+    CHECK_EQ(ptf.find_needle(buf.data(), 5, 4, whole.data(), 1), -1);
+    CHECK_EQ(ptf.rfind_needle(buf.data(), 5, 4, whole.data(), 1), -1);
+    CHECK_EQ(ptf.find_needle(buf.data(), 0, buf.size(), horspool.data(), horspool.size()), 6);
+    CHECK_EQ(ptf.find_needle(buf.data(), 0, buf.size() - 1, horspool.data(), horspool.size()), -1);
+    CHECK_EQ(ptf.rfind_needle(buf.data(), 6, buf.size(), horspool.data(), horspool.size()), 6);
+    CHECK_EQ(ptf.rfind_needle(buf.data(), 7, buf.size(), horspool.data(), horspool.size()), -1);
+    check_range(ptf, buf, 0, buf.size(), horspool);
+    check_range(ptf, buf, 0, buf.size(), whole);
+    check_range(ptf, buf, 3, 3, horspool);
+}
+
+int
+main(void) {
+    test_random_buffers();
+    test_edge_cases();
+    return TEST_RESULT;
+}
@@ -0,0 +1,63 @@
+/*
+ * Minimal checks for the C++ tests run by ctest (see Benchmarks/CMakeLists.txt)
+ *
+ * Copyright (C) 2021-      Tadas Dailyda
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+#ifndef PTF_TEST_H
+#define PTF_TEST_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#ifndef PTF_FIXTURES_DIR
+# define PTF_FIXTURES_DIR "../Tests/PtFormatObjCTests/Resources"
+#endif
+
+static int test_failures = 0;
+
+/* Reports a failed check and goes on, main() returns TEST_RESULT */
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+    if (!((a) == (b))) { \
+        fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, \
+                #a, #b, (long long)(a), (long long)(b)); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define TEST_RESULT (test_failures ? 1 : 0)
+
+static inline std::string
+fixture(const char *name) {
+    return std::string(PTF_FIXTURES_DIR) + "/" + name;
+}
+
+static inline bool
+read_file(const std::string& path, std::vector<unsigned char>& data) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    unsigned char buf[65536];
+    size_t n;
+    data.clear();
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(fp);
+    return true;
+}
+
+#endif
@@ -47,6 +47,87 @@
     NSArray<NSString *> *expectContributors = @[ @"Prince", @"Foo", @"Buz" ];
     XCTAssertEqualObjects([meta contributors], expectContributors);
     XCTAssertEqualObjects([meta location], @"Paisley Park");
+    XCTAssertEqualObjects([ptFormat metadataValueForPath:@"http://www.id3.org/id3v2.3.0#:TPE1"], @"AFKAAFKAP");
+    XCTAssertNil([ptFormat metadataValueForPath:@"http://purl.org/dc/elements/1.1/:contributor"]);
+    XCTAssertNil([ptFormat metadataValueForPath:@"http://purl.org/dc/elements/1.1/:nonexistent"]);
+}
+
+- (void)testCorruptedMetadataLoadsEmpty {
+    ProToolsFormat *ptFormat = [self loadAndCheck:@"MetadataFields" ofType:@"ptx"];
+    NSMutableData *data = [[ptFormat unxoredData] mutableCopy];
+    // xor type 0x01 with xor value 0 loads the decrypted data as is
+    uint8_t *bytes = [data mutableBytes];
+    bytes[0x12] = 0x01;
+    bytes[0x13] = 0x00;
+    NSData *header = [@"sessionMetadataBase64" dataUsingEncoding:NSASCIIStringEncoding];
+    NSRange found = [data rangeOfData:header options:0 range:NSMakeRange(0, [data length])];
+    XCTAssertNotEqual(found.location, NSNotFound);
+    NSUInteger encoded = found.location + found.length + 4;
+
+    // a malformed struct in well framed metadata is not a load error
+    NSMutableData *badStruct = [data mutableCopy];
+    [badStruct replaceBytesInRange:NSMakeRange(encoded, 4) withBytes:"AAAA"];
+    NSError *error = nil;
+    ProToolsFormat *loaded = [ProToolsFormat newWithData:badStruct error:&error];
+    XCTAssertNotNil(loaded);
+    XCTAssertNil(error);
+    PTMetadata *meta = [loaded metadata];
+    XCTAssertNil([meta title]);
+    XCTAssertNil([meta artist]);
+    XCTAssertEqual([[meta contributors] count], 0);
+    XCTAssertNil([meta location]);
+    XCTAssertNil([loaded metadataValueForPath:@"http://www.id3.org/id3v2.3.0#:TPE1"]);
+    XCTAssertNotNil([loaded metadataBase64]);
+    XCTAssertEqual([loaded sessionRate], [ptFormat sessionRate]);
+
+    // an encoded length past the end of the session still fails the load
+    NSMutableData *badLength = [data mutableCopy];
+    ((uint8_t *)[badLength mutableBytes])[encoded - 1] = 0x7f;
+    error = nil;
+    XCTAssertNil([ProToolsFormat newWithData:badLength error:&error]);
+    XCTAssertEqual([error code], 9);
+}
+
+- (void)testDiffBlocks {
+    ProToolsFormat *ptFormat1 = [self loadAndCheck:@"RegionTest" ofType:@"ptx"];
+    ProToolsFormat *ptFormat2 = [self loadAndCheck:@"RegionTest" ofType:@"ptx"];
+    XCTAssertEqual([[ProToolsFormat diffBlocksFrom:ptFormat1 to:ptFormat1] count], 0);
+    XCTAssertEqual([[ProToolsFormat diffBlocksFrom:ptFormat1 to:ptFormat2] count], 0);
+
+    PTBlock *leaf = nil;
+    for (PTBlock *b in [ptFormat1 blocksOfContentType:0x1001]) {
+        if ([[b children] count] == 0) {
+            leaf = b;
+            break;
+        }
+    }
+    XCTAssertNotNil(leaf);
+    NSData *unxored = [ptFormat1 unxoredData];
+    XCTAssertEqualObjects([leaf data], [unxored subdataWithRange:NSMakeRange([leaf offset], [[leaf data] length])]);
+
+    // flip the last byte of the leaf, the same blocks change in both directions
+    NSMutableData *data = [unxored mutableCopy];
+    uint8_t *bytes = [data mutableBytes];
+    bytes[0x12] = 0x01;
+    bytes[0x13] = 0x00;
+    bytes[[leaf offset] + [[leaf data] length] - 1] ^= 0xff;
+    NSError *error = nil;
+    ProToolsFormat *modified = [ProToolsFormat newWithData:data error:&error];
+    XCTAssertNotNil(modified);
+    XCTAssertNil(error);
+
+    NSArray<PTBlockDiff *> *diff = [ProToolsFormat diffBlocksFrom:ptFormat1 to:modified];
+    XCTAssertEqual([diff count], [leaf level] + 1);
+    for (PTBlockDiff *d in diff) {
+        XCTAssertEqual([d kind], PTBlockDiffChanged);
+        XCTAssertEqual([[d olderBlock] offset], [[d newerBlock] offset]);
+        XCTAssertEqual([[d olderBlock] contentType], [[d newerBlock] contentType]);
+        XCTAssertNotEqual([[d olderBlock] contentHash], [[d newerBlock] contentHash]);
+    }
+    PTBlockDiff *last = [diff lastObject];
+    XCTAssertEqual([[last olderBlock] offset], [leaf offset]);
+    XCTAssertEqual([[last olderBlock] level], [leaf level]);
+    XCTAssertEqual([[ProToolsFormat diffBlocksFrom:modified to:ptFormat1] count], [diff count]);
 }
 
 - (void)metadataCheckFor:(NSString*)path ofType:(NSString*)type ver:(uint8_t)ver sr:(int64_t)sr bits:(uint8_t)bits {
@@ -90,6 +171,66 @@
     XCTAssertEqualObjects([ptFormat1 unxoredData], [ptFormat2 unxoredData]);
 }
 
+- (void)testLoadFromData {
+    NSBundle *resourceBundle = SWIFTPM_MODULE_BUNDLE;
+    NSString *resourcePath = [resourceBundle pathForResource:@"RegionTest" ofType:@"ptx" inDirectory:@"Resources"];
+    NSError *error = nil;
+    ProToolsFormat *ptFormatData = [ProToolsFormat newWithData:[NSData dataWithContentsOfFile:resourcePath] error:&error];
+    XCTAssertNotNil(ptFormatData);
+    XCTAssertNil(error);
+
+    ProToolsFormat *ptFormatPath = [self loadAndCheck:@"RegionTest" ofType:@"ptx"];
+    XCTAssertEqualObjects([ptFormatData unxoredData], [ptFormatPath unxoredData]);
+    XCTAssertEqualObjects([ptFormatData tracks], [ptFormatPath tracks]);
+    XCTAssertEqualObjects([ptFormatData regionRanges], [ptFormatPath regionRanges]);
+}
+
+- (void)testLoadSections {
+    NSBundle *resourceBundle = SWIFTPM_MODULE_BUNDLE;
+    NSString *resourcePath = [resourceBundle pathForResource:@"TempoTimeKeySig" ofType:@"ptx" inDirectory:@"Resources"];
+    NSError *error = nil;
+    ProToolsFormat *ptFormat = [ProToolsFormat newWithPath:resourcePath sections:PTSectionMetadata | PTSectionTempo error:&error];
+    XCTAssertNotNil(ptFormat);
+    XCTAssertNil(error);
+    XCTAssertTrue([ptFormat isLoaded:PTSectionHeader | PTSectionMetadata | PTSectionTempo]);
+    XCTAssertFalse([ptFormat isLoaded:PTSectionMidi]);
+    XCTAssertFalse([ptFormat isLoaded:PTSectionAll]);
+    XCTAssertEqual([[ptFormat tracks] count], 0);
+    // main values of sections not loaded are zero, not defaults
+    XCTAssertEqualObjects([ptFormat mainTimeSignature], [PTTimeSignature timeSigWithNom:0 denom:0]);
+    XCTAssertEqualObjects([ptFormat mainKeySignature], [PTKeySignature keySigIsMajor:NO isSharp:NO signs:0]);
+
+    ProToolsFormat *ptFormatAll = [self loadAndCheck:@"TempoTimeKeySig" ofType:@"ptx"];
+    XCTAssertTrue([ptFormatAll isLoaded:PTSectionAll]);
+    XCTAssertEqual([ptFormat sessionRate], [ptFormatAll sessionRate]);
+    XCTAssertEqual([[ptFormat tempoChanges] count], [[ptFormatAll tempoChanges] count]);
+}
+
+- (void)testErrorOnInvalidData {
+    NSError *error = nil;
+    ProToolsFormat *ptFormat = [ProToolsFormat newWithData:[NSData data] error:&error];
+    XCTAssertNil(ptFormat);
+    XCTAssertNotNil(error);
+    XCTAssertEqual([error code], 1);
+}
+
+- (void)testUnxorStream {
+    NSBundle *resourceBundle = SWIFTPM_MODULE_BUNDLE;
+    NSString *resourcePath = [resourceBundle pathForResource:@"Untitled32" ofType:@"ptx" inDirectory:@"Resources"];
+    NSString *outPath = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+    XCTAssertTrue([[NSFileManager defaultManager] createFileAtPath:outPath contents:nil attributes:nil]);
+    NSFileHandle *outHandle = [NSFileHandle fileHandleForWritingAtPath:outPath];
+
+    NSError *error = nil;
+    XCTAssertTrue([ProToolsFormat unxorPath:resourcePath toFileDescriptor:[outHandle fileDescriptor] error:&error]);
+    XCTAssertNil(error);
+    [outHandle closeFile];
+
+    ProToolsFormat *ptFormat = [self loadAndCheck:@"Untitled32" ofType:@"ptx"];
+    XCTAssertEqualObjects([NSData dataWithContentsOfFile:outPath], [ptFormat unxoredData]);
+    [[NSFileManager defaultManager] removeItemAtPath:outPath error:nil];
+}
+
 - (void)testTempoTimeSigKeySig {
     ProToolsFormat *ptFormat = [self loadAndCheck:@"TempoTimeKeySig" ofType:@"ptx"];
 
@@ -113,6 +254,7 @@
     ];
 
     XCTAssertEqualObjects(keySigsActual, keySigsExpected);
+    XCTAssertEqual([[ptFormat blocksOfContentType:0x2432] count], [keySigsExpected count]);
 
     NSArray<PTTimeSignatureEv *> *timeSigsActual = [ptFormat timeSignatures];
     NSArray<PTTimeSignatureEv *> *timeSigsExpected = @[
@@ -272,6 +414,15 @@
     ProToolsFormat *ptFormat5 = [self loadAndCheck:@"DurationDetectTest" ofType:@"ptx"];
     XCTAssertEqual([ptFormat5 musicDurationSecsWithMaxGapSecs:6], 72);
     XCTAssertEqual([ptFormat5 musicDurationSecsWithMaxGapSecs:3], 48);
+    NSArray<NSNumber *> *durationsExpected = @[@72, @48];
+    XCTAssertEqualObjects([ptFormat5 musicDurationsSecsWithMaxGapsSecs:@[@6, @3]], durationsExpected);
+
+    NSArray<NSNumber *> *histogram = [ptFormat5 gapHistogramSecs];
+    NSUInteger gapsOver3Secs = 0;
+    for (NSUInteger i = 3; i < [histogram count]; i++) {
+        gapsOver3Secs += [histogram[i] unsignedIntegerValue];
+    }
+    XCTAssertGreaterThan(gapsOver3Secs, 0);
 }
 
 - (void)testMusicDuration2 {